@@ -0,0 +1,266 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ARENAMAP_H
+#define BITCOIN_ARENAMAP_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Hash map with an open-addressing index over entries allocated from an arena.
+ *
+ * Entries live in fixed-size chunks of CHUNK_NODES, so inserting costs no
+ * heap allocation of its own except once per chunk, and clear() releases the
+ * whole arena in one go. Erased entries go on a free list and are reused by
+ * later inserts. The index is a linear-probing table of (hash, entry number)
+ * pairs, so probing only touches an entry when the 32-bit hash matches.
+ *
+ * Differs from boost::unordered_map in that
+ * - references and pointers to entries stay valid across rehashes (entries
+ *   never move), but iterators do not, just like for unordered_map;
+ * - erasing leaves a tombstone in the index, so iterators other than the
+ *   erased one stay valid and erase(it++) works while iterating;
+ * - Hash only needs to yield 32 bits of entropy, and the map cannot hold more
+ *   than 2^32 - 2 entries.
+ */
+template <class K, class T, class Hash>
+class arenamap {
+public:
+    typedef K key_type;
+    typedef T mapped_type;
+    typedef std::pair<const K, T> value_type;
+    typedef size_t size_type;
+
+    static const uint32_t CHUNK_SHIFT = 6;
+    static const uint32_t CHUNK_NODES = 1 << CHUNK_SHIFT;
+
+    struct slot_type {
+        uint32_t hash;
+        uint32_t node;
+    };
+    typedef typename std::aligned_storage<sizeof(value_type), std::alignment_of<value_type>::value>::type node_type;
+    struct chunk_type {
+        node_type nodes[CHUNK_NODES];
+    };
+
+private:
+    static const uint32_t EMPTY = 0xFFFFFFFF;
+    static const uint32_t TOMBSTONE = 0xFFFFFFFE;
+
+    std::vector<slot_type> slots;
+    std::vector<chunk_type*> chunks;
+    //! Entries handed out from the arena so far, live or on the free list
+    uint32_t nNodesUsed;
+    //! Head of the list of erased entries, linked through their storage
+    uint32_t nFreeNode;
+    size_type nLive;
+    size_type nTombstones;
+    Hash hasher;
+
+    value_type& node(uint32_t n) const {
+        return *reinterpret_cast<value_type*>(&chunks[n >> CHUNK_SHIFT]->nodes[n & (CHUNK_NODES - 1)]);
+    }
+
+    uint32_t HashKey(const K& key) const { return (uint32_t)hasher(key); }
+
+    size_type Lookup(const K& key, uint32_t hash) const {
+        if (slots.empty())
+            return slots.size();
+        size_type mask = slots.size() - 1;
+        for (size_type pos = hash & mask; ; pos = (pos + 1) & mask) {
+            const slot_type& slot = slots[pos];
+            if (slot.node == EMPTY)
+                return slots.size();
+            if (slot.node != TOMBSTONE && slot.hash == hash && node(slot.node).first == key)
+                return pos;
+        }
+    }
+
+    uint32_t AllocateNode() {
+        if (nFreeNode != EMPTY) {
+            uint32_t n = nFreeNode;
+            memcpy(&nFreeNode, &node(n), sizeof(nFreeNode));
+            return n;
+        }
+        if (nNodesUsed == chunks.size() * CHUNK_NODES)
+            chunks.push_back(new chunk_type);
+        return nNodesUsed++;
+    }
+
+    void FreeNode(uint32_t n) {
+        value_type* p = &node(n);
+        p->~value_type();
+        memcpy(p, &nFreeNode, sizeof(nFreeNode));
+        nFreeNode = n;
+    }
+
+    /** Rebuild the index with nSlots slots, dropping all tombstones. */
+    void Rehash(size_type nSlots) {
+        std::vector<slot_type> old(nSlots, slot_type{0, EMPTY});
+        old.swap(slots);
+        size_type mask = nSlots - 1;
+        for (const slot_type& slot : old) {
+            if (slot.node == EMPTY || slot.node == TOMBSTONE)
+                continue;
+            size_type pos = slot.hash & mask;
+            while (slots[pos].node != EMPTY)
+                pos = (pos + 1) & mask;
+            slots[pos] = slot;
+        }
+        nTombstones = 0;
+    }
+
+    /** Find key, or add it with a default-constructed value. Returns the slot and whether it was added. */
+    std::pair<size_type, bool> InsertKey(const K& key) {
+        uint32_t hash = HashKey(key);
+        // Keep the index at most 3/4 full, counting tombstones, and grow it
+        // when live entries alone would fill more than half of it.
+        if ((nLive + nTombstones + 1) * 4 > slots.size() * 3) {
+            size_type nSlots = slots.empty() ? 16 : slots.size();
+            while ((nLive + 1) * 2 > nSlots)
+                nSlots *= 2;
+            Rehash(nSlots);
+        }
+        size_type mask = slots.size() - 1;
+        size_type posTombstone = slots.size();
+        size_type pos = hash & mask;
+        for (; slots[pos].node != EMPTY; pos = (pos + 1) & mask) {
+            const slot_type& slot = slots[pos];
+            if (slot.node == TOMBSTONE) {
+                if (posTombstone == slots.size())
+                    posTombstone = pos;
+            } else if (slot.hash == hash && node(slot.node).first == key) {
+                return std::make_pair(pos, false);
+            }
+        }
+        if (posTombstone != slots.size()) {
+            pos = posTombstone;
+            nTombstones--;
+        }
+        uint32_t n = AllocateNode();
+        new (&node(n)) value_type(key, T());
+        slots[pos].hash = hash;
+        slots[pos].node = n;
+        nLive++;
+        return std::make_pair(pos, true);
+    }
+
+    template <class M, class V>
+    class iterator_base : public std::iterator<std::forward_iterator_tag, V> {
+        friend class arenamap;
+        M* map;
+        size_type pos;
+
+        iterator_base(M* mapIn, size_type posIn) : map(mapIn), pos(posIn) {}
+        void SkipUnused() {
+            while (pos < map->slots.size() && (map->slots[pos].node == EMPTY || map->slots[pos].node == TOMBSTONE))
+                pos++;
+        }
+
+    public:
+        iterator_base() : map(nullptr), pos(0) {}
+        template <class M2, class V2>
+        iterator_base(const iterator_base<M2, V2>& other) : map(other.map), pos(other.pos) {}
+
+        V& operator*() const { return map->node(map->slots[pos].node); }
+        V* operator->() const { return &map->node(map->slots[pos].node); }
+        iterator_base& operator++() { pos++; SkipUnused(); return *this; }
+        iterator_base operator++(int) { iterator_base copy(*this); ++(*this); return copy; }
+        template <class M2, class V2>
+        bool operator==(const iterator_base<M2, V2>& other) const { return pos == other.pos; }
+        template <class M2, class V2>
+        bool operator!=(const iterator_base<M2, V2>& other) const { return pos != other.pos; }
+
+        template <class M2, class V2> friend class iterator_base;
+    };
+
+public:
+    typedef iterator_base<arenamap, value_type> iterator;
+    typedef iterator_base<const arenamap, const value_type> const_iterator;
+
+    arenamap() : nNodesUsed(0), nFreeNode(EMPTY), nLive(0), nTombstones(0) {}
+    ~arenamap() { clear(); }
+
+    arenamap(const arenamap&) = delete;
+    arenamap& operator=(const arenamap&) = delete;
+
+    template <class P>
+    std::pair<iterator, bool> insert(P&& value) {
+        std::pair<size_type, bool> ret = InsertKey(value.first);
+        if (ret.second)
+            node(slots[ret.first].node).second = std::forward<P>(value).second;
+        return std::make_pair(iterator(this, ret.first), ret.second);
+    }
+
+    T& operator[](const K& key) { return node(slots[InsertKey(key).first].node).second; }
+
+    iterator find(const K& key)             { return iterator(this, Lookup(key, HashKey(key))); }
+    const_iterator find(const K& key) const { return const_iterator(this, Lookup(key, HashKey(key))); }
+    size_type count(const K& key) const     { return Lookup(key, HashKey(key)) != slots.size(); }
+
+    iterator erase(iterator it) {
+        FreeNode(slots[it.pos].node);
+        slots[it.pos].node = TOMBSTONE;
+        nLive--;
+        nTombstones++;
+        return ++it;
+    }
+
+    size_type erase(const K& key) {
+        size_type pos = Lookup(key, HashKey(key));
+        if (pos == slots.size())
+            return 0;
+        erase(iterator(this, pos));
+        return 1;
+    }
+
+    void swap(arenamap& other) {
+        slots.swap(other.slots);
+        chunks.swap(other.chunks);
+        std::swap(nNodesUsed, other.nNodesUsed);
+        std::swap(nFreeNode, other.nFreeNode);
+        std::swap(nLive, other.nLive);
+        std::swap(nTombstones, other.nTombstones);
+        std::swap(hasher, other.hasher);
+    }
+
+    /** Destroy all entries and return the whole arena and index to the heap. */
+    void clear() {
+        for (const slot_type& slot : slots) {
+            if (slot.node != EMPTY && slot.node != TOMBSTONE)
+                node(slot.node).~value_type();
+        }
+        for (chunk_type* chunk : chunks)
+            delete chunk;
+        std::vector<slot_type>().swap(slots);
+        std::vector<chunk_type*>().swap(chunks);
+        nNodesUsed = 0;
+        nFreeNode = EMPTY;
+        nLive = 0;
+        nTombstones = 0;
+    }
+
+    bool empty() const        { return nLive == 0; }
+    size_type size() const    { return nLive; }
+
+    iterator begin()              { iterator it(this, 0); it.SkipUnused(); return it; }
+    iterator end()                { return iterator(this, slots.size()); }
+    const_iterator begin() const  { const_iterator it(this, 0); it.SkipUnused(); return it; }
+    const_iterator end() const    { return const_iterator(this, slots.size()); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const   { return end(); }
+
+    // For memory usage accounting
+    size_type bucket_count() const   { return slots.size(); }
+    size_type chunk_count() const    { return chunks.size(); }
+    size_type chunk_capacity() const { return chunks.capacity(); }
+};
+
+#endif // BITCOIN_ARENAMAP_H
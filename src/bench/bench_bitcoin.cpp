@@ -4,16 +4,20 @@
 
 #include "bench.h"
 
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
+#include "script/sigcache.h"
 #include "util.h"
 
 int
 main(int argc, char** argv)
 {
+    SHA256AutoDetect();
     ECC_Start();
     SetupEnvironment();
     fPrintToDebugLog = false; // don't want to write to debug.log file
+    InitSignatureCache();
 
     benchmark::BenchRunner::RunAll();
 
@@ -0,0 +1,40 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench_util.h"
+
+#include "chainparams.h"
+#include "random.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <limits>
+
+TempDatadir::TempDatadir()
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    ClearDatadirCache();
+    pathTemp = boost::filesystem::temp_directory_path() / strprintf("bench_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+}
+
+TempDatadir::~TempDatadir()
+{
+    boost::filesystem::remove_all(pathTemp);
+    mapArgs.erase("-datadir");
+    ClearDatadirCache();
+}
+
+void AddToMempool(CTxMemPool& pool, const CTransaction& tx, CAmount nFee, int64_t nTime)
+{
+    LockPoints lp;
+    CTxMemPoolEntry entry(tx, nFee, nTime, 0.0, 1, pool.HasNoInputsOf(tx), 0, false, 4, lp);
+    CTxMemPool::setEntries setAncestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    pool.CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+    pool.addUnchecked(tx.GetHash(), entry, setAncestors, false);
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_UTIL_H
+#define BITCOIN_BENCH_BENCH_UTIL_H
+
+#include "amount.h"
+
+#include <stdint.h>
+
+#include <boost/filesystem.hpp>
+
+class CTransaction;
+class CTxMemPool;
+
+/**
+ * Selects the regtest parameters and points -datadir at a fresh temporary
+ * directory for as long as it lives, for benchmarks that need databases on
+ * disk. The directory is removed again when it goes out of scope.
+ */
+class TempDatadir
+{
+    boost::filesystem::path pathTemp;
+
+public:
+    TempDatadir();
+    ~TempDatadir();
+};
+
+/**
+ * Add a transaction to the pool the way AcceptToMemoryPool does once it has
+ * decided to accept it: work out its in-mempool ancestors, then add it with
+ * them.
+ */
+void AddToMempool(CTxMemPool& pool, const CTransaction& tx, CAmount nFee = 1000, int64_t nTime = 0);
+
+#endif // BITCOIN_BENCH_BENCH_UTIL_H
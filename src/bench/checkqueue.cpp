@@ -0,0 +1,109 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "checkqueue.h"
+#include "key.h"
+#include "keystore.h"
+#include "pubkey.h"
+#include "main.h"
+#include "policy/policy.h"
+#include "script/sign.h"
+#include "script/standard.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace {
+
+//! Transactions per block, and inputs per transaction
+static const int NUM_TXS = 100;
+static const int INPUTS_PER_TX = 2;
+
+/** Block's worth of transactions spending signed pay-to-pubkey-hash outputs. */
+class SignedTransactions
+{
+public:
+    CScript scriptPubKey;
+    std::vector<CTransaction> vtx;
+    std::vector<PrecomputedTransactionData> txdata;
+
+    SignedTransactions()
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        CBasicKeyStore keystore;
+        keystore.AddKey(key);
+        scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        for (int i = 0; i < NUM_TXS; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(INPUTS_PER_TX);
+            for (int j = 0; j < INPUTS_PER_TX; j++) {
+                tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+            }
+            tx.vout.resize(1);
+            tx.vout[0].nValue = INPUTS_PER_TX * COIN;
+            tx.vout[0].scriptPubKey = scriptPubKey;
+            for (int j = 0; j < INPUTS_PER_TX; j++) {
+                bool fSigned = SignSignature(keystore, scriptPubKey, tx, j, COIN, SIGHASH_ALL);
+                assert(fSigned);
+            }
+            vtx.push_back(tx);
+        }
+        for (const CTransaction& tx : vtx)
+            txdata.emplace_back(tx);
+    }
+};
+
+}
+
+// Verifies the signatures of a block with nThreads threads (including the
+// one adding the checks), handing the checks over per transaction like
+// ConnectBlock does.
+static void CheckQueueScripts(benchmark::State& state, int nThreads)
+{
+    ECCVerifyHandle verifyHandle;
+    static SignedTransactions txs;
+    const CTxOut txout(COIN, txs.scriptPubKey);
+
+    CCheckQueue<CScriptCheck> queue(DEFAULT_SCRIPTCHECK_BATCH_SIZE);
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads - 1; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, &queue));
+
+    while (state.KeepRunning()) {
+        CCheckQueueControl<CScriptCheck> control(&queue, DEFAULT_SCRIPTCHECK_BATCH_SIZE);
+        for (unsigned int i = 0; i < txs.vtx.size(); i++) {
+            std::vector<CScriptCheck> vChecks;
+            for (unsigned int j = 0; j < txs.vtx[i].vin.size(); j++) {
+                // Not stored in the signature cache, so every round verifies
+                vChecks.push_back(CScriptCheck(txout, txs.vtx[i], j, STANDARD_SCRIPT_VERIFY_FLAGS, false, &txs.txdata[i]));
+            }
+            control.Add(vChecks);
+        }
+        bool fOk = control.Wait();
+        assert(fOk);
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+static void CheckQueueScripts_1Thread(benchmark::State& state) { CheckQueueScripts(state, 1); }
+static void CheckQueueScripts_2Threads(benchmark::State& state) { CheckQueueScripts(state, 2); }
+static void CheckQueueScripts_4Threads(benchmark::State& state) { CheckQueueScripts(state, 4); }
+static void CheckQueueScripts_8Threads(benchmark::State& state) { CheckQueueScripts(state, 8); }
+static void CheckQueueScripts_16Threads(benchmark::State& state) { CheckQueueScripts(state, 16); }
+static void CheckQueueScripts_32Threads(benchmark::State& state) { CheckQueueScripts(state, 32); }
+static void CheckQueueScripts_64Threads(benchmark::State& state) { CheckQueueScripts(state, 64); }
+
+BENCHMARK(CheckQueueScripts_1Thread);
+BENCHMARK(CheckQueueScripts_2Threads);
+BENCHMARK(CheckQueueScripts_4Threads);
+BENCHMARK(CheckQueueScripts_8Threads);
+BENCHMARK(CheckQueueScripts_16Threads);
+BENCHMARK(CheckQueueScripts_32Threads);
+BENCHMARK(CheckQueueScripts_64Threads);
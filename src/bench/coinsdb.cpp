@@ -0,0 +1,109 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bench_util.h"
+
+#include "chainparams.h"
+#include "coins.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+namespace {
+
+static const unsigned int COINSDB_TRANSACTIONS = 20000;
+static const unsigned int COINSDB_OUTPUTS = 10;
+static const unsigned int COINSDB_LOOKUPS = 100000;
+static const unsigned int LOOKUPS_PER_RUN = 100;
+
+}
+
+// Looks up coins in a chain state database of 200000 outputs, compacted and
+// with a small cache, so that most reads go to the table files. Half of the
+// lookups are of coins that do not exist, which is where the bloom filters
+// come in.
+static void CoinsDBGetCoin(benchmark::State& state, const CDBOptions& dbOptions)
+{
+    TempDatadir datadir;
+    std::vector<COutPoint> vLookups;
+    vLookups.reserve(COINSDB_LOOKUPS);
+    CCoinsViewDB db(1 << 20, false, true, dbOptions);
+    std::vector<uint256> vTxids;
+    {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 0; i < COINSDB_TRANSACTIONS; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vout.resize(COINSDB_OUTPUTS);
+            for (CTxOut& txout : tx.vout) {
+                txout.nValue = COIN;
+                txout.scriptPubKey = CScript() << OP_TRUE;
+            }
+            CTransaction txNew(tx);
+            AddCoins(cache, txNew, 1);
+            vTxids.push_back(txNew.GetHash());
+        }
+        cache.SetBestBlock(GetRandHash());
+        cache.Flush();
+    }
+    db.CompactRawRange(NULL, NULL);
+
+    for (unsigned int i = 0; i < COINSDB_LOOKUPS; i++) {
+        if (i % 2)
+            vLookups.push_back(COutPoint(vTxids[GetRand(vTxids.size())], GetRand(COINSDB_OUTPUTS)));
+        else
+            vLookups.push_back(COutPoint(GetRandHash(), 0));
+    }
+
+    unsigned int nLookup = 0;
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < LOOKUPS_PER_RUN; i++) {
+            Coin coin;
+            bool fFound = db.GetCoin(vLookups[nLookup], coin);
+            assert(fFound == (nLookup % 2 == 1));
+            nLookup = (nLookup + 1) % COINSDB_LOOKUPS;
+        }
+    }
+}
+
+static void CoinsDBGetCoin_Default(benchmark::State& state)
+{
+    CoinsDBGetCoin(state, CDBOptions());
+}
+
+static void CoinsDBGetCoin_NoBloom(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.nBloomBits = 0;
+    CoinsDBGetCoin(state, dbOptions);
+}
+
+static void CoinsDBGetCoin_1KBBlocks(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.nBlockSize = 1 << 10;
+    CoinsDBGetCoin(state, dbOptions);
+}
+
+static void CoinsDBGetCoin_64KBBlocks(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.nBlockSize = 64 << 10;
+    CoinsDBGetCoin(state, dbOptions);
+}
+
+static void CoinsDBGetCoin_Compression(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.fCompression = true;
+    CoinsDBGetCoin(state, dbOptions);
+}
+
+BENCHMARK(CoinsDBGetCoin_Default);
+BENCHMARK(CoinsDBGetCoin_NoBloom);
+BENCHMARK(CoinsDBGetCoin_1KBBlocks);
+BENCHMARK(CoinsDBGetCoin_64KBBlocks);
+BENCHMARK(CoinsDBGetCoin_Compression);
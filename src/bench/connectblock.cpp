@@ -0,0 +1,146 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bench_util.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+namespace {
+
+//! Outputs created up front; each block spends SPENDS_PER_BLOCK of them
+static const unsigned int FANOUT_OUTPUTS = 100000;
+static const unsigned int SPENDS_PER_BLOCK = 100;
+
+/** Coin database and tip cache holding transactions with nOutputs outputs each. */
+class FanOutChainState
+{
+    TempDatadir datadir;
+
+public:
+    unsigned int nOutputs;
+    std::vector<uint256> vTxids;
+    CCoinsViewDB* pdb;
+    CCoinsViewCache* ptip;
+    CBlockIndex indexPrev;
+    uint256 hashPrev;
+
+    FanOutChainState(unsigned int nOutputsIn) : nOutputs(nOutputsIn), pdb(NULL), ptip(NULL)
+    {
+        // Spend heights are looked up by the view's best block
+        hashPrev = GetRandHash();
+        indexPrev.phashBlock = &mapBlockIndex.insert(std::make_pair(hashPrev, &indexPrev)).first->first;
+        indexPrev.nHeight = 0;
+        indexPrev.nTime = Params().GenesisBlock().nTime;
+        Reset();
+    }
+
+    ~FanOutChainState()
+    {
+        delete ptip;
+        delete pdb;
+        mapBlockIndex.erase(hashPrev);
+    }
+
+    /** Start over with all fan-out outputs unspent and on disk. */
+    void Reset()
+    {
+        delete ptip;
+        delete pdb;
+        pdb = new CCoinsViewDB(1 << 23, true, true);
+        ptip = new CCoinsViewCache(pdb);
+        vTxids.clear();
+        for (unsigned int i = 0; i < FANOUT_OUTPUTS / nOutputs; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vout.resize(nOutputs);
+            for (CTxOut& txout : tx.vout) {
+                txout.nValue = COIN;
+                txout.scriptPubKey = CScript() << OP_TRUE;
+            }
+            CTransaction txFanOut(tx);
+            AddCoins(*ptip, txFanOut, 0);
+            vTxids.push_back(txFanOut.GetHash());
+        }
+        ptip->SetBestBlock(hashPrev);
+        ptip->Flush();
+    }
+};
+
+/** Block spending output n of SPENDS_PER_BLOCK fan-out transactions, starting at transaction nFirst. */
+CBlock SpendingBlock(const FanOutChainState& chainstate, unsigned int nFirst, unsigned int n, int nBlock)
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.hashPrevBlock = chainstate.hashPrev;
+    block.nTime = chainstate.indexPrev.nTime + 1;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << nBlock << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 0;
+    coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(coinbase);
+
+    for (unsigned int i = nFirst; i < nFirst + SPENDS_PER_BLOCK; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(chainstate.vTxids[i], n);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+}
+
+// Connects blocks that each spend one output of 100 transactions with many
+// outputs, and flushes the result to the coin database after every block, so
+// the database cost of spending single outputs of large transactions shows.
+static void ConnectBlockFanOut(benchmark::State& state, unsigned int nOutputs)
+{
+    FanOutChainState chainstate(nOutputs);
+    const unsigned int nTxGroups = chainstate.vTxids.size() / SPENDS_PER_BLOCK;
+    const unsigned int nBlocks = nTxGroups * nOutputs;
+
+    int nBlock = 0;
+    while (state.KeepRunning()) {
+        if ((unsigned int)nBlock == nBlocks) {
+            chainstate.Reset();
+            nBlock = 0;
+        }
+        CBlock block = SpendingBlock(chainstate, (nBlock % nTxGroups) * SPENDS_PER_BLOCK, nBlock / nTxGroups, nBlock);
+        CBlockIndex index;
+        index.pprev = &chainstate.indexPrev;
+        index.nHeight = 1;
+        index.nTime = block.nTime;
+
+        LOCK(cs_main);
+        CValidationState validationState;
+        CCoinsViewCache view(chainstate.ptip);
+        // Just checking leaves out the undo data and block index, but does
+        // all the coin database work of connecting.
+        bool fConnected = ConnectBlock(block, validationState, &index, view, Params(), true);
+        assert(fConnected);
+        view.Flush();
+        chainstate.ptip->Flush();
+        nBlock++;
+    }
+}
+
+static void ConnectBlockFanOut_10Outputs(benchmark::State& state) { ConnectBlockFanOut(state, 10); }
+static void ConnectBlockFanOut_1000Outputs(benchmark::State& state) { ConnectBlockFanOut(state, 1000); }
+
+BENCHMARK(ConnectBlockFanOut_10Outputs);
+BENCHMARK(ConnectBlockFanOut_1000Outputs);
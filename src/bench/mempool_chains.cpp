@@ -0,0 +1,88 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bench_util.h"
+
+#include "policy/policy.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <list>
+#include <vector>
+
+namespace {
+
+static const unsigned int CHAIN_LENGTH = 25;
+// How many of the chain's transactions the reorged block had confirmed.
+static const unsigned int CHAIN_CONFIRMED = 12;
+
+}
+
+// A chain of transactions, each spending the only output of the one before.
+static std::vector<CTransaction> MakeChain()
+{
+    std::vector<CTransaction> vChain;
+    uint256 hashPrev = GetRandHash();
+    for (unsigned int i = 0; i < CHAIN_LENGTH; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(hashPrev, 0);
+        tx.vin[0].scriptSig = CScript() << OP_TRUE;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[0].nValue = (CHAIN_LENGTH - i) * COIN;
+        vChain.push_back(CTransaction(tx));
+        hashPrev = vChain.back().GetHash();
+    }
+    return vChain;
+}
+
+// Accepts a 25-deep chain into the mempool, one transaction at a time, and
+// mines it again. Every acceptance walks all of the new entry's ancestors.
+static void MempoolAcceptChain(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<CTransaction> vChain = MakeChain();
+    std::list<CTransaction> conflicts;
+
+    LOCK(pool.cs);
+    while (state.KeepRunning()) {
+        for (const CTransaction& tx : vChain)
+            AddToMempool(pool, tx);
+        pool.removeForBlock(vChain, 1, conflicts, false);
+    }
+    assert(pool.size() == 0);
+}
+
+// Disconnects a block that confirmed the first 12 transactions of a 25-deep
+// chain whose other 13 are in the mempool: the block's transactions are put
+// back and UpdateTransactionsFromBlock links them up with their descendants.
+// Connecting the block again takes them back out.
+static void MempoolReorgChain(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<CTransaction> vChain = MakeChain();
+    std::vector<CTransaction> vBlock(vChain.begin(), vChain.begin() + CHAIN_CONFIRMED);
+    std::vector<uint256> vHashUpdate;
+    for (const CTransaction& tx : vBlock)
+        vHashUpdate.push_back(tx.GetHash());
+    std::list<CTransaction> conflicts;
+
+    LOCK(pool.cs);
+    for (const CTransaction& tx : vChain)
+        AddToMempool(pool, tx);
+    pool.removeForBlock(vBlock, 1, conflicts, false);
+
+    while (state.KeepRunning()) {
+        for (const CTransaction& tx : vBlock)
+            AddToMempool(pool, tx);
+        pool.UpdateTransactionsFromBlock(vHashUpdate);
+        pool.removeForBlock(vBlock, 1, conflicts, false);
+    }
+    assert(pool.size() == CHAIN_LENGTH - CHAIN_CONFIRMED);
+}
+
+BENCHMARK(MempoolAcceptChain);
+BENCHMARK(MempoolReorgChain);
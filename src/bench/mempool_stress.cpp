@@ -0,0 +1,82 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bench_util.h"
+
+#include "policy/policy.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <list>
+#include <vector>
+
+namespace {
+
+static const unsigned int STRESS_TRANSACTIONS = 500;
+static const unsigned int STRESS_OUTPUTS = 2;
+// How many of the oldest transactions get mined on each run.
+static const unsigned int STRESS_BLOCK_TRANSACTIONS = 50;
+
+struct StressTx
+{
+    CTransaction tx;
+    CAmount nFee;
+};
+
+}
+
+// Churns a mempool of 500 transactions that spend each other's outputs at
+// random: they are all accepted, a quarter of the pool is trimmed away, a
+// block mines the oldest ones and the rest expires. Every step walks the
+// transaction graph, for ancestors when accepting and for descendants when
+// evicting, mining and expiring.
+static void MempoolStress(benchmark::State& state)
+{
+    seed_insecure_rand(true);
+    std::vector<StressTx> vTxs;
+    std::vector<COutPoint> vUnspent;
+    for (unsigned int i = 0; i < STRESS_TRANSACTIONS; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1 + insecure_rand() % 2);
+        for (CTxIn& txin : tx.vin) {
+            if (vUnspent.empty() || insecure_rand() % 4 == 0) {
+                txin.prevout = COutPoint(GetRandHash(), 0);
+            } else {
+                unsigned int n = insecure_rand() % vUnspent.size();
+                txin.prevout = vUnspent[n];
+                vUnspent[n] = vUnspent.back();
+                vUnspent.pop_back();
+            }
+            txin.scriptSig = CScript() << OP_TRUE;
+        }
+        tx.vout.resize(STRESS_OUTPUTS);
+        for (CTxOut& txout : tx.vout) {
+            txout.scriptPubKey = CScript() << OP_TRUE;
+            txout.nValue = COIN;
+        }
+        StressTx stx = { CTransaction(tx), 1000 + insecure_rand() % 9000 };
+        for (unsigned int n = 0; n < STRESS_OUTPUTS; n++)
+            vUnspent.push_back(COutPoint(stx.tx.GetHash(), n));
+        vTxs.push_back(stx);
+    }
+    std::vector<CTransaction> vBlock;
+    for (unsigned int i = 0; i < STRESS_BLOCK_TRANSACTIONS; i++)
+        vBlock.push_back(vTxs[i].tx);
+
+    CTxMemPool pool(CFeeRate(0));
+    std::list<CTransaction> conflicts;
+    LOCK(pool.cs);
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < vTxs.size(); i++)
+            AddToMempool(pool, vTxs[i].tx, vTxs[i].nFee, i);
+        pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4);
+        pool.removeForBlock(vBlock, 1, conflicts, false);
+        pool.Expire(STRESS_TRANSACTIONS / 2);
+        pool.Expire(STRESS_TRANSACTIONS);
+        assert(pool.size() == 0);
+    }
+}
+
+BENCHMARK(MempoolStress);
@@ -0,0 +1,31 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "uint256.h"
+#include "random.h"
+#include "consensus/merkle.h"
+
+static void MerkleRoot(benchmark::State& state, size_t nLeaves)
+{
+    std::vector<uint256> leaves;
+    leaves.resize(nLeaves);
+    for (size_t s = 0; s < nLeaves; s++) {
+        leaves[s] = GetRandHash();
+    }
+    while (state.KeepRunning()) {
+        bool mutation = false;
+        uint256 hash = ComputeMerkleRoot(leaves, &mutation);
+        leaves[mutation] = hash;
+    }
+}
+
+static void MerkleRoot_2000(benchmark::State& state) { MerkleRoot(state, 2000); }
+static void MerkleRoot_10000(benchmark::State& state) { MerkleRoot(state, 10000); }
+static void MerkleRoot_50000(benchmark::State& state) { MerkleRoot(state, 50000); }
+
+BENCHMARK(MerkleRoot_2000);
+BENCHMARK(MerkleRoot_10000);
+BENCHMARK(MerkleRoot_50000);
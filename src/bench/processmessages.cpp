@@ -0,0 +1,155 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bench_util.h"
+
+#include "chainparams.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+
+namespace {
+
+/** Regtest chain state holding just the genesis block, set up like the unit tests do. */
+class GenesisChainState
+{
+    TempDatadir datadir;
+    CCoinsViewDB* pcoinsdbview;
+
+public:
+    GenesisChainState()
+    {
+        pblocktree = new CBlockTreeDB(1 << 20, true);
+        pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        InitBlockIndex(Params());
+        RegisterNodeSignals(GetNodeSignals());
+    }
+
+    ~GenesisChainState()
+    {
+        UnregisterNodeSignals(GetNodeSignals());
+        UnloadBlockIndex();
+        delete pcoinsTip;
+        pcoinsTip = NULL;
+        delete pcoinsdbview;
+        delete pblocktree;
+        pblocktree = NULL;
+    }
+};
+
+/** Append a message to vStream the way it arrives from the network. */
+template<typename T>
+void AppendMessage(std::vector<char>& vStream, const char* pszCommand, const T& obj)
+{
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << obj;
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    hdr.nChecksum = ReadLE32(hash.begin());
+    CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+    ssMessage << hdr;
+    vStream.insert(vStream.end(), ssMessage.begin(), ssMessage.end());
+    vStream.insert(vStream.end(), ssPayload.begin(), ssPayload.end());
+}
+
+/** A relayed transaction with two inputs and two P2PKH outputs. Its inputs are
+    unknown, so it ends up in the orphan pool like most of a fresh node's relay traffic. */
+CTransaction RelayedTransaction()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(2);
+    for (CTxIn& txin : tx.vin) {
+        txin.prevout = COutPoint(GetRandHash(), 0);
+        std::vector<unsigned char> vchSig(72), vchPubKey(33);
+        GetRandBytes(vchSig.data(), vchSig.size());
+        GetRandBytes(vchPubKey.data(), vchPubKey.size());
+        txin.scriptSig = CScript() << vchSig << vchPubKey;
+    }
+    tx.vout.resize(2);
+    for (CTxOut& txout : tx.vout) {
+        std::vector<unsigned char> vchKeyID(20);
+        GetRandBytes(vchKeyID.data(), vchKeyID.size());
+        txout.nValue = COIN;
+        txout.scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vchKeyID << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return tx;
+}
+
+/** Feed the message streams of the peers assigned to worker nWorker (keyed by
+    peer, like the message handler threads) and process them to the end. */
+void ReplayWorker(const std::vector<CNode*>& vPeers, const std::vector<std::vector<char> >& vStreams, int nWorker, int nWorkers)
+{
+    for (size_t i = nWorker; i < vPeers.size(); i += nWorkers) {
+        LOCK(vPeers[i]->cs_vRecvMsg);
+        vPeers[i]->ReceiveMsgBytes(vStreams[i].data(), vStreams[i].size());
+    }
+    bool fMore = true;
+    while (fMore) {
+        fMore = false;
+        for (size_t i = nWorker; i < vPeers.size(); i += nWorkers) {
+            LOCK(vPeers[i]->cs_vRecvMsg);
+            ProcessMessages(vPeers[i]);
+            fMore |= !vPeers[i]->vRecvMsg.empty() && !vPeers[i]->fDisconnect;
+        }
+    }
+}
+
+}
+
+// Feeds 16 peers 100 tx messages each through ProcessMessages, with the peers
+// spread over a varying number of message handler threads. The transactions
+// are made up by the bench rather than captured from a live node: random
+// P2PKH spends of unknown outputs, so they end up as orphans the way much of
+// a fresh node's relay traffic does. Every run replays the same streams.
+static void ProcessMessagesReplay(benchmark::State& state, int nThreads)
+{
+    GenesisChainState chainstate;
+
+    const int nPeers = 16;
+    const int nTxPerPeer = 100;
+    std::vector<std::vector<char> > vStreams(nPeers);
+    for (int i = 0; i < nPeers; i++) {
+        for (int j = 0; j < nTxPerPeer; j++) {
+            AppendMessage(vStreams[i], NetMsgType::TX, RelayedTransaction());
+        }
+    }
+
+    while (state.KeepRunning()) {
+        std::vector<CNode*> vPeers;
+        for (int i = 0; i < nPeers; i++) {
+            CNode* pnode = new CNode(INVALID_SOCKET, CAddress(), "", true);
+            pnode->nVersion = PROTOCOL_VERSION;
+            pnode->SetRecvVersion(PROTOCOL_VERSION);
+            pnode->fSuccessfullyConnected = true;
+            vPeers.push_back(pnode);
+        }
+
+        boost::thread_group workers;
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&ReplayWorker, boost::cref(vPeers), boost::cref(vStreams), i, nThreads));
+        workers.join_all();
+
+        // Also drops their orphans again
+        for (CNode* pnode : vPeers)
+            delete pnode;
+    }
+}
+
+static void ProcessMessagesReplay_1Thread(benchmark::State& state) { ProcessMessagesReplay(state, 1); }
+static void ProcessMessagesReplay_2Threads(benchmark::State& state) { ProcessMessagesReplay(state, 2); }
+static void ProcessMessagesReplay_4Threads(benchmark::State& state) { ProcessMessagesReplay(state, 4); }
+static void ProcessMessagesReplay_8Threads(benchmark::State& state) { ProcessMessagesReplay(state, 8); }
+
+BENCHMARK(ProcessMessagesReplay_1Thread);
+BENCHMARK(ProcessMessagesReplay_2Threads);
+BENCHMARK(ProcessMessagesReplay_4Threads);
+BENCHMARK(ProcessMessagesReplay_8Threads);
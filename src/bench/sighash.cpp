@@ -0,0 +1,61 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "amount.h"
+#include "arith_uint256.h"
+#include "primitives/transaction.h"
+#include "script/interpreter.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <vector>
+
+/* Number of inputs of the consolidation transaction being hashed */
+static const int NUM_INPUTS = 1000;
+
+// A transaction spending NUM_INPUTS segwit v0 outputs into a single output,
+// the worst case for per-input BIP143 hashing.
+static CTransaction MakeConsolidationTx(CScript& scriptCode)
+{
+    scriptCode = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x42) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    CMutableTransaction tx;
+    tx.vin.resize(NUM_INPUTS);
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        tx.vin[i].prevout.hash = ArithToUint256(arith_uint256(i + 1));
+        tx.vin[i].prevout.n = i % 4;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = NUM_INPUTS * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_0 << std::vector<unsigned char>(20, 0x42);
+    return tx;
+}
+
+// Signature hashes for every input, recomputing the transaction-wide hashes each time
+static void SigHashWitnessV0_1000Inputs(benchmark::State& state)
+{
+    CScript scriptCode;
+    const CTransaction tx = MakeConsolidationTx(scriptCode);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < NUM_INPUTS; i++)
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL, COIN, SIGVERSION_WITNESS_V0);
+    }
+}
+
+// Signature hashes for every input, sharing one PrecomputedTransactionData as CheckInputs does
+static void SigHashWitnessV0_1000Inputs_Precomputed(benchmark::State& state)
+{
+    CScript scriptCode;
+    const CTransaction tx = MakeConsolidationTx(scriptCode);
+    while (state.KeepRunning()) {
+        PrecomputedTransactionData txdata(tx);
+        for (int i = 0; i < NUM_INPUTS; i++)
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL, COIN, SIGVERSION_WITNESS_V0, &txdata);
+    }
+}
+
+BENCHMARK(SigHashWitnessV0_1000Inputs);
+BENCHMARK(SigHashWitnessV0_1000Inputs_Precomputed);
@@ -6,6 +6,9 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -16,7 +19,7 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -25,12 +28,37 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread has a deque of its own, and the master spreads the checks
+  * it adds over all of them. A thread takes its work from the back of its
+  * own deque, and when that is empty steals from the front of another
+  * thread's. The deques have a lock each, so threads only contend when
+  * they touch the same deque, which is rare while all of them have work.
+  * The shared lock is only taken to go to sleep and to wake sleepers up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    //! Checks waiting to be taken by a thread
+    struct WorkQueue {
+        boost::mutex mutex;
+        std::deque<T> checks;
+    };
+
+    //! The maximum number of threads, including the master
+    static const unsigned int MAX_THREADS = 128;
+
+    //! A deque per thread; the first one is the master's
+    std::unique_ptr<WorkQueue[]> queues;
+
+    //! The number of deques handed out to threads so far
+    std::atomic<unsigned int> nQueues;
+
+    //! The deque the next batch of checks is added to (only used by the master)
+    unsigned int nNextQueue;
+
+    //! Mutex to protect going to sleep and waking up
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,139 +67,187 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
     //! The number of workers (including the master) that are idle.
     int nIdle;
 
-    //! The total number of workers (including the master).
-    int nTotal;
-
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! The number of checks in the deques, not yet taken by any thread.
+    std::atomic<unsigned int> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! The temporary evaluation result.
+    std::atomic<bool> fAllOk;
 
     //! The maximum number of elements to be processed in one batch
-    unsigned int nBatchSize;
+    std::atomic<unsigned int> nBatchSize;
+
+    //! Mutex to ensure only one concurrent CCheckQueueControl
+    boost::mutex ControlMutex;
+
+    friend class CCheckQueueControl<T>;
+
+    /**
+     * Take a batch of checks, from the back of our own deque or else from the
+     * front of another thread's. Take half of what is there, up to
+     * nBatchSize, so whoever comes next still finds something.
+     */
+    bool Take(unsigned int nSelf, std::vector<T>& vChecks)
+    {
+        unsigned int n = nQueues.load();
+        for (unsigned int i = 0; i < n; i++) {
+            WorkQueue& queue = queues[(nSelf + i) % n];
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            if (queue.checks.empty())
+                continue;
+            unsigned int nNow = std::max(1U, std::min(nBatchSize.load(), (unsigned int)queue.checks.size() / 2));
+            vChecks.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                // Swap jobs out of the deque instead of copying, to keep the lock short
+                if (i == 0) {
+                    vChecks[j].swap(queue.checks.back());
+                    queue.checks.pop_back();
+                } else {
+                    vChecks[j].swap(queue.checks.front());
+                    queue.checks.pop_front();
+                }
+            }
+            nQueued -= nNow;
+            return true;
+        }
+        return false;
+    }
 
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nSelf, bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
+            if (nQueued.load() > 0 && Take(nSelf, vChecks)) {
                 // Check whether we need to do work at all
-                fOk = fAllOk;
+                bool fOk = fAllOk.load();
+                // execute work
+                BOOST_FOREACH (T& check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                if (!fOk)
+                    fAllOk = false;
+                unsigned int nNow = vChecks.size();
+                vChecks.clear();
+                if (nTodo.fetch_sub(nNow) == nNow && !fMaster) {
+                    // We processed the last element; inform the master it can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    condMaster.notify_one();
+                }
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster && nTodo.load() == 0) {
+                bool fRet = fAllOk.load();
+                // reset the status for new work later
+                fAllOk = true;
+                // return the current status
+                return fRet;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            // Checks added after we looked, but before we took the lock
+            if (nQueued.load() > 0)
+                continue;
+            nIdle++;
+            cond.wait(lock); // wait
+            nIdle--;
         } while (true);
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn) : queues(new WorkQueue[MAX_THREADS]), nQueues(1), nNextQueue(0), nIdle(0), nQueued(0), nTodo(0), fAllOk(true), nBatchSize(std::max(1U, nBatchSizeIn)) {}
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        unsigned int nSelf = nQueues.fetch_add(1);
+        assert(nSelf < MAX_THREADS);
+        Loop(nSelf);
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
+        // Count the checks before they can be taken, so the counters never
+        // drop below what is actually left.
         nTodo += vChecks.size();
+        nQueued += vChecks.size();
+
+        // Spread them over all threads' deques, in batches.
+        unsigned int n = nQueues.load();
+        size_t nPerQueue = std::max((size_t)1, std::min((size_t)nBatchSize.load(), (vChecks.size() + n - 1) / n));
+        for (size_t i = 0; i < vChecks.size(); i += nPerQueue) {
+            WorkQueue& queue = queues[nNextQueue % n];
+            nNextQueue = (nNextQueue + 1) % n;
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            for (size_t j = i; j < std::min(vChecks.size(), i + nPerQueue); j++) {
+                queue.checks.push_back(T());
+                vChecks[j].swap(queue.checks.back());
+            }
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nIdle == 0)
+            return;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
+    //! Change the maximum batch size
+    void SetBatchSize(unsigned int nBatchSizeIn)
+    {
+        nBatchSize = std::max(1U, nBatchSizeIn);
+    }
+
+    unsigned int GetBatchSize()
+    {
+        return nBatchSize;
+    }
+
     ~CCheckQueue()
     {
     }
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo.load() == 0 && fAllOk.load() == true);
     }
 
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
+ *
+ * With nFlushSize set, checks added are collected and only handed to the
+ * queue once there are at least that many, so that a producer adding a few
+ * checks at a time takes the queue's locks (and wakes up the workers) once
+ * per batch instead of once per Add.
+ *
+ * Only one controller can use a queue at a time; others block until it is
+ * done.
  */
 template <typename T>
 class CCheckQueueControl
@@ -179,14 +255,28 @@ class CCheckQueueControl
 private:
     CCheckQueue<T>* pqueue;
     bool fDone;
+    unsigned int nFlushSize;
+    std::vector<T> vPending;
+    boost::unique_lock<boost::mutex> lockControl;
+
+    void Flush()
+    {
+        if (!vPending.empty()) {
+            pqueue->Add(vPending);
+            vPending.clear();
+        }
+    }
 
 public:
-    CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
+    CCheckQueueControl(CCheckQueue<T>* pqueueIn, unsigned int nFlushSizeIn = 0) : pqueue(pqueueIn), fDone(false), nFlushSize(nFlushSizeIn)
     {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
+            // Only one thread at a time can be the queue's master
+            lockControl = boost::unique_lock<boost::mutex>(pqueue->ControlMutex);
             bool isIdle = pqueue->IsIdle();
             assert(isIdle);
+            vPending.reserve(nFlushSize);
         }
     }
 
@@ -194,6 +284,7 @@ public:
     {
         if (pqueue == NULL)
             return true;
+        Flush();
         bool fRet = pqueue->Wait();
         fDone = true;
         return fRet;
@@ -201,8 +292,18 @@ public:
 
     void Add(std::vector<T>& vChecks)
     {
-        if (pqueue != NULL)
+        if (pqueue == NULL)
+            return;
+        if (nFlushSize == 0) {
             pqueue->Add(vChecks);
+            return;
+        }
+        BOOST_FOREACH (T& check, vChecks) {
+            vPending.push_back(T());
+            check.swap(vPending.back());
+        }
+        if (vPending.size() >= nFlushSize)
+            Flush();
     }
 
     ~CCheckQueueControl()
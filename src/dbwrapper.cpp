@@ -15,14 +15,19 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBOptions& dbOptions)
 {
     leveldb::Options options;
     options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    if (dbOptions.nWriteBufferSize > 0)
+        options.write_buffer_size = dbOptions.nWriteBufferSize;
+    else
+        options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    options.block_size = dbOptions.nBlockSize;
+    if (dbOptions.nBloomBits > 0)
+        options.filter_policy = leveldb::NewBloomFilterPolicy(dbOptions.nBloomBits);
+    options.compression = dbOptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,14 +36,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const CDBOptions& dbOptions)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, dbOptions);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -55,6 +60,8 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     dbwrapper_private::HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
+    LogPrint("db", "LevelDB options for %s: block size %u, compression %d, max open files %d, bloom bits %d, write buffer %u\n",
+        path.string(), options.block_size, dbOptions.fCompression, options.max_open_files, dbOptions.nBloomBits, options.write_buffer_size);
 
     // The base-case obfuscation key, which is a noop.
     obfuscate_key = std::vector<unsigned char>(OBFUSCATE_KEY_NUM_BYTES, '\000');
@@ -122,6 +129,25 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+void CDBWrapper::CompactRawRange(const std::string* pbegin, const std::string* pend) const
+{
+    leveldb::Slice slBegin, slEnd;
+    if (pbegin)
+        slBegin = leveldb::Slice(*pbegin);
+    if (pend)
+        slEnd = leveldb::Slice(*pend);
+    pdb->CompactRange(pbegin ? &slBegin : NULL, pend ? &slEnd : NULL);
+}
+
+std::vector<int> CDBWrapper::GetFilesPerLevel() const
+{
+    std::vector<int> vFiles;
+    std::string strValue;
+    for (int nLevel = 0; pdb->GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), &strValue); nLevel++)
+        vFiles.push_back(atoi(strValue));
+    return vFiles;
+}
+
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
@@ -25,6 +25,44 @@ public:
 
 class CDBWrapper;
 
+//! Default LevelDB block size, in bytes of uncompressed data
+static const size_t DEFAULT_DB_BLOCK_SIZE = 4096;
+//! Default for compressing LevelDB blocks
+static const bool DEFAULT_DB_COMPRESSION = false;
+//! Default number of files LevelDB may keep open
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+//! Default bloom filter size, in bits per key
+static const int DEFAULT_DB_BLOOM_BITS = 10;
+//! Largest block size LevelDB accepts, in kilobytes
+static const unsigned int MAX_DB_BLOCK_SIZE_KB = 4096;
+//! Largest open file limit LevelDB accepts
+static const int MAX_DB_MAX_OPEN_FILES = 50000;
+//! Maximum bloom filter size, in bits per key
+static const int MAX_DB_BLOOM_BITS = 64;
+//! Largest write buffer LevelDB accepts, in megabytes
+static const unsigned int MAX_DB_WRITE_BUFFER_MB = 1024;
+
+/** Tuning of the LevelDB instance below a CDBWrapper. */
+struct CDBOptions
+{
+    //! Approximate amount of data packed into one block
+    size_t nBlockSize;
+    //! Compress blocks (only has an effect if LevelDB was built with Snappy)
+    bool fCompression;
+    //! Number of files LevelDB may keep open
+    int nMaxOpenFiles;
+    //! Bits per key of the bloom filter that saves reads of absent keys, 0 for none
+    int nBloomBits;
+    /**
+     * Amount of writes collected in memory before they are written out as a
+     * new level-0 file, which is what starts background compactions. 0 to use
+     * a quarter of the cache.
+     */
+    size_t nWriteBufferSize;
+
+    CDBOptions() : nBlockSize(DEFAULT_DB_BLOCK_SIZE), fCompression(DEFAULT_DB_COMPRESSION), nMaxOpenFiles(DEFAULT_DB_MAX_OPEN_FILES), nBloomBits(DEFAULT_DB_BLOOM_BITS), nWriteBufferSize(0) {}
+};
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -50,11 +88,19 @@ private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] parent    CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &parent) : parent(parent) { };
+    CDBBatch(const CDBWrapper &parent) : parent(parent), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -71,6 +117,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -82,7 +136,15 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -192,8 +254,9 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] dbOptions   Tuning of the underlying LevelDB instance.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const CDBOptions& dbOptions = CDBOptions());
     ~CDBWrapper();
 
     template <typename K, typename V>
@@ -280,6 +343,32 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Compact the range of keys from key_begin to key_end, so that the
+     * space of entries erased there is reclaimed.
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(ssKey1.GetSerializeSize(key_begin));
+        ssKey2.reserve(ssKey2.GetSerializeSize(key_end));
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
+
+    /**
+     * Compact the range of raw (serialized) keys from *pbegin to *pend, where
+     * NULL stands for the start or the end of the database.
+     */
+    void CompactRawRange(const std::string* pbegin, const std::string* pend) const;
+
+    /** Return the number of table files at each level of the database. */
+    std::vector<int> GetFilesPerLevel() const;
 };
 
 #endif // BITCOIN_DBWRAPPER_H
@@ -205,4 +205,9 @@ public:
  */
 uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
 
+/** Optimized SipHash-2-4 implementation for uint256 followed by a 32-bit
+ *  little-endian integer, such as an outpoint.
+ */
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
+
 #endif // BITCOIN_HASH_H
@@ -16,6 +16,7 @@
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
 #include "httpserver.h"
 #include "httprpc.h"
 #include "key.h"
@@ -64,6 +65,9 @@
 using namespace std;
 
 bool fFeeEstimatesInitialized = false;
+// Set once the mempool has been loaded, so that shutting down in the middle
+// of loading it does not overwrite mempool.dat with a part of it.
+static std::atomic<bool> fDumpMempoolLater(false);
 static const bool DEFAULT_PROXYRANDOMIZE = true;
 static const bool DEFAULT_REST_ENABLE = false;
 static const bool DEFAULT_DISABLE_SAFEMODE = false;
@@ -93,6 +97,9 @@ enum BindFlags {
 
 static const char* FEE_ESTIMATES_FILENAME="fee_estimates.dat";
 
+//! Databases whose LevelDB options can be tuned with -<name>blocksize etc
+static const char* const TUNABLE_DB_NAMES[] = {"chainstate", "blockindex"};
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Shutdown
@@ -143,9 +150,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -159,7 +166,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -199,6 +205,10 @@ void Shutdown()
     StopNode();
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
+    StopBlockCandidate();
+
+    if (fDumpMempoolLater && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
 
     if (fFeeEstimatesInitialized)
     {
@@ -220,6 +230,10 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsPrefetch;
+        pcoinsPrefetch = NULL;
+        delete pcoinsWriteBehind;
+        pcoinsWriteBehind = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -305,11 +319,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-backgroundflush", strprintf(_("Write the in-memory UTXO set to the chain state database in a background thread while validation continues; up to twice -dbcache may be in use while a write is in progress. Ignored when pruning (default: %u)"), DEFAULT_BACKGROUND_FLUSH));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
+    strUsage += HelpMessageOpt("-blockreconstructionextratxn=<n>", strprintf(_("Extra transactions to keep in memory for compact block reconstructions (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
+    strUsage += HelpMessageOpt("-checkmempoolload", strprintf(_("Verify the scripts of every transaction loaded from mempool.dat, instead of trusting those saved on the current tip (default: %u)"), DEFAULT_CHECK_MEMPOOL_LOAD));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), BITCOIN_CONF_FILENAME));
     if (mode == HMM_BITCOIND)
     {
@@ -325,8 +342,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart. Unless -checkmempoolload is set, the scripts of transactions saved on the current tip are not verified again, so mempool.dat must be trusted like the rest of the data directory (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-prefetchthreads=<n>", strprintf(_("Set the number of threads reading the inputs of new blocks from the chain state database ahead of their validation; they keep up to %u MiB of coins in memory (0 to %d, 0 = off, default: %d)"), MAX_PREFETCH_USAGE >> 20, MAX_PREFETCH_THREADS, DEFAULT_PREFETCH_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
@@ -335,6 +354,8 @@ std::string HelpMessage(HelpMessageMode mode)
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
+    strUsage += HelpMessageOpt("-reindexthreads=<n>", strprintf(_("Set the number of threads deserializing and checking blocks during -reindex (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_REINDEX_THREADS, DEFAULT_REINDEX_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
@@ -357,6 +378,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXRECEIVEBUFFER));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXSENDBUFFER));
     strUsage += HelpMessageOpt("-maxtimeadjustment", strprintf(_("Maximum allowed median peer time offset adjustment. Local perspective of time may be influenced by peers forward or backward by this amount. (default: %u seconds)"), DEFAULT_MAX_TIME_ADJUSTMENT));
+    strUsage += HelpMessageOpt("-msghandthreads=<n>", strprintf(_("Set the number of threads processing peer messages (0 to %d, 0 = auto, default: %d)"), MAX_MSGHAND_THREADS, DEFAULT_MSGHAND_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), DEFAULT_PERMIT_BAREMULTISIG));
@@ -365,6 +387,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), DEFAULT_PROXYRANDOMIZE));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Socket events mode, which must be one of: %s (default: %s)"), GetSupportedSocketEventsModes(), DEFAULT_SOCKETEVENTS));
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
     strUsage += HelpMessageOpt("-torcontrol=<ip>:<port>", strprintf(_("Tor control port to use if onion listening enabled (default: %s)"), DEFAULT_TOR_CONTROL));
     strUsage += HelpMessageOpt("-torpassword=<pass>", _("Tor control port password (default: empty)"));
@@ -403,8 +426,17 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-checkpoints", strprintf("Disable expensive verification for known chain history (default: %u)", DEFAULT_CHECKPOINTS_ENABLED));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf("Disable safemode, override a real safe mode event (default: %u)", DEFAULT_DISABLE_SAFEMODE));
         strUsage += HelpMessageOpt("-testsafemode", strprintf("Force safe mode (default: %u)", DEFAULT_TESTSAFEMODE));
+        BOOST_FOREACH(const char* pszDB, TUNABLE_DB_NAMES) {
+            const std::string strDB(pszDB);
+            strUsage += HelpMessageOpt("-" + strDB + "blocksize=<n>", strprintf("Pack about <n> kilobytes into each block of the %s database (1 to %u, default: %u)", strDB, MAX_DB_BLOCK_SIZE_KB, DEFAULT_DB_BLOCK_SIZE >> 10));
+            strUsage += HelpMessageOpt("-" + strDB + "compression", strprintf("Compress the blocks of the %s database, if built with Snappy (default: %u)", strDB, DEFAULT_DB_COMPRESSION));
+            strUsage += HelpMessageOpt("-" + strDB + "maxopenfiles=<n>", strprintf("Keep at most <n> table files of the %s database open (up to %u, default: %u)", strDB, MAX_DB_MAX_OPEN_FILES, DEFAULT_DB_MAX_OPEN_FILES));
+            strUsage += HelpMessageOpt("-" + strDB + "bloombits=<n>", strprintf("Use <n> bits per key for the bloom filters of the %s database, 0 for none (0 to %u, default: %u)", strDB, MAX_DB_BLOOM_BITS, DEFAULT_DB_BLOOM_BITS));
+            strUsage += HelpMessageOpt("-" + strDB + "writebuffer=<n>", strprintf("Write <n> megabytes of changes to the %s database out as one new file to be compacted in the background, 0 for a quarter of its cache (0 to %u, default: 0)", strDB, MAX_DB_WRITE_BUFFER_MB));
+        }
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", "Randomly drop 1 of every <n> network messages");
         strUsage += HelpMessageOpt("-fuzzmessagestest=<n>", "Randomly fuzz 1 of every <n> network messages");
+        strUsage += HelpMessageOpt("-scriptcheckbatch=<n>", strprintf("Hand script checks to the script verification threads in batches of <n> (1 to %u, default: %u)", MAX_SCRIPTCHECK_BATCH_SIZE, DEFAULT_SCRIPTCHECK_BATCH_SIZE));
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf("Stop running after importing blocks from disk (default: %u)", DEFAULT_STOPAFTERBLOCKIMPORT));
         strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)", DEFAULT_ANCESTOR_LIMIT));
         strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
@@ -427,7 +459,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-mocktime=<n>", "Replace actual time with <n> seconds since epoch (default: 0)");
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", DEFAULT_LIMITFREERELAY));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", DEFAULT_RELAYPRIORITY));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u, maximum: %d)", DEFAULT_MAX_SIG_CACHE_SIZE, MAX_MAX_SIG_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered zero fee for relaying, mining and transaction creation (default: %s)"),
@@ -456,6 +488,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-blockminsize=<n>", strprintf(_("Set minimum block size in bytes (default: %u)"), DEFAULT_BLOCK_MIN_SIZE));
     strUsage += HelpMessageOpt("-blockmaxsize=<n>", strprintf(_("Set maximum block size in bytes (default: %d)"), DEFAULT_BLOCK_MAX_SIZE));
     strUsage += HelpMessageOpt("-blockprioritysize=<n>", strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE));
+    strUsage += HelpMessageOpt("-incrementaltemplate", strprintf(_("Keep the block template up to date as transactions enter and leave the mempool instead of assembling it anew for each request (default: %u)"), DEFAULT_INCREMENTAL_TEMPLATE));
     if (showDebug)
         strUsage += HelpMessageOpt("-blockversion=<n>", "Override block version to test forking scenarios");
 
@@ -575,18 +608,12 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 
     // -reindex
     if (fReindex) {
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(chainparams, file, &pos);
-            nFile++;
-        }
+        // -reindexthreads=0 means one block parsing thread per core
+        int nReindexThreads = GetArg("-reindexthreads", DEFAULT_REINDEX_THREADS);
+        if (nReindexThreads <= 0)
+            nReindexThreads += GetNumCores();
+        nReindexThreads = std::max(1, std::min(nReindexThreads, MAX_REINDEX_THREADS));
+        ReindexBlockFiles(chainparams, nReindexThreads);
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -630,6 +657,12 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        CMempoolLoadStats stats;
+        LoadMempool(stats);
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Sanity checks
@@ -750,6 +783,20 @@ static std::string ResolveErrMsg(const char * const optname, const std::string&
     return strprintf(_("Cannot resolve -%s address: '%s'"), optname, strBind);
 }
 
+/** Read the LevelDB options of the database called strName from -<strName>blocksize and friends. */
+static CDBOptions GetDBOptions(const std::string& strName)
+{
+    CDBOptions dbOptions;
+    int64_t nBlockSizeKB = GetArg("-" + strName + "blocksize", DEFAULT_DB_BLOCK_SIZE >> 10);
+    dbOptions.nBlockSize = std::max((int64_t)1, std::min(nBlockSizeKB, (int64_t)MAX_DB_BLOCK_SIZE_KB)) << 10;
+    dbOptions.fCompression = GetBoolArg("-" + strName + "compression", DEFAULT_DB_COMPRESSION);
+    dbOptions.nMaxOpenFiles = std::max((int64_t)0, std::min(GetArg("-" + strName + "maxopenfiles", DEFAULT_DB_MAX_OPEN_FILES), (int64_t)MAX_DB_MAX_OPEN_FILES));
+    dbOptions.nBloomBits = std::max((int64_t)0, std::min(GetArg("-" + strName + "bloombits", DEFAULT_DB_BLOOM_BITS), (int64_t)MAX_DB_BLOOM_BITS));
+    int64_t nWriteBufferMB = GetArg("-" + strName + "writebuffer", 0);
+    dbOptions.nWriteBufferSize = std::max((int64_t)0, std::min(nWriteBufferMB, (int64_t)MAX_DB_WRITE_BUFFER_MB)) << 20;
+    return dbOptions;
+}
+
 void InitLogging()
 {
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
@@ -838,13 +885,22 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 #endif
     }
 
+    std::string strSocketEvents = GetArg("-socketevents", DEFAULT_SOCKETEVENTS);
+    if (!ParseSocketEventsMode(strSocketEvents, nSocketEventsMode))
+        return InitError(strprintf(_("Invalid -socketevents ('%s') specified. Only these modes are supported: %s"), strSocketEvents, GetSupportedSocketEventsModes()));
+    std::string strSocketEventsError;
+    if (!CreateSocketEvents(strSocketEventsError))
+        return InitError(strprintf(_("Unable to use -socketevents=%s: %s"), strSocketEvents, strSocketEventsError));
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     int nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
     // Trim requested connection counts, to fit into system limitations
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    // (select() can only wait on descriptors below FD_SETSIZE)
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT)
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -899,6 +955,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nScriptCheckThreads = 0;
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    SetScriptCheckBatchSize(std::max((int64_t)1, std::min(GetArg("-scriptcheckbatch", DEFAULT_SCRIPTCHECK_BATCH_SIZE), (int64_t)MAX_SCRIPTCHECK_BATCH_SIZE)));
+
+    // -msghandthreads=0 means one message handler thread per core
+    nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads = GetNumCores();
+    nMessageHandlerThreads = std::max(1, std::min(nMessageHandlerThreads, MAX_MSGHAND_THREADS));
 
     fServer = GetBoolArg("-server", false);
 
@@ -976,6 +1039,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     // Initialize elliptic curve code
+    std::string sha256_algo = SHA256AutoDetect();
+    LogPrintf("Using the '%s' SHA256 implementation\n", sha256_algo);
     ECC_Start();
     globalVerifyHandle.reset(new ECCVerifyHandle());
 
@@ -1015,10 +1080,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
-    LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    InitSignatureCache();
+
+    LogPrintf("Using %u threads for script and header verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadHeaderCheck);
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1239,15 +1308,34 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsPrefetch;
+                pcoinsPrefetch = NULL;
+                delete pcoinsWriteBehind;
+                pcoinsWriteBehind = NULL;
+                delete pcoinsdbview;
+                pcoinsdbview = NULL;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, GetDBOptions("blockindex"));
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState, GetDBOptions("chainstate"));
+                // Pruning needs the chain state on disk to keep up with the
+                // block files it deletes, so it always writes synchronously.
+                if (GetBoolArg("-backgroundflush", DEFAULT_BACKGROUND_FLUSH) && !fPruneMode)
+                    pcoinsWriteBehind = new CCoinsViewWriteBehind(pcoinsdbview);
+                CCoinsView *pcoinsbase = pcoinsWriteBehind ? (CCoinsView*)pcoinsWriteBehind : pcoinsdbview;
+                int nPrefetchThreads = std::min((int)GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS), MAX_PREFETCH_THREADS);
+                if (nPrefetchThreads > 0)
+                    pcoinsbase = pcoinsPrefetch = new CCoinsViewPrefetch(pcoinsbase, nPrefetchThreads);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsbase);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                // Convert a coin database written by an older version to per-output records
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1453,6 +1541,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                                          boost::ref(cs_main), boost::cref(pindexBestHeader), nPowTargetSpacing);
     scheduler.scheduleEvery(f, nPowTargetSpacing);
 
+    if (GetBoolArg("-incrementaltemplate", DEFAULT_INCREMENTAL_TEMPLATE))
+        StartBlockCandidate(Params(), scheduler);
+
     // ********************************************************* Step 12: finished
 
     SetRPCWarmupFinished();
@@ -15,8 +15,10 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "init.h"
+#include "mappedfile.h"
 #include "merkleblock.h"
 #include "net.h"
 #include "policy/fees.h"
@@ -104,9 +106,20 @@ struct COrphanTx {
     NodeId fromPeer;
     int64_t nTimeExpire;
 };
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
-map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
-void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+/**
+ * Protects the orphan pool, so peers can be disconnected and orphans expire
+ * without waiting for cs_main. When both are needed, cs_main is taken first.
+ */
+CCriticalSection cs_orphans;
+map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_orphans);
+map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_orphans);
+void EraseOrphansFor(NodeId peer);
+
+/** Ring buffer of transactions we saw but do not have in the mempool, to reconstruct compact blocks with */
+static std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > vExtraTxnForCompact GUARDED_BY(cs_main);
+/** Next position to overwrite in vExtraTxnForCompact */
+static size_t vExtraTxnForCompactIt GUARDED_BY(cs_main) = 0;
+static CCompactBlockStats compactBlockStats GUARDED_BY(cs_main) = {};
 
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
@@ -146,13 +159,21 @@ namespace {
 
     CBlockIndex *pindexBestInvalid;
 
+    /**
+     * Protects the per-peer bookkeeping of block download and announcement
+     * (mapNodeState, mapBlocksInFlight and the counters derived from them),
+     * so that it can be looked at and updated without waiting for cs_main.
+     * When more locks are needed, cs_main and cs_orphans are taken first.
+     */
+    CCriticalSection cs_nodestate;
+
     /**
      * The set of all CBlockIndex entries with BLOCK_VALID_TRANSACTIONS (for itself and all ancestors) and
      * as good as our current tip or better. Entries may be failed, though, and pruning nodes may be
      * missing the data for the block.
      */
     set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexCandidates;
-    /** Number of nodes with fSyncStarted. */
+    /** Number of nodes with fSyncStarted. Protected by cs_nodestate. */
     int nSyncStarted = 0;
     /** All pairs A->B, where A (or one of its ancestors) misses transactions, but B has transactions.
      * Pruned nodes may have entries where B is missing data.
@@ -206,7 +227,7 @@ namespace {
     boost::scoped_ptr<CRollingBloomFilter> recentRejects;
     uint256 hashRecentRejectsChainTip;
 
-    /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_main. */
+    /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_nodestate. */
     struct QueuedBlock {
         uint256 hash;
         CBlockIndex* pindex;                                     //!< Optional.
@@ -215,10 +236,10 @@ namespace {
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
-    /** Stack of nodes which we have set to announce using compact blocks */
+    /** Stack of nodes which we have set to announce using compact blocks. Protected by cs_nodestate. */
     list<NodeId> lNodesAnnouncingHeaderAndIDs;
 
-    /** Number of preferable block download peers. */
+    /** Number of preferable block download peers. Protected by cs_nodestate. */
     int nPreferredDownload = 0;
 
     /** Dirty block index entries. */
@@ -227,13 +248,15 @@ namespace {
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
 
-    /** Number of peers from which we're downloading blocks. */
+    /** Number of peers from which we're downloading blocks. Protected by cs_nodestate. */
     int nPeersWithValidatedDownloads = 0;
 
-    /** Relay map, protected by cs_main. */
+    /** Protects the relay map, so transactions can be served from it while cs_main is busy. */
+    CCriticalSection cs_relay;
+    /** Relay map, protected by cs_relay. */
     typedef std::map<uint256, std::shared_ptr<const CTransaction>> MapRelay;
     MapRelay mapRelay;
-    /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
+    /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_relay. */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
 } // anon namespace
 
@@ -251,7 +274,7 @@ struct CBlockReject {
 };
 
 /**
- * Maintain validation-specific state about nodes, protected by cs_main, instead
+ * Maintain validation-specific state about nodes, protected by cs_nodestate, instead
  * by CNode's own locks. This simplifies asynchronous operation, where
  * processing of incoming data is done after the ProcessMessage call returns,
  * and we're no longer holding the node's locks.
@@ -318,23 +341,32 @@ struct CNodeState {
     }
 };
 
-/** Map maintaining per-node state. Requires cs_main. */
+/** Map maintaining per-node state. Requires cs_nodestate. */
 map<NodeId, CNodeState> mapNodeState;
 
-// Requires cs_main.
+// Requires cs_nodestate.
 CNodeState *State(NodeId pnode) {
+    AssertLockHeld(cs_nodestate);
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
     if (it == mapNodeState.end())
         return NULL;
     return &it->second;
 }
 
+/** Whether a peer told us it can give us witnesses. */
+bool PeerHasWitness(NodeId nodeid) {
+    LOCK(cs_nodestate);
+    CNodeState *state = State(nodeid);
+    return state != NULL && state->fHaveWitness;
+}
+
 int GetHeight()
 {
     LOCK(cs_main);
     return chainActive.Height();
 }
 
+// Requires cs_nodestate.
 void UpdatePreferredDownload(CNode* node, CNodeState* state)
 {
     nPreferredDownload -= state->fPreferredDownload;
@@ -346,14 +378,16 @@ void UpdatePreferredDownload(CNode* node, CNodeState* state)
 }
 
 void InitializeNode(NodeId nodeid, const CNode *pnode) {
-    LOCK(cs_main);
+    LOCK(cs_nodestate);
     CNodeState &state = mapNodeState.insert(std::make_pair(nodeid, CNodeState())).first->second;
     state.name = pnode->addrName;
     state.address = pnode->addr;
 }
 
 void FinalizeNode(NodeId nodeid) {
-    LOCK(cs_main);
+    EraseOrphansFor(nodeid);
+
+    LOCK(cs_nodestate);
     CNodeState *state = State(nodeid);
 
     if (state->fSyncStarted)
@@ -366,7 +400,6 @@ void FinalizeNode(NodeId nodeid) {
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
-    EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -381,7 +414,7 @@ void FinalizeNode(NodeId nodeid) {
     }
 }
 
-// Requires cs_main.
+// Requires cs_nodestate.
 // Returns a bool indicating whether we requested this block.
 // Also used if a block was /not/ received and timed out or started with another peer
 bool MarkBlockAsReceived(const uint256& hash) {
@@ -406,9 +439,9 @@ bool MarkBlockAsReceived(const uint256& hash) {
     return false;
 }
 
-// Requires cs_main.
+// Requires cs_nodestate.
 // returns false, still setting pit, if the block was already in flight from the same peer
-// pit will only be valid as long as the same cs_main lock is being held
+// pit will only be valid as long as the same cs_nodestate lock is being held
 bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
@@ -440,7 +473,7 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     return true;
 }
 
-/** Check whether the last unknown block a peer advertised is not yet known. */
+/** Check whether the last unknown block a peer advertised is not yet known. Requires cs_main and cs_nodestate. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
@@ -455,7 +488,7 @@ void ProcessBlockAvailability(NodeId nodeid) {
     }
 }
 
-/** Update tracking information about which blocks a peer is assumed to have. */
+/** Update tracking information about which blocks a peer is assumed to have. Requires cs_main and cs_nodestate. */
 void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
@@ -473,6 +506,7 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+// Requires cs_main and cs_nodestate
 void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
     if (nLocalServices & NODE_WITNESS) {
         // Don't ever request compact blocks when segwit is enabled.
@@ -505,7 +539,7 @@ bool CanDirectFetch(const Consensus::Params &consensusParams)
     return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
 }
 
-// Requires cs_main
+// Requires cs_main and cs_nodestate
 bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
 {
     if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
@@ -535,7 +569,7 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
+ *  at most count entries. Requires cs_main and cs_nodestate. */
 void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
     if (count == 0)
         return;
@@ -621,7 +655,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 } // anon namespace
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
-    LOCK(cs_main);
+    LOCK(cs_nodestate);
     CNodeState *state = State(nodeid);
     if (state == NULL)
         return false;
@@ -635,6 +669,17 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     return true;
 }
 
+void GetCompactBlockStats(CCompactBlockStats &stats) {
+    LOCK(cs_main);
+    stats = compactBlockStats;
+    stats.nExtraTxn = 0;
+    for (const std::pair<uint256, std::shared_ptr<const CTransaction> >& extra : vExtraTxnForCompact) {
+        if (extra.second)
+            stats.nExtraTxn++;
+    }
+    stats.nMaxExtraTxn = std::max((int64_t)0, GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
@@ -672,6 +717,9 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewWriteBehind *pcoinsWriteBehind = NULL;
+CCoinsViewPrefetch *pcoinsPrefetch = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -679,8 +727,20 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
+static void AddToCompactExtraTransactions(const std::shared_ptr<const CTransaction>& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    int64_t nMaxExtraTxn = GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN);
+    if (nMaxExtraTxn <= 0)
+        return;
+    if (vExtraTxnForCompact.empty())
+        vExtraTxnForCompact.resize(nMaxExtraTxn);
+    vExtraTxnForCompact[vExtraTxnForCompactIt] = std::make_pair(tx->GetHash(), tx);
+    vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % nMaxExtraTxn;
+}
+
 bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
+    LOCK(cs_orphans);
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
@@ -705,12 +765,14 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
     }
 
+    AddToCompactExtraTransactions(std::make_shared<const CTransaction>(tx));
+
     LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
              mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
     return true;
 }
 
-int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_orphans)
 {
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
@@ -730,6 +792,7 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
 void EraseOrphansFor(NodeId peer)
 {
+    LOCK(cs_orphans);
     int nErased = 0;
     map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end())
@@ -744,8 +807,9 @@ void EraseOrphansFor(NodeId peer)
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
+    LOCK(cs_orphans);
     unsigned int nEvicted = 0;
     static int64_t nNextSweep;
     int64_t nNow = GetTime();
@@ -955,15 +1019,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -1102,10 +1166,13 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
-    pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    std::vector<COutPoint> vNoSpendsRemaining;
+    std::vector<std::shared_ptr<const CTransaction> > vTxnRemoved;
+    pool.TrimToSize(limit, &vNoSpendsRemaining, &vTxnRemoved);
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
+    BOOST_FOREACH(const std::shared_ptr<const CTransaction>& tx, vTxnRemoved)
+        AddToCompactExtraTransactions(tx);
 }
 
 /** Convert CValidationState to a human-readable message for logging */
@@ -1117,16 +1184,29 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
+/** Script verification flags for transactions entering the mempool */
+static unsigned int GetMempoolScriptFlags()
+{
+    unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (!Params().RequireStandard()) {
+        scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+    }
+    return scriptVerifyFlags;
+}
+
+// fScriptChecks false skips script verification, for transactions whose
+// scripts were verified on top of the current tip before (see LoadMempool).
+// fTxChecked true skips CheckTransaction, which the caller already ran.
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
-                              bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+                              bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
+                              bool fScriptChecks, bool fTxChecked, std::vector<COutPoint>& coins_to_uncache)
 {
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
-    if (!CheckTransaction(tx, state))
+    if (!fTxChecked && !CheckTransaction(tx, state))
         return false; // state filled in by CheckTransaction
 
     // Coinbase is only valid in a block, not as a loose transaction
@@ -1218,20 +1298,23 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            COutPoint outpoint(hash, out);
+            bool fHadCoinInCache = pcoinsTip->HaveCoinInCache(outpoint);
+            if (view.HaveCoin(outpoint)) {
+                if (!fHadCoinInCache)
+                    coins_to_uncache.push_back(outpoint);
+                return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+            }
         }
 
         // do all inputs exist?
         // Note that this does not check for the presence of actual outputs (see the next check for that),
         // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                coins_to_uncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
@@ -1279,14 +1362,14 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -1488,19 +1571,18 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             }
         }
 
-        unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
-        if (!Params().RequireStandard()) {
-            scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
-        }
+        unsigned int scriptVerifyFlags = GetMempoolScriptFlags();
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true)) {
+        PrecomputedTransactionData txdata(tx);
+        if (!CheckInputs(tx, state, view, fScriptChecks, scriptVerifyFlags, true, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
-            if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true) &&
-                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true)) {
+            if (fScriptChecks &&
+                CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
                 // Only the witness is wrong, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
@@ -1516,7 +1598,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        if (fScriptChecks && !CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
         {
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
@@ -1530,6 +1612,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
                     hash.ToString(),
                     FormatMoney(nModifiedFees - nConflictingFees),
                     (int)nSize - (int)nConflictingSize);
+            AddToCompactExtraTransactions(it->GetSharedTx());
         }
         pool.RemoveStaged(allConflicting, false);
 
@@ -1549,18 +1632,189 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+static bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                       bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit=false,
+                                       const CAmount nAbsurdFee=0, bool fScriptChecks=true, bool fTxChecked=false)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    std::vector<COutPoint> coins_to_uncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, fScriptChecks, fTxChecked, coins_to_uncache);
     if (!res) {
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
-            pcoinsTip->Uncache(hashTx);
+        BOOST_FOREACH(const COutPoint& outpoint, coins_to_uncache)
+            pcoinsTip->Uncache(outpoint);
     }
     return res;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee, bool fTxChecked)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fOverrideMempoolLimit, nAbsurdFee, true, fTxChecked);
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+
+// mempool.dat holds, in this order:
+// - the version, MEMPOOL_DUMP_VERSION
+// - the tip and the script verification flags the transactions were
+//   accepted with
+// - the number of transactions, then for each of them, parents before
+//   children: the transaction, its witness hash, the time it entered the
+//   mempool and its priority and fee deltas
+// - the deltas of transactions that are not in the mempool
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    // Take the transactions together with the tip they are valid on
+    uint256 hashTip;
+    std::vector<TxMempoolInfo> vInfo;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (chainActive.Tip())
+            hashTip = chainActive.Tip()->GetBlockHash();
+        vInfo = mempool.infoAll();
+        mapDeltas = mempool.mapDeltas;
+    }
+
+    try {
+        boost::filesystem::path pathNew = GetDataDir() / "mempool.dat.new";
+        CAutoFile file(fopen(pathNew.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s: Failed to open %s", __func__, pathNew.string());
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << hashTip;
+        file << GetMempoolScriptFlags();
+        file << (uint64_t)vInfo.size();
+        BOOST_FOREACH(const TxMempoolInfo& info, vInfo) {
+            std::pair<double, CAmount> deltas(0, 0);
+            std::map<uint256, std::pair<double, CAmount> >::iterator it = mapDeltas.find(info.tx->GetHash());
+            if (it != mapDeltas.end()) {
+                deltas = it->second;
+                mapDeltas.erase(it);
+            }
+            file << *info.tx;
+            file << info.tx->GetWitnessHash();
+            file << info.nTime;
+            file << deltas;
+        }
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathNew, GetDataDir() / "mempool.dat"))
+            return error("%s: Failed to rename %s", __func__, pathNew.string());
+    } catch (const std::exception& e) {
+        return error("%s: Failed to dump mempool: %s", __func__, e.what());
+    }
+
+    LogPrintf("Dumped %u mempool transactions to disk in %.2fms\n", vInfo.size(), 0.001 * (GetTimeMicros() - nStart));
+    return true;
+}
+
+// Restores a prioritisation from mempool.dat, unless the transaction has been
+// prioritised since.
+static void RestorePrioritisation(const uint256& hash, const std::pair<double, CAmount>& deltas)
+{
+    if (deltas.first == 0 && deltas.second == 0)
+        return;
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+    if (dPriorityDelta == 0 && nFeeDelta == 0)
+        mempool.PrioritiseTransaction(hash, hash.ToString(), deltas.first, deltas.second);
+}
+
+bool LoadMempool(CMempoolLoadStats &stats)
+{
+    stats.nAccepted = stats.nScriptChecksSkipped = stats.nFailed = stats.nAlreadyHad = stats.nExpired = 0;
+    int64_t nStart = GetTimeMicros();
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    int64_t nNow = GetTime();
+
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("No mempool to load from %s\n", path.string());
+        return false;
+    }
+
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s: Unknown version %u of %s", __func__, nVersion, path.string());
+
+        uint256 hashTip;
+        unsigned int nScriptFlags;
+        uint64_t nTransactions;
+        file >> hashTip;
+        file >> nScriptFlags;
+        file >> nTransactions;
+        // The transactions' scripts were verified with these flags against
+        // the coins as of hashTip. While that is still our tip, verifying
+        // them again would only find the same, as long as the transaction
+        // still hashes to the witness hash stored next to it. That hash only
+        // catches accidental corruption: anyone able to write mempool.dat can
+        // make it match, so -checkmempoolload turns this off.
+        bool fScriptsVerified = (nScriptFlags == GetMempoolScriptFlags()) && !GetBoolArg("-checkmempoolload", DEFAULT_CHECK_MEMPOOL_LOAD);
+
+        // Read and accept the transactions one at a time, so that the file
+        // never needs to fit in memory and cs_main is not held throughout.
+        while (nTransactions--) {
+            CTransaction tx;
+            uint256 hashWitness;
+            int64_t nTime;
+            std::pair<double, CAmount> deltas;
+            file >> tx;
+            file >> hashWitness;
+            file >> nTime;
+            file >> deltas;
+
+            if (mempool.exists(tx.GetHash())) {
+                stats.nAlreadyHad++;
+                continue;
+            }
+            RestorePrioritisation(tx.GetHash(), deltas);
+            if (nTime + nExpiryTimeout <= nNow) {
+                stats.nExpired++;
+                continue;
+            }
+
+            CValidationState state;
+            {
+                LOCK(cs_main);
+                bool fScriptChecks = !fScriptsVerified || chainActive.Tip() == NULL || chainActive.Tip()->GetBlockHash() != hashTip;
+                if (!fScriptChecks && tx.GetWitnessHash() != hashWitness) {
+                    LogPrintf("%s: %s does not match its witness hash in %s, checking its scripts\n", __func__, tx.GetHash().ToString(), path.string());
+                    fScriptChecks = true;
+                }
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, false, NULL, nTime, false, 0, fScriptChecks)) {
+                    stats.nAccepted++;
+                    if (!fScriptChecks)
+                        stats.nScriptChecksSkipped++;
+                } else {
+                    LogPrint("mempool", "%s: %s not accepted: %s\n", __func__, tx.GetHash().ToString(), FormatStateMessage(state));
+                    stats.nFailed++;
+                }
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            RestorePrioritisation(it->first, it->second);
+    } catch (const std::exception& e) {
+        return error("%s: Failed to load mempool: %s", __func__, e.what());
+    }
+
+    LogPrintf("Loaded mempool from disk in %.2fms: %d accepted (%d without script checks), %d failed, %d already had, %d expired\n",
+        0.001 * (GetTimeMicros() - nStart), stats.nAccepted, stats.nScriptChecksSkipped, stats.nFailed, stats.nAlreadyHad, stats.nExpired);
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1600,9 +1854,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
         int nHeight = -1;
         {
             const CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(view, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1693,6 +1947,35 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
+/** Read-only mappings of recently read block files. */
+static CMappedFileCache mappedblockfiles(MAX_MAPPED_BLOCKFILES);
+
+/**
+ * Locate the serialized block stored at pos inside a memory mapping of its
+ * block file, using the size WriteBlockToDisk stores right before it.
+ * Returns NULL (and the caller should fall back to stdio) if the file
+ * cannot be mapped or the stored size does not fit in the file.
+ */
+static std::shared_ptr<const CMappedFile> MapBlockData(const CDiskBlockPos& pos, const unsigned char*& pblock, unsigned int& nBlockSize)
+{
+    if (pos.IsNull() || pos.nPos < sizeof(uint32_t))
+        return std::shared_ptr<const CMappedFile>();
+    boost::filesystem::path path = GetBlockPosFilename(pos, "blk");
+    std::shared_ptr<const CMappedFile> mapping = mappedblockfiles.Get(pos.nFile, path, pos.nPos);
+    if (!mapping)
+        return mapping;
+    nBlockSize = ReadLE32(mapping->data() + pos.nPos - sizeof(uint32_t));
+    uint64_t nEnd = (uint64_t)pos.nPos + nBlockSize;
+    if (nBlockSize > MAX_BLOCKFILE_SIZE || nEnd > mapping->size()) {
+        // Either the file grew since it was mapped, or the size is bogus.
+        mapping = mappedblockfiles.Get(pos.nFile, path, nEnd);
+        if (!mapping)
+            return mapping;
+    }
+    pblock = mapping->data() + pos.nPos;
+    return mapping;
+}
+
 /* Generic implementation of block reading that can handle
    both a block and its header.  */
 
@@ -1701,14 +1984,21 @@ static bool ReadBlockOrHeader(T& block, const CDiskBlockPos& pos, const Consensu
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
-
-    // Read block
+    // Read block, straight from the mapped file if possible
     try {
-        filein >> block;
+        const unsigned char* pblock = NULL;
+        unsigned int nBlockSize = 0;
+        std::shared_ptr<const CMappedFile> mapping = MapBlockData(pos, pblock, nBlockSize);
+        if (mapping) {
+            CSpanReader reader(SER_DISK, CLIENT_VERSION, pblock, nBlockSize);
+            reader >> block;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+            filein >> block;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1747,6 +2037,45 @@ bool ReadBlockHeaderFromDisk(CBlockHeader& block, const CBlockIndex* pindex, con
     return ReadBlockOrHeader(block, pindex, consensusParams);
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    // WriteBlockToDisk stores the message start and the block size in front of the block.
+    static const unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(uint32_t);
+    if (pos.IsNull() || pos.nPos < nHeaderSize)
+        return error("%s: invalid position %s", __func__, pos.ToString());
+
+    const unsigned char* pblock = NULL;
+    unsigned int nBlockSize = 0;
+    std::shared_ptr<const CMappedFile> mapping = MapBlockData(pos, pblock, nBlockSize);
+    if (mapping) {
+        if (memcmp(pblock - nHeaderSize, messageStart, MESSAGE_START_SIZE))
+            return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+        block.assign(pblock, pblock + nBlockSize);
+        return true;
+    }
+
+    CDiskBlockPos posHeader(pos.nFile, pos.nPos - nHeaderSize);
+    CAutoFile filein(OpenBlockFile(posHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blk_start;
+        filein >> FLATDATA(blk_start) >> nBlockSize;
+        if (memcmp(blk_start, messageStart, MESSAGE_START_SIZE))
+            return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+        if (nBlockSize > MAX_BLOCKFILE_SIZE)
+            return error("%s: block size %u too large at %s", __func__, nBlockSize, pos.ToString());
+        block.resize(nBlockSize);
+        filein.read((char*)begin_ptr(block), nBlockSize);
+    } catch (const std::exception& e) {
+        return error("%s: Read from block file failed: %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1875,12 +2204,12 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
+    LOCK(cs_nodestate);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1916,6 +2245,7 @@ void static InvalidBlockFound(CBlockIndex *pindex, const CValidationState &state
     int nDoS = 0;
     if (state.IsInvalid(nDoS)) {
         std::map<uint256, NodeId>::iterator it = mapBlockSource.find(pindex->GetBlockHash());
+        LOCK(cs_nodestate);
         if (it != mapBlockSource.end() && State(it->second)) {
             assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
             CBlockReject reject = {(unsigned char)state.GetRejectCode(), state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), pindex->GetBlockHash()};
@@ -1938,24 +2268,14 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -1967,7 +2287,7 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
     const CScriptWitness *witness = (nIn < ptxTo->wit.vtxinwit.size()) ? &ptxTo->wit.vtxinwit[nIn].scriptWitness : NULL;
-    if (!VerifyScript(scriptSig, scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore, *txdata), &error)) {
         return false;
     }
     return true;
@@ -1993,20 +2313,20 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase()) {
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
+            if (coin.IsCoinBase()) {
+                if (nSpendHeight - (int)coin.nHeight < COINBASE_MATURITY)
                     return state.Invalid(false,
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
-                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight));
+                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - (int)coin.nHeight));
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -2026,7 +2346,7 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -2049,11 +2369,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2065,8 +2385,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                        CScriptCheck check2(coin.out, tx, i,
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -2163,34 +2483,30 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
+    if (view.HaveCoin(out))
+        fClean = error("%s: undo data overwriting existing output", __func__);
+
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return error("%s: undo data adding output to missing transaction", __func__);
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
     }
-    if (coins->IsAvailable(out.n))
-        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
@@ -2221,32 +2537,24 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight || tx.IsCoinBase() != coin.IsCoinBase())
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
             }
         }
@@ -2271,8 +2579,11 @@ void static FlushBlockFile(bool fFinalize = false)
 
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
+        if (fFinalize) {
+            // Do not keep a mapping that extends past the new end of file.
+            mappedblockfiles.Evict(nLastBlockFile);
             TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+        }
         FileCommit(fileOld);
         fclose(fileOld);
     }
@@ -2288,13 +2599,49 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(DEFAULT_SCRIPTCHECK_BATCH_SIZE);
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+void SetScriptCheckBatchSize(unsigned int nBatchSize) {
+    scriptcheckqueue.SetBatchSize(nBatchSize);
+}
+
+/**
+ * Closure representing the context-free checks of one block header (chain ID,
+ * auxpow merkle branches and proof of work). None of them needs cs_main.
+ */
+class CHeaderCheck
+{
+private:
+    const CBlockHeader *pheader;
+    const Consensus::Params *pparams;
+
+public:
+    CHeaderCheck(): pheader(NULL), pparams(NULL) {}
+    CHeaderCheck(const CBlockHeader& headerIn, const Consensus::Params& paramsIn) : pheader(&headerIn), pparams(&paramsIn) {}
+
+    bool operator()() {
+        CValidationState state;
+        return CheckBlockHeader(*pheader, state, *pparams);
+    }
+
+    void swap(CHeaderCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pparams, check.pparams);
+    }
+};
+
+static CCheckQueue<CHeaderCheck> headercheckqueue(16);
+
+void ThreadHeaderCheck() {
+    RenameThread("bitcoin-headerch");
+    headercheckqueue.Thread();
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2473,10 +2820,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -2515,7 +2863,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // Script checks are handed to the workers in batches as the loop below
+    // produces them, so they verify scripts while later transactions are
+    // still being connected.
+    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL, scriptcheckqueue.GetBatchSize());
 
     std::vector<uint256> vOrphanErase;
     std::vector<int> prevheights;
@@ -2526,6 +2877,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
@@ -2543,17 +2896,20 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // be in ConnectBlock because they require the UTXO set
             prevheights.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+                prevheights[j] = view.AccessCoin(tx.vin[j].prevout).nHeight;
             }
 
             // Which orphan pool entries must we evict?
-            for (size_t j = 0; j < tx.vin.size(); j++) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
-                if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
-                for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    vOrphanErase.push_back(orphanHash);
+            {
+                LOCK(cs_orphans);
+                for (size_t j = 0; j < tx.vin.size(); j++) {
+                    auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
+                    if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
+                    for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+                        const CTransaction& orphanTx = (*mi)->second.tx;
+                        const uint256& orphanHash = orphanTx.GetHash();
+                        vOrphanErase.push_back(orphanHash);
+                    }
                 }
             }
 
@@ -2572,13 +2928,19 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             return state.DoS(100, error("ConnectBlock(): too many sigops"),
                              REJECT_INVALID, "bad-blk-sigops");
 
+        // The precomputed hashes are only used by witness signatures, so
+        // leave them out of this serial loop when no witness is verified.
+        if (flags & SCRIPT_VERIFY_WITNESS)
+            txdata.emplace_back(tx);
+        else
+            txdata.emplace_back();
         if (!tx.IsCoinBase())
         {
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -2647,6 +3009,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     // Erase orphan transactions include or precluded by this block
     if (vOrphanErase.size()) {
+        LOCK(cs_orphans);
         int nErased = 0;
         BOOST_FOREACH(uint256 &orphanHash, vOrphanErase) {
             nErased += EraseOrphanTx(orphanHash);
@@ -2747,16 +3110,20 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // The write may still be in progress in the background; wait for it
+        // if the caller needs the state to be on disk.
+        if (pcoinsWriteBehind && mode == FLUSH_STATE_ALWAYS && !pcoinsWriteBehind->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -3732,7 +4099,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckPOW=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3751,7 +4118,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), fCheckPOW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3779,6 +4146,25 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
     return true;
 }
 
+/** Queue the outputs spent by a block for pcoinsPrefetch, except for those created in the block itself or already cached. */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    std::set<uint256> setCreated;
+    for (const CTransaction& tx : block.vtx)
+        setCreated.insert(tx.GetHash());
+    std::vector<COutPoint> vOutpoints;
+    for (const CTransaction& tx : block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        for (const CTxIn& txin : tx.vin) {
+            if (!setCreated.count(txin.prevout.hash) && !pcoinsTip->HaveCoinInCache(txin.prevout))
+                vOutpoints.push_back(txin.prevout);
+        }
+    }
+    pcoinsPrefetch->Prefetch(vOutpoints);
+}
+
 /** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
 static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
 {
@@ -3840,6 +4226,11 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
         return AbortNode(state, std::string("System error: ") + e.what());
     }
 
+    // Get the inputs of a block that is about to be connected read into
+    // memory while it waits for its turn.
+    if (pcoinsPrefetch && fHasMoreWork)
+        PrefetchBlockInputs(block);
+
     if (fCheckForPruning)
         FlushStateToDisk(state, FLUSH_STATE_NONE); // we just allocated more disk space for block files
 
@@ -3863,7 +4254,11 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, C
 {
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested;
+        {
+            LOCK(cs_nodestate);
+            fRequested = MarkBlockAsReceived(pblock->GetHash());
+        }
         fRequested |= fForceProcessing;
 
         // Store to disk
@@ -3964,6 +4359,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        mappedblockfiles.Evict(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4390,21 +4786,29 @@ void UnloadBlockIndex()
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
-    nSyncStarted = 0;
+    {
+        LOCK(cs_orphans);
+        mapOrphanTransactions.clear();
+        mapOrphanTransactionsByPrev.clear();
+    }
+    {
+        LOCK(cs_nodestate);
+        nSyncStarted = 0;
+        mapBlocksInFlight.clear();
+        nPreferredDownload = 0;
+        mapNodeState.clear();
+    }
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
     nBlockSequenceId = 1;
     mapBlockSource.clear();
-    mapBlocksInFlight.clear();
-    nPreferredDownload = 0;
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
-    mapNodeState.clear();
     recentRejects.reset(NULL);
     versionbitscache.Clear();
+    ClearRetargetCache();
+    mappedblockfiles.Clear();
     for (int b = 0; b < VERSIONBITS_NUM_BITS; b++) {
         warningcache[b].clear();
     }
@@ -4467,10 +4871,122 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
+namespace {
+// Map of disk positions for blocks with unknown parent (only used for reindex)
+std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+}
+
+/**
+ * Hand a block read from a block file to AcceptBlock, unless its parent is
+ * not known yet, in which case it is set aside until it is. Then process the
+ * blocks that were set aside waiting for this one. Returns false if
+ * importing should stop.
+ */
+static bool ImportBlock(const CChainParams& chainparams, CBlock& block, CDiskBlockPos* dbp, int& nLoaded)
+{
+    uint256 hash = block.GetHash();
+    {
+        LOCK(cs_main);
+        // detect out of order blocks, and store them for later
+        if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+            LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                    block.hashPrevBlock.ToString());
+            if (dbp)
+                mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+            return true;
+        }
+
+        // process in case the block isn't known yet
+        if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+            CValidationState state;
+            if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL))
+                nLoaded++;
+            if (state.IsError())
+                return false;
+        } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+            LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+        }
+    }
+
+    // Activate the genesis block so normal node progress can continue
+    if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+        CValidationState state;
+        if (!ActivateBestChain(state, chainparams)) {
+            return false;
+        }
+    }
+
+    NotifyHeaderTip();
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+            {
+                LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                        head.ToString());
+                LOCK(cs_main);
+                CValidationState dummy;
+                if (AcceptBlock(block, dummy, chainparams, NULL, true, &it->second, NULL))
+                {
+                    nLoaded++;
+                    queue.push_back(block.GetHash());
+                }
+            }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+            NotifyHeaderTip();
+        }
+    }
+    return true;
+}
+
+/**
+ * Find the next block in a block file, by its network magic and size. On
+ * success the file is positioned at the start of the block, limited to its
+ * end, and nRewind is where to look for the next one should reading this
+ * one fail. Returns false at the end of the file.
+ */
+static bool FindNextBlock(const CChainParams& chainparams, CBufferedFile& blkdat, uint64_t& nRewind, unsigned int& nSize)
+{
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(chainparams.MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            return false;
+        }
+        uint64_t nBlockPos = blkdat.GetPos();
+        blkdat.SetLimit(nBlockPos + nSize);
+        blkdat.SetPos(nBlockPos);
+        return true;
+    }
+    return false;
+}
+
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
@@ -4478,108 +4994,382 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
-
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
+        unsigned int nSize = 0;
+        while (FindNextBlock(chainparams, blkdat, nRewind, nSize)) {
             try {
                 // read block
-                uint64_t nBlockPos = blkdat.GetPos();
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
+                    dbp->nPos = blkdat.GetPos();
                 CBlock block;
                 blkdat >> block;
                 nRewind = blkdat.GetPos();
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                if (!ImportBlock(chainparams, block, dbp, nLoaded))
+                    break;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+    if (nLoaded > 0)
+        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
+
+namespace {
+/** A block found in a block file by -reindex */
+struct CReindexBlock {
+    CDiskBlockPos pos;
+    unsigned int nSize;
+    //! The block as read from the file, until it is deserialized
+    std::unique_ptr<CDataStream> pdata;
+    CBlock block;
+    //! Whether the block was deserialized (successfully or not)
+    bool fParsed;
+    bool fValid;
+    //! Blocks found again in the bytes of a block that failed to deserialize or was shorter than nSize
+    std::vector<std::pair<CDiskBlockPos, CBlock> > vRescanned;
+
+    CReindexBlock(const CDiskBlockPos& posIn, unsigned int nSizeIn) : pos(posIn), nSize(nSizeIn), pdata(new CDataStream(SER_DISK, CLIENT_VERSION)), fParsed(false), fValid(false) {}
+};
+typedef std::shared_ptr<CReindexBlock> CReindexBlockRef;
+
+/** The blocks found in one block file, in the order they are in it */
+struct CReindexFile {
+    std::deque<CReindexBlockRef> blocks;
+    //! Whether the whole file was read
+    bool fRead;
+
+    CReindexFile() : fRead(false) {}
+};
+
+/**
+ * Reads, deserializes and imports the block files in three stages. Readers
+ * each take a file at a time and find the blocks in it; parsers deserialize
+ * the blocks and run the context-free checks on them, in any order; and the
+ * sequencer hands them to AcceptBlock in the order of the files, and of the
+ * blocks within each file, as a serial reindex would. Readers skip the whole
+ * size a block claims, so when a block fails to deserialize, or is shorter
+ * than that, its parser looks for blocks in those bytes again.
+ *
+ * Readers stay at most REINDEX_READER_THREADS files, and
+ * REINDEX_MAX_READ_AHEAD bytes, ahead of the sequencer; the file the
+ * sequencer is waiting on is always read.
+ */
+class CReindexPipeline
+{
+private:
+    const CChainParams& chainparams;
+
+    boost::mutex mutex;
+    boost::condition_variable condReader;
+    boost::condition_variable condParser;
+    boost::condition_variable condSequencer;
+    bool fStop;
+
+    //! The next file a reader is to take
+    int nNextFile;
+    //! The first file that does not exist (or could not be opened)
+    int nEndFile;
+    //! The file the sequencer imports from
+    int nSequencing;
+    int nReadersRunning;
+    std::map<int, CReindexFile> mapFiles;
+    std::deque<CReindexBlockRef> queueParse;
+    //! Bytes of blocks read but not yet imported
+    uint64_t nReadAhead;
+
+    // Statistics, for the progress reports
+    uint64_t nBlocksRead;
+    uint64_t nBytesRead;
+    uint64_t nBlocksParsed;
+    uint64_t nBlocksImported;
+    int64_t nReadMicros;
+    int64_t nParseMicros;
+    int64_t nImportMicros;
+    int64_t nSequencerWaitMicros;
+
+    boost::thread_group threads;
+
+    void ThreadRead()
+    {
+        RenameThread("bitcoin-reindexrd");
+        while (true) {
+            int nFile;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNextFile < nEndFile && nNextFile >= nSequencing + REINDEX_READER_THREADS)
+                    condReader.wait(lock);
+                if (fStop || nNextFile >= nEndFile)
+                    break;
+                nFile = nNextFile++;
+                mapFiles[nFile];
+            }
+
+            CDiskBlockPos pos(nFile, 0);
+            FILE* file = NULL;
+            if (boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+                file = OpenBlockFile(pos, true); // Errors are logged in OpenBlockFile
+            if (!file) {
+                // No block files left to reindex
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nEndFile = std::min(nEndFile, nFile);
+                mapFiles.erase(nFile);
+                condSequencer.notify_all();
+                condReader.notify_all();
+                break;
+            }
+            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+            ReadFile(file, pos);
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (--nReadersRunning == 0)
+            condParser.notify_all();
+    }
+
+    void ReadFile(FILE* file, CDiskBlockPos pos)
+    {
+        int64_t nTime = GetTimeMicros();
+        try {
+            // This takes over file and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(file, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            unsigned int nSize = 0;
+            while (FindNextBlock(chainparams, blkdat, nRewind, nSize)) {
+                pos.nPos = blkdat.GetPos();
+                CReindexBlockRef pblock = std::make_shared<CReindexBlock>(pos, nSize);
+                try {
+                    pblock->pdata->resize(nSize);
+                    blkdat.read(&(*pblock->pdata)[0], nSize);
+                    nRewind = blkdat.GetPos();
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: I/O error - %s\n", __func__, e.what());
                     continue;
                 }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    LOCK(cs_main);
-                    CValidationState state;
-                    if (AcceptBlock(block, state, chainparams, NULL, true, dbp, NULL))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+                int64_t nNow = GetTimeMicros();
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nReadMicros += nNow - nTime;
+                while (!fStop && pos.nFile != nSequencing && nReadAhead > REINDEX_MAX_READ_AHEAD)
+                    condReader.wait(lock);
+                if (fStop)
+                    return;
+                nTime = GetTimeMicros();
+                nReadAhead += nSize;
+                nBlocksRead++;
+                nBytesRead += nSize;
+                mapFiles[pos.nFile].blocks.push_back(pblock);
+                queueParse.push_back(pblock);
+                condParser.notify_one();
+            }
+        } catch (const std::runtime_error& e) {
+            AbortNode(std::string("System error: ") + e.what());
+        }
 
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
-                    }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nReadMicros += GetTimeMicros() - nTime;
+        mapFiles[pos.nFile].fRead = true;
+        condSequencer.notify_all();
+    }
+
+    void ThreadParse()
+    {
+        RenameThread("bitcoin-reindexps");
+        while (true) {
+            CReindexBlockRef pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && queueParse.empty() && nReadersRunning > 0)
+                    condParser.wait(lock);
+                if (fStop || queueParse.empty())
+                    return;
+                pblock = queueParse.front();
+                queueParse.pop_front();
+            }
+
+            int64_t nTime = GetTimeMicros();
+            try {
+                *pblock->pdata >> pblock->block;
+                pblock->fValid = true;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize error in blk%05u.dat at %u - %s\n", __func__, pblock->pos.nFile, pblock->pos.nPos, e.what());
+            }
+            // Like a serial reindex, look for blocks again from the byte after
+            // the magic of a block that did not deserialize, or from the end of
+            // one that left bytes over.
+            if (!pblock->fValid)
+                Rescan(*pblock, pblock->pos.nPos - (MESSAGE_START_SIZE + sizeof(unsigned int)) + 1);
+            else if (!pblock->pdata->empty())
+                Rescan(*pblock, pblock->pos.nPos + pblock->nSize - pblock->pdata->size());
+            pblock->pdata.reset();
+            if (pblock->fValid) {
+                // This only saves AcceptBlock the work; should the block be
+                // invalid, AcceptBlock finds out again and marks it as such.
+                CValidationState state;
+                CheckBlock(pblock->block, state, chainparams.GetConsensus());
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nParseMicros += GetTimeMicros() - nTime;
+            nBlocksParsed++;
+            pblock->fParsed = true;
+            condSequencer.notify_all();
+        }
+    }
+
+    //! Find and deserialize the blocks that start between nPos and the end of rblock
+    void Rescan(CReindexBlock& rblock, uint64_t nPos)
+    {
+        uint64_t nEnd = rblock.pos.nPos + rblock.nSize;
+        FILE* file = OpenBlockFile(CDiskBlockPos(rblock.pos.nFile, nPos), true);
+        if (!file)
+            return;
+        try {
+            // This takes over file and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(file, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            unsigned int nSize = 0;
+            while (FindNextBlock(chainparams, blkdat, nRewind, nSize)) {
+                CDiskBlockPos pos(rblock.pos.nFile, nPos + blkdat.GetPos());
+                // The readers found the blocks that start further on
+                if (pos.nPos - (MESSAGE_START_SIZE + sizeof(unsigned int)) >= nEnd)
+                    break;
+                try {
+                    CBlock block;
+                    blkdat >> block;
+                    nRewind = blkdat.GetPos();
+                    rblock.vRescanned.push_back(std::make_pair(pos, block));
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: Deserialize or I/O error in blk%05u.dat at %u - %s\n", __func__, pos.nFile, pos.nPos, e.what());
                 }
+            }
+        } catch (const std::runtime_error& e) {
+            AbortNode(std::string("System error: ") + e.what());
+        }
+    }
 
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (AcceptBlock(block, dummy, chainparams, NULL, true, &it->second, NULL))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
+    //! Import a block, unless importing from its file stopped already
+    void Import(CBlock& block, CDiskBlockPos& pos, int& nLoaded, int& nStopFile)
+    {
+        if (pos.nFile == nStopFile)
+            return;
+        try {
+            if (!ImportBlock(chainparams, block, &pos, nLoaded))
+                nStopFile = pos.nFile;
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+
+public:
+    CReindexPipeline(const CChainParams& chainparamsIn, int nParserThreads) : chainparams(chainparamsIn), fStop(false), nNextFile(0), nEndFile(std::numeric_limits<int>::max()), nSequencing(0), nReadersRunning(REINDEX_READER_THREADS), nReadAhead(0),
+        nBlocksRead(0), nBytesRead(0), nBlocksParsed(0), nBlocksImported(0), nReadMicros(0), nParseMicros(0), nImportMicros(0), nSequencerWaitMicros(0)
+    {
+        for (int i = 0; i < REINDEX_READER_THREADS; i++)
+            threads.create_thread(boost::bind(&CReindexPipeline::ThreadRead, this));
+        for (int i = 0; i < nParserThreads; i++)
+            threads.create_thread(boost::bind(&CReindexPipeline::ThreadParse, this));
+    }
+
+    ~CReindexPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condReader.notify_all();
+        condParser.notify_all();
+        threads.interrupt_all();
+        threads.join_all();
+    }
+
+    //! Import the blocks as they come out of the parsers
+    bool Run()
+    {
+        int64_t nStart = GetTimeMicros();
+        int64_t nLastReport = nStart;
+        uint64_t nLastBytes = 0, nLastParsed = 0, nLastImported = 0;
+        int nLoaded = 0;
+        // A block file that importing stopped at, as a serial reindex stops
+        // at the rest of the file
+        int nStopFile = -1;
+        while (true) {
+            CReindexBlockRef pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                int64_t nWaitStart = GetTimeMicros();
+                while (true) {
+                    if (nSequencing >= nEndFile)
+                        break;
+                    std::map<int, CReindexFile>::iterator it = mapFiles.find(nSequencing);
+                    if (it != mapFiles.end()) {
+                        CReindexFile& file = it->second;
+                        if (!file.blocks.empty() && file.blocks.front()->fParsed) {
+                            pblock = file.blocks.front();
+                            file.blocks.pop_front();
+                            break;
+                        }
+                        if (file.blocks.empty() && file.fRead) {
+                            mapFiles.erase(it);
+                            nSequencing++;
+                            condReader.notify_all();
+                            continue;
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
                     }
+                    condSequencer.wait(lock);
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                nSequencerWaitMicros += GetTimeMicros() - nWaitStart;
+                if (!pblock)
+                    break;
+                nReadAhead -= pblock->nSize;
+                condReader.notify_all();
+            }
+
+            int64_t nTime = GetTimeMicros();
+            if (pblock->fValid)
+                Import(pblock->block, pblock->pos, nLoaded, nStopFile);
+            for (std::pair<CDiskBlockPos, CBlock>& rescanned : pblock->vRescanned)
+                Import(rescanned.second, rescanned.first, nLoaded, nStopFile);
+            nImportMicros += GetTimeMicros() - nTime;
+            nBlocksImported++;
+            pblock.reset();
+
+            if (nTime - nLastReport > 10 * 1000000) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                double dSeconds = (nTime - nLastReport) * 0.000001;
+                LogPrintf("Reindex: read %u blocks (%.1f MiB/s), parsed %u (%.1f/s), processed %u (%.1f/s); %.1f MiB read ahead\n",
+                    nBlocksRead, (nBytesRead - nLastBytes) / dSeconds / (1 << 20),
+                    nBlocksParsed, (nBlocksParsed - nLastParsed) / dSeconds,
+                    nBlocksImported, (nBlocksImported - nLastImported) / dSeconds,
+                    nReadAhead / (double)(1 << 20));
+                nLastReport = nTime;
+                nLastBytes = nBytesRead;
+                nLastParsed = nBlocksParsed;
+                nLastImported = nBlocksImported;
             }
         }
-    } catch (const std::runtime_error& e) {
-        AbortNode(std::string("System error: ") + e.what());
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        LogPrintf("Reindex: processed %u blocks from %d files in %.2fs. Readers spent %.2fs reading %u blocks (%.1f MiB), parsers %.2fs parsing them, the importer %.2fs importing and %.2fs waiting\n",
+            nBlocksImported, nSequencing, (GetTimeMicros() - nStart) * 0.000001,
+            nReadMicros * 0.000001, nBlocksRead, nBytesRead / (double)(1 << 20),
+            nParseMicros * 0.000001, nImportMicros * 0.000001, nSequencerWaitMicros * 0.000001);
+        if (nLoaded > 0)
+            LogPrintf("Loaded %i blocks from block files\n", nLoaded);
+        return nLoaded > 0;
     }
-    if (nLoaded > 0)
-        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+};
+}
+
+bool ReindexBlockFiles(const CChainParams& chainparams, int nParserThreads)
+{
+    nParserThreads = std::max(1, nParserThreads);
+    LogPrintf("Reindexing block files, with %d reader and %d parser threads...\n", REINDEX_READER_THREADS, nParserThreads);
+    CReindexPipeline pipeline(chainparams, nParserThreads);
+    return pipeline.Run();
 }
 
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
@@ -4838,12 +5628,18 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
-            // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
+            if (recentRejects->contains(inv.hash) || mempool.exists(inv.hash))
+                return true;
+            {
+                LOCK(cs_orphans);
+                if (mapOrphanTransactions.count(inv.hash))
+                    return true;
+            }
+
+            // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
             // requesting or processing some txs which have already been included in a block
-            return recentRejects->contains(inv.hash) ||
-                   mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoinsInCache(inv.hash);
+            return pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
     case MSG_WITNESS_BLOCK:
@@ -4859,8 +5655,9 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
+    // Only blocks need cs_main; transactions are served from the relay map
+    // and the mempool, which have locks of their own, so they do not have to
+    // wait for a block being connected.
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4873,6 +5670,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
             {
+                LOCK(cs_main);
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
@@ -4907,11 +5705,23 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
+                    // Plain block requests can be served with the bytes stored
+                    // on disk, skipping a deserialize/reserialize round-trip.
+                    // Those include witness data, so without witness
+                    // serialization this only works for blocks that cannot
+                    // have any.
+                    std::vector<unsigned char> vRawBlock;
+                    bool fRaw = (inv.type == MSG_WITNESS_BLOCK ||
+                                 (inv.type == MSG_BLOCK && !IsWitnessEnabled(mi->second->pprev, consensusParams))) &&
+                                ReadRawBlockFromDisk(vRawBlock, mi->second, Params().MessageStart());
+
                     // Send block from disk
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                    if (!fRaw && !ReadBlockFromDisk(block, (*mi).second, consensusParams))
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
+                    if (fRaw)
+                        pfrom->PushMessage(NetMsgType::BLOCK, CFlatData(vRawBlock));
+                    else if (inv.type == MSG_BLOCK)
                         pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
                     else if (inv.type == MSG_WITNESS_BLOCK)
                         pfrom->PushMessage(NetMsgType::BLOCK, block);
@@ -4965,9 +5775,15 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             {
                 // Send stream from relay memory
                 bool push = false;
-                auto mi = mapRelay.find(inv.hash);
-                if (mi != mapRelay.end()) {
-                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *mi->second);
+                std::shared_ptr<const CTransaction> txRelay;
+                {
+                    LOCK(cs_relay);
+                    auto mi = mapRelay.find(inv.hash);
+                    if (mi != mapRelay.end())
+                        txRelay = mi->second;
+                }
+                if (txRelay) {
+                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *txRelay);
                     push = true;
                 } else if (pfrom->timeLastMempoolReq) {
                     auto txinfo = mempool.info(inv.hash);
@@ -5007,7 +5823,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
 uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params& chainparams) {
     uint32_t nFetchFlags = 0;
-    if (IsWitnessEnabled(pprev, chainparams) && State(pfrom->GetId())->fHaveWitness) {
+    if (IsWitnessEnabled(pprev, chainparams) && PeerHasWitness(pfrom->GetId())) {
         nFetchFlags |= MSG_WITNESS_FLAG;
     }
     return nFetchFlags;
@@ -5029,7 +5845,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                strCommand == NetMsgType::FILTERCLEAR))
     {
         if (pfrom->nVersion >= NO_BLOOM_VERSION) {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
             return false;
         } else {
@@ -5045,7 +5860,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pfrom->nVersion != 0)
         {
             pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_DUPLICATE, string("Duplicate version message"));
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 1);
             return false;
         }
@@ -5121,13 +5935,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         if((pfrom->nServices & NODE_WITNESS))
         {
-            LOCK(cs_main);
+            LOCK(cs_nodestate);
             State(pfrom->GetId())->fHaveWitness = true;
         }
 
         // Potentially mark this peer as a preferred download peer.
         {
-        LOCK(cs_main);
+        LOCK(cs_nodestate);
         UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
         }
 
@@ -5187,7 +6001,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (pfrom->nVersion == 0)
     {
         // Must have a version message before anything else
-        LOCK(cs_main);
         Misbehaving(pfrom->GetId(), 1);
         return false;
     }
@@ -5199,7 +6012,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // Mark this node as currently connected, so we update its timestamp later.
         if (pfrom->fNetworkNode) {
-            LOCK(cs_main);
+            LOCK(cs_nodestate);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
 
@@ -5233,7 +6046,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         if (vAddr.size() > 1000)
         {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message addr size() = %u", vAddr.size());
         }
@@ -5290,7 +6102,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == NetMsgType::SENDHEADERS)
     {
-        LOCK(cs_main);
+        LOCK(cs_nodestate);
         State(pfrom->GetId())->fPreferHeaders = true;
     }
 
@@ -5300,7 +6112,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint64_t nCMPCTBLOCKVersion = 1;
         vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
         if (nCMPCTBLOCKVersion == 1) {
-            LOCK(cs_main);
+            LOCK(cs_nodestate);
             State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
             State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
         }
@@ -5313,7 +6125,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message inv size() = %u", vInv.size());
         }
@@ -5344,6 +6155,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
 
             if (inv.type == MSG_BLOCK) {
+                LOCK(cs_nodestate);
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
                     // First request the headers preceding the announced block. In the normal fully-synced
@@ -5400,7 +6212,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> vInv;
         if (vInv.size() > MAX_INV_SZ)
         {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message getdata size() = %u", vInv.size());
         }
@@ -5465,6 +6276,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         BlockTransactionsRequest req;
         vRecv >> req;
 
+        LOCK(cs_main);
+
         BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
         if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
             Misbehaving(pfrom->GetId(), 100);
@@ -5505,7 +6318,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
-        CNodeState *nodestate = State(pfrom->GetId());
         CBlockIndex* pindex = NULL;
         if (locator.IsNull())
         {
@@ -5557,7 +6369,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // if our peer has chainActive.Tip() (and thus we are sending an empty
             // headers message). In both cases it's safe to update
             // pindexBestHeaderSent to be our tip.
-            nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
+            {
+                LOCK(cs_nodestate);
+                State(pfrom->GetId())->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
+            }
             pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
         }
     }
@@ -5581,6 +6396,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // The context-free checks don't need cs_main, so run them before
+        // taking it rather than holding up the other message handlers.
+        CValidationState stateCheck;
+        bool fCheckOk = CheckTransaction(tx, stateCheck);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
@@ -5589,7 +6409,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv.hash);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
+        bool fAccepted = false;
+        if (!AlreadyHave(inv)) {
+            if (fCheckOk)
+                fAccepted = AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, 0, true);
+            else
+                state = stateCheck;
+        }
+        if (fAccepted) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
             for (unsigned int i = 0; i < tx.vout.size(); i++) {
@@ -5604,61 +6431,64 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
             // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
+            {
+                LOCK(cs_orphans);
+                set<NodeId> setMisbehaving;
+                while (!vWorkQueue.empty()) {
+                    auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+                    vWorkQueue.pop_front();
+                    if (itByPrev == mapOrphanTransactionsByPrev.end())
+                        continue;
+                    for (auto mi = itByPrev->second.begin();
+                         mi != itByPrev->second.end();
+                         ++mi)
+                    {
+                        const CTransaction& orphanTx = (*mi)->second.tx;
+                        const uint256& orphanHash = orphanTx.GetHash();
+                        NodeId fromPeer = (*mi)->second.fromPeer;
+                        bool fMissingInputs2 = false;
+                        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                        // anyone relaying LegitTxX banned)
+                        CValidationState stateDummy;
 
 
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
+                        if (setMisbehaving.count(fromPeer))
+                            continue;
+                        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+                            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                            RelayTransaction(orphanTx);
+                            for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
+                                vWorkQueue.emplace_back(orphanHash, i);
+                            }
+                            vEraseQueue.push_back(orphanHash);
                         }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0 && (!state.CorruptionPossible() || State(fromPeer)->fHaveWitness))
+                        else if (!fMissingInputs2)
                         {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!stateDummy.CorruptionPossible()) {
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
+                            int nDos = 0;
+                            if (stateDummy.IsInvalid(nDos) && nDos > 0 && (!state.CorruptionPossible() || PeerHasWitness(fromPeer)))
+                            {
+                                // Punish peer that gave us an invalid orphan tx
+                                Misbehaving(fromPeer, nDos);
+                                setMisbehaving.insert(fromPeer);
+                                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                            }
+                            // Has inputs but not accepted to mempool
+                            // Probably non-standard or insufficient fee/priority
+                            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                            vEraseQueue.push_back(orphanHash);
+                            if (!stateDummy.CorruptionPossible()) {
+                                assert(recentRejects);
+                                recentRejects->insert(orphanHash);
+                            }
                         }
+                        mempool.check(pcoinsTip);
                     }
-                    mempool.check(pcoinsTip);
                 }
-            }
 
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+                BOOST_FOREACH(uint256 hash, vEraseQueue)
+                    EraseOrphanTx(hash);
+            }
         }
         else if (fMissingInputs)
         {
@@ -5718,7 +6548,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
                 pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
                                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0 && (!state.CorruptionPossible() || State(pfrom->id)->fHaveWitness)) {
+            if (nDoS > 0 && (!state.CorruptionPossible() || PeerHasWitness(pfrom->id))) {
                 // When a non-witness-supporting peer gives us a transaction that would
                 // be accepted if witness validation was off, we can't blame them for it.
                 Misbehaving(pfrom->GetId(), nDoS);
@@ -5756,97 +6586,121 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // If AcceptBlockHeader returned true, it set pindex
         assert(pindex);
-        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
 
-        std::map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
-        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+        // The in-flight bookkeeping needs cs_nodestate, which must not be held
+        // while a block is connected, so what the compact block turns into is
+        // processed after letting go of it.
+        bool fBlockReconstructed = false;
+        bool fRevertToHeaderProcessing = false;
+        {
+            LOCK(cs_nodestate);
+            UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
 
-        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
-            return true;
+            std::map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+            bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
 
-        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
-                pindex->nTx != 0) { // We had this block at some point, but pruned it
-            if (fAlreadyInFlight) {
-                // We requested this block for some reason, but our mempool will probably be useless
-                // so we just grab the block via normal getdata
-                std::vector<CInv> vInv(1);
-                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
-                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+            if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
                 return true;
+
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                    pindex->nTx != 0) { // We had this block at some point, but pruned it
+                if (fAlreadyInFlight) {
+                    // We requested this block for some reason, but our mempool will probably be useless
+                    // so we just grab the block via normal getdata
+                    std::vector<CInv> vInv(1);
+                    vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                    pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                    return true;
+                }
             }
-        }
 
-        // If we're not close to tip yet, give up and let parallel block fetch work its magic
-        if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
-            return true;
+            // If we're not close to tip yet, give up and let parallel block fetch work its magic
+            if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+                return true;
 
-        CNodeState *nodestate = State(pfrom->GetId());
+            CNodeState *nodestate = State(pfrom->GetId());
+
+            // We want to be a bit conservative just to be extra careful about DoS
+            // possibilities in compact block processing...
+            if (pindex->nHeight <= chainActive.Height() + 2) {
+                if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                     (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                    list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+                    if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
+                        if (!(*queuedBlockIt)->partialBlock)
+                            (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                        else {
+                            // The block was already in flight using compact blocks from the same peer
+                            LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                            return true;
+                        }
+                    }
 
-        // We want to be a bit conservative just to be extra careful about DoS
-        // possibilities in compact block processing...
-        if (pindex->nHeight <= chainActive.Height() + 2) {
-            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
-                 (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
-                list<QueuedBlock>::iterator *queuedBlockIt = NULL;
-                if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
-                    if (!(*queuedBlockIt)->partialBlock)
-                        (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
-                    else {
-                        // The block was already in flight using compact blocks from the same peer
-                        LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                    PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                    ReadStatus status = partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                    if (status == READ_STATUS_INVALID) {
+                        MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                        Misbehaving(pfrom->GetId(), 100);
+                        LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                        return true;
+                    } else if (status == READ_STATUS_FAILED) {
+                        // Duplicate txindexes, the block is now in-flight, so just request it
+                        std::vector<CInv> vInv(1);
+                        vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                        pfrom->PushMessage(NetMsgType::GETDATA, vInv);
                         return true;
                     }
-                }
 
-                PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
-                ReadStatus status = partialBlock.InitData(cmpctblock);
-                if (status == READ_STATUS_INVALID) {
-                    MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
-                    Misbehaving(pfrom->GetId(), 100);
-                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
-                    return true;
-                } else if (status == READ_STATUS_FAILED) {
-                    // Duplicate txindexes, the block is now in-flight, so just request it
+                    BlockTransactionsRequest req;
+                    for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                        if (!partialBlock.IsTxAvailable(i))
+                            req.indexes.push_back(i);
+                    }
+                    compactBlockStats.nBlocks++;
+                    compactBlockStats.nTxPrefilled += partialBlock.GetPrefilledCount();
+                    compactBlockStats.nTxMempool += partialBlock.GetMempoolCount();
+                    compactBlockStats.nTxExtra += partialBlock.GetExtraCount();
+                    compactBlockStats.nTxRequested += req.indexes.size();
+                    if (req.indexes.empty())
+                        compactBlockStats.nBlocksComplete++;
+                    if (req.indexes.empty()) {
+                        fBlockReconstructed = true;
+                    } else {
+                        req.blockhash = pindex->GetBlockHash();
+                        pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+                    }
+                }
+            } else {
+                if (fAlreadyInFlight) {
+                    // We requested this block, but its far into the future, so our
+                    // mempool will probably be useless - request the block normally
                     std::vector<CInv> vInv(1);
                     vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
                     pfrom->PushMessage(NetMsgType::GETDATA, vInv);
                     return true;
-                }
-
-                BlockTransactionsRequest req;
-                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
-                    if (!partialBlock.IsTxAvailable(i))
-                        req.indexes.push_back(i);
-                }
-                if (req.indexes.empty()) {
-                    // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
-                    BlockTransactions txn;
-                    txn.blockhash = cmpctblock.header.GetHash();
-                    CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
-                    blockTxnMsg << txn;
-                    return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived, chainparams);
                 } else {
-                    req.blockhash = pindex->GetBlockHash();
-                    pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+                    // If this was an announce-cmpctblock, we want the same treatment as a header message
+                    fRevertToHeaderProcessing = true;
                 }
             }
-        } else {
-            if (fAlreadyInFlight) {
-                // We requested this block, but its far into the future, so our
-                // mempool will probably be useless - request the block normally
-                std::vector<CInv> vInv(1);
-                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
-                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
-                return true;
-            } else {
-                // If this was an announce-cmpctblock, we want the same treatment as a header message
-                // Dirty hack to process as if it were just a headers message (TODO: move message handling into their own functions)
-                std::vector<CBlock> headers;
-                headers.push_back(cmpctblock.header);
-                CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
-                vHeadersMsg << headers;
-                return ProcessMessage(pfrom, NetMsgType::HEADERS, vHeadersMsg, nTimeReceived, chainparams);
-            }
+        }
+
+        if (fBlockReconstructed) {
+            // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
+            BlockTransactions txn;
+            txn.blockhash = cmpctblock.header.GetHash();
+            CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
+            blockTxnMsg << txn;
+            return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived, chainparams);
+        }
+
+        if (fRevertToHeaderProcessing) {
+            // Dirty hack to process as if it were just a headers message (TODO: move message handling into their own functions)
+            std::vector<CBlock> headers;
+            headers.push_back(cmpctblock.header);
+            CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
+            vHeadersMsg << headers;
+            return ProcessMessage(pfrom, NetMsgType::HEADERS, vHeadersMsg, nTimeReceived, chainparams);
         }
 
         CheckBlockIndex(chainparams.GetConsensus());
@@ -5859,18 +6713,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
-        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
-        if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
-                it->second.first != pfrom->GetId()) {
-            LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
-            return true;
-        }
-
-        PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
         CBlock block;
-        ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+        ReadStatus status;
+        {
+            LOCK(cs_nodestate);
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+            status = partialBlock.FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID)
+                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+        }
         if (status == READ_STATUS_INVALID) {
-            MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
             Misbehaving(pfrom->GetId(), 100);
             LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
             return true;
@@ -5888,7 +6747,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
                                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
                 if (nDoS > 0) {
-                    LOCK(cs_main);
                     Misbehaving(pfrom->GetId(), nDoS);
                 }
             }
@@ -5903,7 +6761,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
         unsigned int nCount = ReadCompactSize(vRecv);
         if (nCount > MAX_HEADERS_RESULTS) {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("headers message count = %u", nCount);
         }
@@ -5921,6 +6778,32 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        // Run the context-free checks of all headers we don't know yet on the
+        // header check threads before taking cs_main; only linking them into
+        // the block index has to be serialized. If any of them fails, the
+        // headers are checked one by one below so the failure is handled (and
+        // the preceding headers accepted) exactly as before.
+        bool fHeadersChecked = false;
+        if (nScriptCheckThreads && nCount > 1) {
+            std::vector<uint256> vHashes;
+            vHashes.reserve(nCount);
+            BOOST_FOREACH(const CBlockHeader& header, headers)
+                vHashes.push_back(header.GetHash());
+
+            std::vector<CHeaderCheck> vChecks;
+            {
+                LOCK(cs_main);
+                for (unsigned int n = 0; n < nCount; n++) {
+                    if (!mapBlockIndex.count(vHashes[n]))
+                        vChecks.push_back(CHeaderCheck(headers[n], chainparams.GetConsensus()));
+                }
+            }
+
+            CCheckQueueControl<CHeaderCheck> control(&headercheckqueue);
+            control.Add(vChecks);
+            fHeadersChecked = control.Wait();
+        }
+
         {
         LOCK(cs_main);
 
@@ -5943,7 +6826,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, !fHeadersChecked)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -5954,6 +6837,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         assert(pindexLast);
+        LOCK(cs_nodestate);
         UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
         bool maxSize = (nCount == MAX_HEADERS_RESULTS);
@@ -6050,7 +6934,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
                                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
             if (nDoS > 0) {
-                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), nDoS);
             }
         }
@@ -6078,7 +6961,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -6195,7 +7081,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (!filter.IsWithinSizeConstraints())
         {
             // There is no excuse for sending a too-large filter
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
         }
         else
@@ -6217,7 +7102,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         // and thus, the maximum size any matched object can have) in a filteradd message
         if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
         {
-            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
         } else {
             LOCK(pfrom->cs_filter);
@@ -6225,7 +7109,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->pfilter->insert(vData);
             else
             {
-                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), 100);
             }
         }
@@ -6483,6 +7366,7 @@ bool SendMessages(CNode* pto)
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_vAddrToSend);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -6507,6 +7391,7 @@ bool SendMessages(CNode* pto)
                 pto->vAddrToSend.shrink_to_fit();
         }
 
+        LOCK(cs_nodestate);
         CNodeState &state = *State(pto->GetId());
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
@@ -6793,6 +7678,7 @@ bool SendMessages(CNode* pto)
                     vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
                     {
+                        LOCK(cs_relay);
                         // Expire old relay messages
                         while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
                         {
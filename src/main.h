@@ -33,6 +33,9 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewDB;
+class CCoinsViewPrefetch;
+class CCoinsViewWriteBehind;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
@@ -41,6 +44,7 @@ class CValidationState;
 
 struct CNodeStateStats;
 struct LockPoints;
+struct PrecomputedTransactionData;
 
 /** Default for DEFAULT_WHITELISTRELAY. */
 static const bool DEFAULT_WHITELISTRELAY = true;
@@ -56,6 +60,8 @@ static const CAmount HIGH_TX_FEE_PER_KB = 0.01 * COIN;
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -blockreconstructionextratxn, number of transactions kept for compact block reconstruction besides the mempool */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
 /** Expiration time for orphan transactions in seconds */
 static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** Minimum time between orphan transactions expire time checks in seconds */
@@ -70,17 +76,35 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool, whether to dump the mempool on shutdown and load it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -checkmempoolload, whether to verify the scripts of all transactions loaded from mempool.dat */
+static const bool DEFAULT_CHECK_MEMPOOL_LOAD = false;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** The maximum number of block files kept memory-mapped for reading blocks */
+static const unsigned int MAX_MAPPED_BLOCKFILES = 8;
 
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -scriptcheckbatch default (script checks handed to and taken by the script-checking threads at a time) */
+static const unsigned int DEFAULT_SCRIPTCHECK_BATCH_SIZE = 128;
+/** Maximum -scriptcheckbatch */
+static const unsigned int MAX_SCRIPTCHECK_BATCH_SIZE = 4096;
+/** Maximum number of block parsing threads during -reindex */
+static const int MAX_REINDEX_THREADS = 16;
+/** -reindexthreads default (number of block parsing threads during -reindex, 0 = auto) */
+static const int DEFAULT_REINDEX_THREADS = 0;
+/** Number of threads reading block files during -reindex */
+static const int REINDEX_READER_THREADS = 2;
+/** The most bytes of blocks -reindex reads ahead of the block file it is importing */
+static const uint64_t REINDEX_MAX_READ_AHEAD = 2 * MAX_BLOCKFILE_SIZE;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -247,6 +271,13 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/**
+ * Rebuild the block index from the block files on disk (-reindex). The files
+ * are read by REINDEX_READER_THREADS threads and their blocks deserialized
+ * and checked by nParserThreads more, while the calling thread imports them
+ * in the order they appear in the files.
+ */
+bool ReindexBlockFiles(const CChainParams& chainparams, int nParserThreads);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
@@ -263,6 +294,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Set the number of script checks moved between threads at a time; call before starting the script-checking threads */
+void SetScriptCheckBatchSize(unsigned int nBatchSize);
+/** Run an instance of the header checking thread (context-free checks of received headers) */
+void ThreadHeaderCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -314,9 +349,9 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool; fTxChecked if CheckTransaction already passed **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0, bool fTxChecked=false);
 
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
@@ -331,6 +366,40 @@ struct CNodeStateStats {
     std::vector<int> vHeightInFlight;
 };
 
+struct CCompactBlockStats {
+    //! Compact blocks we started to reconstruct
+    uint64_t nBlocks;
+    //! Of those, the ones that needed no getblocktxn round trip
+    uint64_t nBlocksComplete;
+    uint64_t nTxPrefilled;
+    uint64_t nTxMempool;
+    uint64_t nTxExtra;
+    uint64_t nTxRequested;
+    //! Transactions in the extra pool, and how many it holds at most
+    size_t nExtraTxn;
+    size_t nMaxExtraTxn;
+};
+
+/** Get statistics of compact block reconstruction */
+void GetCompactBlockStats(CCompactBlockStats &stats);
+
+struct CMempoolLoadStats {
+    //! Transactions accepted back into the mempool
+    int64_t nAccepted;
+    //! Of those, the ones whose scripts were not verified again
+    int64_t nScriptChecksSkipped;
+    int64_t nFailed;
+    //! Transactions the mempool already had
+    int64_t nAlreadyHad;
+    //! Transactions older than -mempoolexpiry, which were not tried
+    int64_t nExpired;
+};
+
+/** Write the mempool and its prioritisations to mempool.dat in the data directory */
+bool DumpMempool();
+/** Accept the transactions in mempool.dat back into the mempool */
+bool LoadMempool(CMempoolLoadStats &stats);
+
 
 
 /** 
@@ -361,10 +430,11 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. txdata holds the signature hash parts shared by all inputs
+ * and must outlive any script checks pushed onto pvChecks.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -425,12 +495,13 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    PrecomputedTransactionData *txdata;
 
 public:
-    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
+    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(NULL) {}
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
 
@@ -442,6 +513,7 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        std::swap(txdata, check.txdata);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -453,6 +525,13 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 bool ReadBlockHeaderFromDisk(CBlockHeader& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/**
+ * Copy the serialization of a block exactly as stored on disk, without
+ * deserializing it or checking its proof of work again. The stored form
+ * includes witness data, so it is only usable as-is by readers that want
+ * witness serialization or know the block has none.
+ */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -524,6 +603,15 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the chain state database at the bottom of pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Global variable that points to the background writer below pcoinsTip, if -backgroundflush is set (protected by cs_main) */
+extern CCoinsViewWriteBehind *pcoinsWriteBehind;
+
+/** Global variable that points to the input prefetcher below pcoinsTip, if -prefetchthreads is not 0 (protected by cs_main) */
+extern CCoinsViewPrefetch *pcoinsPrefetch;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
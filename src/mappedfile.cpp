@@ -0,0 +1,95 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    munmap(const_cast<unsigned char*>(pbegin), nSize);
+#endif
+}
+
+std::shared_ptr<const CMappedFile> CMappedFile::Open(const boost::filesystem::path& path)
+{
+#ifndef WIN32
+    // Mapping whole block files is only reasonable with a 64-bit address space.
+    if (sizeof(void*) < 8)
+        return std::shared_ptr<const CMappedFile>();
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return std::shared_ptr<const CMappedFile>();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return std::shared_ptr<const CMappedFile>();
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+    if (p == MAP_FAILED)
+        return std::shared_ptr<const CMappedFile>();
+    return std::shared_ptr<const CMappedFile>(new CMappedFile((const unsigned char*)p, st.st_size));
+#else
+    return std::shared_ptr<const CMappedFile>();
+#endif
+}
+
+std::shared_ptr<const CMappedFile> CMappedFileCache::Get(int nFile, const boost::filesystem::path& path, size_t nMinSize)
+{
+    LOCK(cs);
+    std::map<int, lru_type::iterator>::iterator it = mapFiles.find(nFile);
+    if (it != mapFiles.end()) {
+        if (it->second->second->size() >= nMinSize) {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->second;
+        }
+        // The file grew since it was mapped; map it again below.
+        lru.erase(it->second);
+        mapFiles.erase(it);
+    }
+
+    std::shared_ptr<const CMappedFile> mapping = CMappedFile::Open(path);
+    if (!mapping || mapping->size() < nMinSize)
+        return std::shared_ptr<const CMappedFile>();
+    if (nMaxFiles == 0)
+        return mapping;
+    while (lru.size() >= nMaxFiles) {
+        mapFiles.erase(lru.back().first);
+        lru.pop_back();
+    }
+    lru.push_front(std::make_pair(nFile, mapping));
+    mapFiles[nFile] = lru.begin();
+    return mapping;
+}
+
+void CMappedFileCache::Evict(int nFile)
+{
+    LOCK(cs);
+    std::map<int, lru_type::iterator>::iterator it = mapFiles.find(nFile);
+    if (it != mapFiles.end()) {
+        lru.erase(it->second);
+        mapFiles.erase(it);
+    }
+}
+
+void CMappedFileCache::Clear()
+{
+    LOCK(cs);
+    lru.clear();
+    mapFiles.clear();
+}
+
+size_t CMappedFileCache::size() const
+{
+    LOCK(cs);
+    return lru.size();
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <stddef.h>
+
+#include <boost/filesystem/path.hpp>
+
+/** Read-only memory mapping of a whole file, unmapped on destruction. */
+class CMappedFile
+{
+private:
+    const unsigned char* pbegin;
+    size_t nSize;
+
+    CMappedFile(const unsigned char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+
+    // Disallow copies
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    ~CMappedFile();
+
+    /** Map the current contents of path. Returns NULL if the file is empty,
+     *  cannot be opened, or mapping is not supported on this platform. */
+    static std::shared_ptr<const CMappedFile> Open(const boost::filesystem::path& path);
+
+    const unsigned char* data() const { return pbegin; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * Least recently used cache of read-only file mappings, keyed by file number.
+ *
+ * Mappings are handed out as shared pointers, so a file evicted while a
+ * reader still uses it stays mapped until that reader is done with it.
+ * Files that grow after being mapped are remapped on demand: callers state
+ * how many bytes they need the mapping to cover.
+ */
+class CMappedFileCache
+{
+private:
+    typedef std::list<std::pair<int, std::shared_ptr<const CMappedFile> > > lru_type;
+
+    mutable CCriticalSection cs;
+    size_t nMaxFiles;
+    //! Most recently used mapping first
+    lru_type lru;
+    std::map<int, lru_type::iterator> mapFiles;
+
+public:
+    CMappedFileCache(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    /** Return a mapping of file nFile at path covering at least nMinSize
+     *  bytes, or NULL if no such mapping can be made. */
+    std::shared_ptr<const CMappedFile> Get(int nFile, const boost::filesystem::path& path, size_t nMinSize);
+
+    /** Drop the mapping of nFile, e.g. before the file is truncated or removed. */
+    void Evict(int nFile);
+
+    /** Drop all mappings. */
+    void Clear();
+
+    size_t size() const;
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include "arenamap.h"
 #include "indirectmap.h"
 
 #include <stdlib.h>
@@ -131,6 +132,14 @@ static inline size_t IncrementalDynamicUsage(const indirectmap<X, Y>& m)
     return MallocUsage(sizeof(stl_tree_node<std::pair<const X*, Y> >));
 }
 
+// arenamap allocates its entries in chunks, next to an array of index slots
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const arenamap<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(typename arenamap<X, Y, Z>::chunk_type)) * m.chunk_count() + MallocUsage(sizeof(typename arenamap<X, Y, Z>::slot_type) * m.bucket_count()) + MallocUsage(sizeof(void*) * m.chunk_capacity());
+}
+
 template<typename X>
 static inline size_t DynamicUsage(const std::unique_ptr<X>& p)
 {
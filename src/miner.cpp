@@ -18,6 +18,7 @@
 #include "policy/policy.h"
 #include "pow.h"
 #include "primitives/transaction.h"
+#include "scheduler.h"
 #include "script/standard.h"
 #include "timedata.h"
 #include "txmempool.h"
@@ -26,6 +27,7 @@
 #include "validationinterface.h"
 
 #include <algorithm>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <queue>
@@ -111,6 +113,7 @@ BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
 void BlockAssembler::resetBlock()
 {
     inBlock.clear();
+    vBlockEntries.clear();
 
     // Reserve space for coinbase tx
     nBlockSize = 1000;
@@ -124,6 +127,9 @@ void BlockAssembler::resetBlock()
 
     lastFewTxs = 0;
     blockFinished = false;
+
+    minPackageFeeRate = CFeeRate(MAX_MONEY);
+    fTested = false;
 }
 
 CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
@@ -136,26 +142,11 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
         return NULL;
     pblock = &pblocktemplate->block; // pointer for convenience
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
-
     LOCK2(cs_main, mempool.cs);
     CBlockIndex* pindexPrev = chainActive.Tip();
     nHeight = pindexPrev->nHeight + 1;
 
-    const int32_t nChainId = chainparams.GetConsensus ().nAuxpowChainId;
-    // FIXME: Active version bits after the always-auxpow fork!
-    //const int32_t nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
-    const int32_t nVersion = 4;
-    pblock->SetBaseVersion(nVersion, nChainId);
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (chainparams.MineBlocksOnDemand())
-        pblock->SetBaseVersion(GetArg("-blockversion", pblock->GetBaseVersion()), nChainId);
-
-    pblock->nTime = GetAdjustedTime();
+    InitBlockHeader(pindexPrev);
     const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
 
     nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
@@ -179,10 +170,64 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
         addPackageTxs();
     }
 
+    FinishBlock(scriptPubKeyIn, pindexPrev);
+    LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld sigops %d\n", nBlockSize, nBlockTx, nFees, nBlockSigOpsCost);
+
+    CValidationState state;
+    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+    }
+    fTested = true;
+
+    return pblocktemplate.release();
+}
+
+CBlockTemplate* BlockAssembler::ReassembleBlock(const CScript& scriptPubKeyIn)
+{
+    pblocktemplate.reset(new CBlockTemplate());
+
+    if(!pblocktemplate.get())
+        return NULL;
+    pblock = &pblocktemplate->block; // pointer for convenience
+
+    LOCK2(cs_main, mempool.cs);
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    assert(nHeight == pindexPrev->nHeight + 1);
+
+    InitBlockHeader(pindexPrev);
+    FinishBlock(scriptPubKeyIn, pindexPrev);
+
+    if (!fTested) {
+        CValidationState state;
+        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+            throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+        }
+        fTested = true;
+    }
+
+    return pblocktemplate.release();
+}
+
+void BlockAssembler::InitBlockHeader(const CBlockIndex* pindexPrev)
+{
+    const int32_t nChainId = chainparams.GetConsensus ().nAuxpowChainId;
+    // FIXME: Active version bits after the always-auxpow fork!
+    //const int32_t nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
+    const int32_t nVersion = 4;
+    pblock->SetBaseVersion(nVersion, nChainId);
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (chainparams.MineBlocksOnDemand())
+        pblock->SetBaseVersion(GetArg("-blockversion", pblock->GetBaseVersion()), nChainId);
+
+    pblock->nTime = GetAdjustedTime();
+}
+
+void BlockAssembler::FinishBlock(const CScript& scriptPubKeyIn, CBlockIndex* pindexPrev)
+{
     nLastBlockTx = nBlockTx;
     nLastBlockSize = nBlockSize;
     nLastBlockCost = nBlockCost;
-    LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld sigops %d\n", nBlockSize, nBlockTx, nFees, nBlockSigOpsCost);
 
     // Create coinbase transaction.
     CMutableTransaction coinbaseTx;
@@ -192,9 +237,19 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
     coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
     coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
     coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
-    pblock->vtx[0] = coinbaseTx;
+
+    pblock->vtx.reserve(vBlockEntries.size() + 1);
+    pblocktemplate->vTxFees.reserve(vBlockEntries.size() + 1);
+    pblocktemplate->vTxSigOpsCost.reserve(vBlockEntries.size() + 1);
+    pblock->vtx.push_back(coinbaseTx);
+    pblocktemplate->vTxFees.push_back(-nFees);
+    pblocktemplate->vTxSigOpsCost.push_back(-1); // updated below
+    BOOST_FOREACH(CTxMemPool::txiter iter, vBlockEntries) {
+        pblock->vtx.push_back(iter->GetTx());
+        pblocktemplate->vTxFees.push_back(iter->GetFee());
+        pblocktemplate->vTxSigOpsCost.push_back(iter->GetSigOpCost());
+    }
     pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
-    pblocktemplate->vTxFees[0] = -nFees;
 
     // Fill in header
     pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
@@ -202,13 +257,6 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
     pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
     pblock->nNonce         = 0;
     pblocktemplate->vTxSigOpsCost[0] = GetLegacySigOpCount(pblock->vtx[0]);
-
-    CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
-        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
-    }
-
-    return pblocktemplate.release();
 }
 
 bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
@@ -310,9 +358,6 @@ bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
 
 void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 {
-    pblock->vtx.push_back(iter->GetTx());
-    pblocktemplate->vTxFees.push_back(iter->GetFee());
-    pblocktemplate->vTxSigOpsCost.push_back(iter->GetSigOpCost());
     if (fNeedSizeAccounting) {
         nBlockSize += ::GetSerializeSize(iter->GetTx(), SER_NETWORK, PROTOCOL_VERSION);
     }
@@ -321,6 +366,7 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     nBlockSigOpsCost += iter->GetSigOpCost();
     nFees += iter->GetFee();
     inBlock.insert(iter);
+    vBlockEntries.push_back(iter);
 
     bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
     if (fPrintPriority) {
@@ -334,6 +380,60 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     }
 }
 
+void BlockAssembler::UpdateMinPackageFeeRate(CAmount packageFees, uint64_t packageSize)
+{
+    CFeeRate packageFeeRate(packageFees, packageSize);
+    if (packageFeeRate < minPackageFeeRate)
+        minPackageFeeRate = packageFeeRate;
+}
+
+bool BlockAssembler::AddEntry(CTxMemPool::txiter iter)
+{
+    // cannot accept witness transactions into a non-witness block
+    if (!fIncludeWitness && !iter->GetTx().wit.IsNull())
+        return true;
+
+    if (!isStillDependent(iter)) {
+        if (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(iter->GetTxSize()) && nBlockSize >= nBlockMinSize)
+            return true;
+        if (!IsFinalTx(iter->GetTx(), nHeight, nLockTimeCutoff))
+            return true;
+        if (TestForBlock(iter)) {
+            UpdateMinPackageFeeRate(iter->GetModifiedFee(), iter->GetTxSize());
+            AddToBlock(iter);
+            fTested = false;
+            return true;
+        }
+    }
+
+    // Only a new selection can get it in, together with the parents that
+    // were left out or in place of a package that pays less. That is worth
+    // making if the package pays the minimum fee, and either still fits or
+    // would push out a package that pays a lower feerate.
+    uint64_t packageSize = iter->GetSizeWithAncestors();
+    CAmount packageFees = iter->GetModFeesWithAncestors();
+    if (packageFees < ::minRelayTxFee.GetFee(packageSize))
+        return true;
+    if (TestPackage(packageSize, iter->GetSigOpCostWithAncestors()))
+        return false;
+    return !(CFeeRate(packageFees, packageSize) > minPackageFeeRate);
+}
+
+void BlockAssembler::RemoveEntry(CTxMemPool::txiter iter)
+{
+    if (!inBlock.erase(iter))
+        return;
+    fTested = false;
+    vBlockEntries.erase(std::find(vBlockEntries.begin(), vBlockEntries.end(), iter));
+    if (fNeedSizeAccounting) {
+        nBlockSize -= ::GetSerializeSize(iter->GetTx(), SER_NETWORK, PROTOCOL_VERSION);
+    }
+    nBlockCost -= iter->GetTxCost();
+    --nBlockTx;
+    nBlockSigOpsCost -= iter->GetSigOpCost();
+    nFees -= iter->GetFee();
+}
+
 void BlockAssembler::addScoreTxs()
 {
     std::priority_queue<CTxMemPool::txiter, std::vector<CTxMemPool::txiter>, ScoreCompare> clearedTxs;
@@ -379,6 +479,7 @@ void BlockAssembler::addScoreTxs()
 
         // If this tx fits in the block add it, otherwise keep looping
         if (TestForBlock(iter)) {
+            UpdateMinPackageFeeRate(iter->GetModifiedFee(), iter->GetTxSize());
             AddToBlock(iter);
 
             // This tx was successfully added, so
@@ -552,6 +653,7 @@ void BlockAssembler::addPackageTxs()
         }
 
         // Package can be added. Sort the entries in a valid order.
+        UpdateMinPackageFeeRate(packageFees, packageSize);
         vector<CTxMemPool::txiter> sortedEntries;
         SortForBlock(ancestors, iter, sortedEntries);
 
@@ -646,6 +748,163 @@ void BlockAssembler::addPriorityTxs()
     }
 }
 
+/**
+ * The block template -incrementaltemplate keeps up to date: the transactions
+ * a full CreateNewBlock selected on top of the tip, extended as transactions
+ * enter the mempool and trimmed as they leave it, so that templates can be
+ * handed out without walking the whole mempool under cs_main. It is made
+ * from scratch again when the tip changes, and every
+ * CANDIDATE_REFRESH_INTERVAL seconds while transactions that would make it
+ * pay more are left out. Nothing is maintained while no template has been
+ * asked for in the last CANDIDATE_IDLE_TIMEOUT seconds.
+ * Guarded by cs_main and mempool.cs.
+ */
+class CBlockCandidate : public CValidationInterface
+{
+private:
+    BlockAssembler assembler;
+    // The tip the selection was made on, null while it has to be made again
+    uint256 hashPrevBlock;
+    // When a template was last asked for
+    int64_t nLastRequest;
+    bool fMissedFees;
+
+    /** Select the transactions from scratch */
+    CBlockTemplate* Assemble(const CScript& scriptPubKeyIn);
+
+public:
+    CBlockCandidate(const CChainParams& chainparams)
+        : assembler(chainparams), nLastRequest(0), fMissedFees(false) {}
+
+    CBlockTemplate* Create(const CScript& scriptPubKeyIn);
+    /** Make the selection again if the tip changed or fees were missed, or
+     *  drop it if no template was asked for in a while */
+    void Refresh();
+
+    // Called by the mempool with cs held
+    void EntryAdded(CTxMemPool::txiter it);
+    void EntryRemoved(CTxMemPool::txiter it);
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex) { Refresh(); }
+};
+
+static const int64_t CANDIDATE_REFRESH_INTERVAL = 10;
+static const int64_t CANDIDATE_IDLE_TIMEOUT = 120;
+
+static CBlockCandidate* pcandidate = NULL;
+
+CBlockTemplate* CBlockCandidate::Assemble(const CScript& scriptPubKeyIn)
+{
+    hashPrevBlock.SetNull();
+    CBlockTemplate* pblocktemplate = assembler.CreateNewBlock(scriptPubKeyIn);
+    if (pblocktemplate) {
+        hashPrevBlock = pblocktemplate->block.hashPrevBlock;
+        fMissedFees = false;
+    }
+    return pblocktemplate;
+}
+
+CBlockTemplate* CBlockCandidate::Create(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    nLastRequest = GetTime();
+    if (hashPrevBlock == chainActive.Tip()->GetBlockHash()) {
+        try {
+            return assembler.ReassembleBlock(scriptPubKeyIn);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+    }
+    return Assemble(scriptPubKeyIn);
+}
+
+void CBlockCandidate::Refresh()
+{
+    LOCK2(cs_main, mempool.cs);
+    if (GetTime() - nLastRequest > CANDIDATE_IDLE_TIMEOUT) {
+        hashPrevBlock.SetNull();
+        return;
+    }
+    if (hashPrevBlock == chainActive.Tip()->GetBlockHash() && !fMissedFees)
+        return;
+    try {
+        std::unique_ptr<CBlockTemplate> pblocktemplate(Assemble(CScript()));
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+}
+
+void CBlockCandidate::EntryAdded(CTxMemPool::txiter it)
+{
+    AssertLockHeld(cs_main);
+    if (hashPrevBlock.IsNull())
+        return;
+    // Transactions of a disconnected block come back before the tip moves,
+    // and their descendants may be selected already
+    if (pcoinsTip->GetBestBlock() != hashPrevBlock) {
+        hashPrevBlock.SetNull();
+        return;
+    }
+    if (!assembler.AddEntry(it))
+        fMissedFees = true;
+}
+
+void CBlockCandidate::EntryRemoved(CTxMemPool::txiter it)
+{
+    AssertLockHeld(cs_main);
+    if (hashPrevBlock.IsNull())
+        return;
+    // A connected block takes its transactions out without their descendants
+    if (pcoinsTip->GetBestBlock() != hashPrevBlock) {
+        hashPrevBlock.SetNull();
+        return;
+    }
+    assembler.RemoveEntry(it);
+}
+
+static void RefreshBlockCandidate()
+{
+    LOCK2(cs_main, mempool.cs);
+    if (pcandidate)
+        pcandidate->Refresh();
+}
+
+void StartBlockCandidate(const CChainParams& chainparams, CScheduler& scheduler)
+{
+    {
+        LOCK2(cs_main, mempool.cs);
+        assert(!pcandidate);
+        pcandidate = new CBlockCandidate(chainparams);
+    }
+    mempool.NotifyEntryAdded.connect(boost::bind(&CBlockCandidate::EntryAdded, pcandidate, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockCandidate::EntryRemoved, pcandidate, _1));
+    RegisterValidationInterface(pcandidate);
+    scheduler.scheduleEvery(&RefreshBlockCandidate, CANDIDATE_REFRESH_INTERVAL);
+}
+
+void StopBlockCandidate()
+{
+    if (!pcandidate)
+        return;
+    UnregisterValidationInterface(pcandidate);
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&CBlockCandidate::EntryAdded, pcandidate, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&CBlockCandidate::EntryRemoved, pcandidate, _1));
+    LOCK2(cs_main, mempool.cs);
+    delete pcandidate;
+    pcandidate = NULL;
+}
+
+CBlockTemplate* CreateBlockTemplate(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+{
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (pcandidate)
+            return pcandidate->Create(scriptPubKeyIn);
+    }
+    return BlockAssembler(chainparams).CreateNewBlock(scriptPubKeyIn);
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
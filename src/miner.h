@@ -17,12 +17,15 @@
 class CBlockIndex;
 class CChainParams;
 class CReserveKey;
+class CScheduler;
 class CScript;
 class CWallet;
 
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -incrementaltemplate, keeping a block template up to date as the mempool changes */
+static const bool DEFAULT_INCREMENTAL_TEMPLATE = true;
 
 struct CBlockTemplate
 {
@@ -151,6 +154,12 @@ private:
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
     CTxMemPool::setEntries inBlock;
+    // The same entries, in the order they go into the block
+    std::vector<CTxMemPool::txiter> vBlockEntries;
+    // The lowest feerate of a package selected by feerate
+    CFeeRate minPackageFeeRate;
+    // Whether the selection passed TestBlockValidity as it is
+    bool fTested;
 
     // Chain context for the block
     int nHeight;
@@ -165,13 +174,36 @@ public:
     BlockAssembler(const CChainParams& chainparams);
     /** Construct a new block template with coinbase to scriptPubKeyIn */
     CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
+    /** Construct a new block template with coinbase to scriptPubKeyIn from the
+     *  transactions the last CreateNewBlock selected, as changed by AddEntry
+     *  and RemoveEntry since. The tip must not have changed in between. The
+     *  block is tested again if the selection changed. */
+    CBlockTemplate* ReassembleBlock(const CScript& scriptPubKeyIn);
+
+    // Incremental updates of the selection, with mempool.cs held
+    /** Append an entry that just entered the mempool if all of its in-mempool
+     *  parents are selected and it fits. Returns false if it was left out
+     *  although assembling the block from scratch might include it: its
+     *  package pays the minimum fee and either fits or pays a higher feerate
+     *  than the lowest package selected. */
+    bool AddEntry(CTxMemPool::txiter iter);
+    /** Take an entry that is leaving the mempool out of the selection. Its
+     *  in-mempool descendants have to leave with it. */
+    void RemoveEntry(CTxMemPool::txiter iter);
 
 private:
     // utility functions
     /** Clear the block's state and prepare for assembling a new block */
     void resetBlock();
+    /** Set the version and time of a block on top of pindexPrev */
+    void InitBlockHeader(const CBlockIndex* pindexPrev);
+    /** Fill the block with the coinbase and the selected transactions and
+     *  complete its header */
+    void FinishBlock(const CScript& scriptPubKeyIn, CBlockIndex* pindexPrev);
     /** Add a tx to the block */
     void AddToBlock(CTxMemPool::txiter iter);
+    /** Lower minPackageFeeRate to the feerate of a package being added */
+    void UpdateMinPackageFeeRate(CAmount packageFees, uint64_t packageSize);
 
     // Methods for how to add transactions to a block.
     /** Add transactions based on modified feerate */
@@ -204,6 +236,14 @@ private:
     void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
 };
 
+/** Start keeping a block template up to date with the mempool and the tip,
+ *  once one is first asked for through CreateBlockTemplate */
+void StartBlockCandidate(const CChainParams& chainparams, CScheduler& scheduler);
+void StopBlockCandidate();
+/** Construct a new block template with coinbase to scriptPubKeyIn, from the
+ *  candidate kept up to date since StartBlockCandidate where possible */
+CBlockTemplate* CreateBlockTemplate(const CChainParams& chainparams, const CScript& scriptPubKeyIn);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
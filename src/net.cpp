@@ -27,6 +27,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -89,6 +93,8 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+int nMessageHandlerThreads = DEFAULT_MSGHAND_THREADS;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
@@ -106,7 +112,12 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+/** Lets the message handler thread of a peer know it has a new message to process. */
+struct MessageHandlerWakeup {
+    boost::mutex mutex;
+    boost::condition_variable cond;
+};
+static MessageHandlerWakeup messageHandlerWakeup[MAX_MSGHAND_THREADS];
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -404,7 +415,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsServiceableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -758,7 +769,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
             i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
 
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            messageHandlerWakeup[id % nMessageHandlerThreads].cond.notify_one();
         }
     }
 
@@ -1038,7 +1049,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsServiceableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1083,9 +1094,336 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode)
+{
+    if (str == "select") {
+        mode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (str == "epoll") {
+        mode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string GetSupportedSocketEventsModes()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return "select, epoll";
+#else
+    return "select";
+#endif
+}
+
+bool IsServiceableSocket(SOCKET hSocket)
+{
+    return nSocketEventsMode != SOCKETEVENTS_SELECT || IsSelectableSocket(hSocket);
+}
+
+// The socket handler waits on the read end of this pipe along with the peer
+// sockets, so that messages queued from other threads are sent right away
+// instead of after the wait times out.
+static int wakeupPipe[2] = {-1, -1};
+static std::atomic<bool> fWakeupPending(false);
+#ifdef HAVE_SYS_EPOLL_H
+static int epollFd = -1;
+#endif
+
+/** Maximum time the socket handler waits for events, in milliseconds. Bounds how
+    long disconnects, timeouts and resuming reception after flood control take. */
+static const int64_t SOCKET_EVENTS_TIMEOUT = 50;
+
+enum {
+    SOCKET_EVENT_RECV = (1 << 0),
+    SOCKET_EVENT_SEND = (1 << 1),
+};
+
+static void WakeSocketHandler()
+{
+#ifndef WIN32
+    if (wakeupPipe[1] == -1 || fWakeupPending.exchange(true))
+        return;
+    char c = 0;
+    // A full pipe means the socket handler has wakeups to process already.
+    if (write(wakeupPipe[1], &c, 1) != 1)
+        return;
+#endif
+}
+
+static void DrainWakeupPipe()
+{
+#ifndef WIN32
+    char buf[128];
+    while (read(wakeupPipe[0], buf, sizeof(buf)) > 0) {}
+    // Only clear the flag once the pipe is empty: a wakeup that is skipped
+    // because the flag was still set happened before the events below are
+    // collected again, so it cannot be lost.
+    fWakeupPending = false;
+#endif
+}
+
+bool CreateSocketEvents(std::string& strError)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && epollFd == -1) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd == -1) {
+            strError = strprintf("epoll_create1 failed: %s", NetworkErrorString(errno));
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+static void InitSocketEvents()
+{
+#ifndef WIN32
+    if (wakeupPipe[0] == -1) {
+        if (pipe(wakeupPipe) != 0) {
+            LogPrintf("Couldn't create socket handler wakeup pipe: %s\n", NetworkErrorString(errno));
+            wakeupPipe[0] = wakeupPipe[1] = -1;
+        } else {
+            for (int i = 0; i < 2; i++) {
+                fcntl(wakeupPipe[i], F_SETFL, fcntl(wakeupPipe[i], F_GETFL, 0) | O_NONBLOCK);
+                fcntl(wakeupPipe[i], F_SETFD, FD_CLOEXEC);
+            }
+        }
+    }
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL) {
+        // Created by CreateSocketEvents during init, which fails rather than
+        // falling back to select() with an unclipped -maxconnections
+        assert(epollFd != -1);
+        std::vector<int> vFixed;
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            vFixed.push_back(hListenSocket.socket);
+        if (wakeupPipe[0] != -1)
+            vFixed.push_back(wakeupPipe[0]);
+        BOOST_FOREACH(int fd, vFixed) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+                LogPrintf("epoll_ctl failed to add fd %d: %s\n", fd, NetworkErrorString(errno));
+        }
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", nSocketEventsMode == SOCKETEVENTS_EPOLL ? "epoll" : "select()");
+}
+
+static void ShutdownSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (epollFd != -1) {
+        close(epollFd);
+        epollFd = -1;
+    }
+#endif
+#ifndef WIN32
+    for (int i = 0; i < 2; i++) {
+        if (wakeupPipe[i] != -1) {
+            close(wakeupPipe[i]);
+            wakeupPipe[i] = -1;
+        }
+    }
+#endif
+}
+
+/** Which events to wait for on a peer's socket. */
+static int GetSocketInterest(CNode* pnode)
+{
+    // Implement the following logic:
+    // * If there is data to send, wait for sending data. As this only
+    //   happens when optimistic write failed, we choose to first drain the
+    //   write buffer in this case before receiving more. This avoids
+    //   needlessly queueing received data, if the remote peer is not themselves
+    //   receiving data. This means properly utilizing TCP flow control signalling.
+    // * Otherwise, if there is no (complete) message in the receive buffer,
+    //   or there is space left in the buffer, wait for receiving data.
+    // * (if neither of the above applies, there is certainly one message
+    //   in the receiver buffer ready to be processed).
+    // Together, that means that at least one of the following is always possible,
+    // so we don't deadlock:
+    // * We send some data.
+    // * We wait for data to be received (and disconnect after timeout).
+    // * We process a message in the buffer (message handler thread).
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty())
+            return SOCKET_EVENT_SEND;
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            return SOCKET_EVENT_RECV;
+    }
+    return 0;
+}
+
+static void SocketEventsSelect(std::set<SOCKET>& setRecv, std::set<SOCKET>& setSend, std::set<SOCKET>& setError)
+{
+    struct timeval timeout = MillisToTimeval(SOCKET_EVENTS_TIMEOUT);
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+    std::vector<SOCKET> vSockets;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+        vSockets.push_back(hListenSocket.socket);
+    }
+#ifndef WIN32
+    if (wakeupPipe[0] != -1) {
+        FD_SET(wakeupPipe[0], &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, (SOCKET)wakeupPipe[0]);
+        have_fds = true;
+    }
+#endif
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            SOCKET hSocket = pnode->hSocket;
+            if (hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, hSocket);
+            have_fds = true;
+            vSockets.push_back(hSocket);
+
+            int nEvents = GetSocketInterest(pnode);
+            if (nEvents & SOCKET_EVENT_SEND)
+                FD_SET(hSocket, &fdsetSend);
+            if (nEvents & SOCKET_EVENT_RECV)
+                FD_SET(hSocket, &fdsetRecv);
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            setRecv.insert(vSockets.begin(), vSockets.end());
+        }
+        MilliSleep(SOCKET_EVENTS_TIMEOUT);
+        return;
+    }
+
+#ifndef WIN32
+    if (wakeupPipe[0] != -1 && FD_ISSET(wakeupPipe[0], &fdsetRecv))
+        DrainWakeupPipe();
+#endif
+    BOOST_FOREACH(SOCKET hSocket, vSockets) {
+        if (FD_ISSET(hSocket, &fdsetRecv))
+            setRecv.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetSend))
+            setSend.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetError))
+            setError.insert(hSocket);
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void SocketEventsEpoll(std::set<SOCKET>& setRecv, std::set<SOCKET>& setSend, std::set<SOCKET>& setError)
+{
+    // Peer sockets stay registered between calls; only changes in what we
+    // wait for are passed to the kernel. Closing a socket removes it from
+    // the epoll set.
+    std::set<SOCKET> setKnown;
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        setKnown.insert(hListenSocket.socket);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            SOCKET hSocket = pnode->hSocket;
+            if (hSocket == INVALID_SOCKET)
+                continue;
+            setKnown.insert(hSocket);
+
+            int nEvents = GetSocketInterest(pnode);
+            if (nEvents == pnode->nSocketEventsRegistered)
+                continue;
+            struct epoll_event event;
+            event.events = ((nEvents & SOCKET_EVENT_RECV) ? EPOLLIN : 0) | ((nEvents & SOCKET_EVENT_SEND) ? EPOLLOUT : 0);
+            event.data.fd = hSocket;
+            int op = pnode->nSocketEventsRegistered == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+            int ret = epoll_ctl(epollFd, op, hSocket, &event);
+            // The descriptor may still (or no longer) be registered if it was reused.
+            if (ret != 0 && op == EPOLL_CTL_ADD && errno == EEXIST)
+                ret = epoll_ctl(epollFd, EPOLL_CTL_MOD, hSocket, &event);
+            else if (ret != 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+                ret = epoll_ctl(epollFd, EPOLL_CTL_ADD, hSocket, &event);
+            if (ret == 0)
+                pnode->nSocketEventsRegistered = nEvents;
+            else
+                LogPrint("net", "epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+        }
+    }
+
+    std::vector<struct epoll_event> vEvents(setKnown.size() + 1);
+    int nReady = epoll_wait(epollFd, vEvents.data(), vEvents.size(), SOCKET_EVENTS_TIMEOUT);
+    boost::this_thread::interruption_point();
+
+    if (nReady < 0)
+    {
+        int nErr = errno;
+        if (nErr != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            MilliSleep(SOCKET_EVENTS_TIMEOUT);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nReady; i++)
+    {
+        const struct epoll_event& event = vEvents[i];
+        SOCKET hSocket = event.data.fd;
+        if (hSocket == (SOCKET)wakeupPipe[0]) {
+            DrainWakeupPipe();
+            continue;
+        }
+        if (!setKnown.count(hSocket)) {
+            // Left behind by a peer that has gone away since.
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, hSocket, NULL);
+            continue;
+        }
+        if (event.events & EPOLLIN)
+            setRecv.insert(hSocket);
+        if (event.events & EPOLLOUT)
+            setSend.insert(hSocket);
+        if (event.events & (EPOLLERR | EPOLLHUP))
+            setError.insert(hSocket);
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
     while (true)
     {
         //
@@ -1152,93 +1490,24 @@ void ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Find which sockets are ready
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
+        std::set<SOCKET> setRecv;
+        std::set<SOCKET> setSend;
+        std::set<SOCKET> setError;
+#ifdef HAVE_SYS_EPOLL_H
+        if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+            SocketEventsEpoll(setRecv, setSend, setError);
+        else
+#endif
+            SocketEventsSelect(setRecv, setSend, setError);
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && setRecv.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1254,6 +1523,10 @@ void ThreadSocketHandler()
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
+        // Timeouts are in seconds, so checking once per second is enough.
+        int64_t nTime = GetTime();
+        bool fCheckInactivity = nTime != nLastInactivityCheck;
+        nLastInactivityCheck = nTime;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             boost::this_thread::interruption_point();
@@ -1263,7 +1536,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (setRecv.count(pnode->hSocket) || setError.count(pnode->hSocket))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1307,7 +1580,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (setSend.count(pnode->hSocket))
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1317,8 +1590,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            if (fCheckInactivity && nTime - pnode->nTimeConnected > 60)
             {
                 if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
                 {
@@ -1800,19 +2072,22 @@ bool OpenNetworkConnection(const CAddress& addrConnect, bool fCountFailure, CSem
 }
 
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(int nWorker)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+    MessageHandlerWakeup& wakeup = messageHandlerWakeup[nWorker];
 
     while (true)
     {
+        // Every peer is handled by exactly one worker, so its messages are
+        // still processed in order, one at a time.
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->id % nMessageHandlerThreads != nWorker)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -1857,8 +2132,10 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        if (fSleep) {
+            boost::unique_lock<boost::mutex> lock(wakeup.mutex);
+            wakeup.cond.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        }
     }
 }
 
@@ -1889,7 +2166,7 @@ bool BindListenPort(const CService &addrBind, std::string& strError, bool fWhite
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
+    if (!IsServiceableSocket(hListenSocket))
     {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
@@ -2076,6 +2353,7 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+    InitSocketEvents();
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -2085,7 +2363,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        boost::function<void()> messageHandler = boost::bind(&ThreadMessageHandler, i);
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", messageHandler));
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2132,6 +2413,7 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+        ShutdownSocketEvents();
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2424,6 +2706,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nServices = NODE_NONE;
     nServicesExpected = NODE_NONE;
     hSocket = hSocketIn;
+    nSocketEventsRegistered = -1;
     nRecvVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
@@ -2589,8 +2872,13 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (it == vSendMsg.begin()) {
         SocketSendData(this);
+        // Whatever the socket didn't take has to wait for it to become
+        // writable; make the socket handler start waiting for that now.
+        if (!vSendMsg.empty())
+            WakeSocketHandler();
+    }
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
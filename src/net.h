@@ -75,11 +75,26 @@ static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
 static const bool DEFAULT_BLOCKSONLY = false;
 
 static const bool DEFAULT_FORCEDNSSEED = false;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
+/** -msghandthreads default (number of message handler threads, 0 = auto) */
+static const int DEFAULT_MSGHAND_THREADS = 1;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
+/** Backends ThreadSocketHandler can use to wait for socket readiness */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT = 0,
+    SOCKETEVENTS_EPOLL = 1,
+};
+#ifdef HAVE_SYS_EPOLL_H
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+#endif
+
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
@@ -102,6 +117,13 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Parse a -socketevents value; fails for backends not available on this platform. */
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode);
+std::string GetSupportedSocketEventsModes();
+/** Set up the socket event backend selected by -socketevents, before any sockets are opened. */
+bool CreateSocketEvents(std::string& strError);
+/** Whether hSocket can be serviced by the socket event backend in use. */
+bool IsServiceableSocket(SOCKET hSocket);
 
 struct CombinerAll
 {
@@ -169,6 +191,10 @@ extern CAddrMan addrman;
 
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** Socket event backend used by the socket handler thread (-socketevents) */
+extern SocketEventsMode nSocketEventsMode;
+/** Number of threads processing peer messages; each peer is handled by one of them (-msghandthreads) */
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -329,6 +355,9 @@ public:
     ServiceFlags nServices;
     ServiceFlags nServicesExpected;
     SOCKET hSocket;
+    // events hSocket is registered for with the epoll backend (-1: not registered),
+    // only accessed by the socket handler thread
+    int nSocketEventsRegistered;
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
@@ -401,6 +430,8 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    // protects vAddrToSend and addrKnown, which message handler threads of other peers add to
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -517,6 +548,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -525,6 +557,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -9,9 +9,101 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "primitives/block.h"
+#include "sync.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <algorithm>
+#include <map>
+
+namespace {
+
+/** Number of past block durations the EMA retarget averages over (3 days) */
+static const int EMA_WINDOW_SIZE = 2160;
+/** Number of memoized retarget results kept before the memo is reset */
+static const size_t MAX_RETARGET_RESULTS = 10000;
+
+/**
+ * Retarget state that is expensive to rebuild by walking the block index.
+ *
+ * The raw durations of the EMA_WINDOW_SIZE blocks ending at pindexWindow are
+ * kept in a ring, so that asking for the window of a direct child (the common
+ * case during header sync and block connection) only reads one new header.
+ * Targets computed by the windowed algorithms depend on nothing but the block
+ * they are computed on top of, so they are memoized per CBlockIndex as well.
+ */
+class CRetargetCache
+{
+private:
+    const CBlockIndex* pindexWindow;
+    int nWindowStart; //!< position of the oldest duration in vDurations
+    int64_t vDurations[EMA_WINDOW_SIZE];
+    std::map<const CBlockIndex*, unsigned int> mapResults;
+
+    static int64_t BlockDuration(const CBlockIndex* pindex)
+    {
+        return pindex->GetBlockTime() - pindex->pprev->GetBlockTime();
+    }
+
+public:
+    CRetargetCache() { Clear(); }
+
+    void Clear()
+    {
+        pindexWindow = NULL;
+        nWindowStart = 0;
+        mapResults.clear();
+    }
+
+    /** Copy the raw durations of the EMA_WINDOW_SIZE blocks ending at pindexLast, oldest first */
+    void GetWindow(const CBlockIndex* pindexLast, int64_t* pDurations)
+    {
+        if (pindexWindow != NULL && pindexLast->pprev == pindexWindow) {
+            vDurations[nWindowStart] = BlockDuration(pindexLast);
+            nWindowStart = (nWindowStart + 1) % EMA_WINDOW_SIZE;
+            pindexWindow = pindexLast;
+        } else if (pindexLast != pindexWindow) {
+            const CBlockIndex* pindex = pindexLast;
+            for (int i = EMA_WINDOW_SIZE - 1; i >= 0; i--) {
+                assert(pindex->pprev);
+                vDurations[i] = BlockDuration(pindex);
+                pindex = pindex->pprev;
+            }
+            nWindowStart = 0;
+            pindexWindow = pindexLast;
+        }
+        std::copy(vDurations + nWindowStart, vDurations + EMA_WINDOW_SIZE, pDurations);
+        std::copy(vDurations, vDurations + nWindowStart, pDurations + EMA_WINDOW_SIZE - nWindowStart);
+    }
+
+    bool GetResult(const CBlockIndex* pindexLast, unsigned int& nBits) const
+    {
+        std::map<const CBlockIndex*, unsigned int>::const_iterator it = mapResults.find(pindexLast);
+        if (it == mapResults.end())
+            return false;
+        nBits = it->second;
+        return true;
+    }
+
+    void SetResult(const CBlockIndex* pindexLast, unsigned int nBits)
+    {
+        if (mapResults.size() >= MAX_RETARGET_RESULTS)
+            mapResults.clear();
+        mapResults[pindexLast] = nBits;
+    }
+};
+
+CCriticalSection cs_retarget;
+CRetargetCache retargetcache;
+
+} // anon namespace
+
+void ClearRetargetCache()
+{
+    LOCK(cs_retarget);
+    retargetcache.Clear();
+}
+
 unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, const Consensus::Params& params) {
     /* current difficulty formula, dash - DarkGravity v3, written by Evan Duffield - evan@dashpay.io */
     const CBlockIndex *BlockLastSolved = pindexLast;
@@ -30,6 +122,11 @@ unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, const Consens
 	return nProofOfWorkLimit;
     }
 
+    LOCK(cs_retarget);
+    unsigned int nBitsCached;
+    if (retargetcache.GetResult(pindexLast, nBitsCached))
+        return nBitsCached;
+
     for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
         if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
         CountBlocks++;
@@ -66,6 +163,7 @@ unsigned int static DarkGravityWave(const CBlockIndex* pindexLast, const Consens
     if (bnNew > bnPowLimit)
         bnNew = bnPowLimit;
 
+    retargetcache.SetResult(pindexLast, bnNew.GetCompact());
     return bnNew.GetCompact();
 }
 
@@ -152,7 +250,7 @@ unsigned int GetNextWorkRequiredEMA(const CBlockIndex* pindexLast, const CBlockH
     unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
     const int64_t perBlockTargetTimespan = 120; // two mins between blocks
     const arith_uint256 bnPowLimit = UintToArith256(params.powLimit);
-    int64_t block_durations[2160];
+    int64_t block_durations[EMA_WINDOW_SIZE];
     float alpha = 0.09; // closer to 1.0 = faster response to new values
     if (pindexLast->nHeight > 110322) {
         alpha = 0.06;
@@ -188,11 +286,15 @@ unsigned int GetNextWorkRequiredEMA(const CBlockIndex* pindexLast, const CBlockH
 	return bnNew.GetCompact();
     }
 
-    // collect last 3 days (30*24*3=2160) blocks durations:
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < 2160 ; i++) {
-        block_durations[2159 - i] = pindexFirst->GetBlockTime() - pindexFirst->pprev->GetBlockTime();
+    // everything below only depends on pindexLast and its ancestors
+    LOCK(cs_retarget);
+    unsigned int nBitsCached;
+    if (retargetcache.GetResult(pindexLast, nBitsCached))
+        return nBitsCached;
 
+    // collect last 3 days (30*24*3=2160) blocks durations:
+    retargetcache.GetWindow(pindexLast, block_durations);
+    for (int i = 0; i < 2160 ; i++) {
         if (pindexLast->nHeight > 110322) {
             // slow down difficulty decrease even more,
             // also limit the effect of future nTime values (actually annihilates them):
@@ -209,7 +311,6 @@ unsigned int GetNextWorkRequiredEMA(const CBlockIndex* pindexLast, const CBlockH
         if (block_durations[2159 - i] < 0 && pindexLast->nHeight > 104290) {
             block_durations[2159 - i] = perBlockTargetTimespan;
         }
-        pindexFirst = pindexFirst->pprev;
     }
 
     // compute exponential moving average block duration:
@@ -244,6 +345,7 @@ unsigned int GetNextWorkRequiredEMA(const CBlockIndex* pindexLast, const CBlockH
     if (bnNew > bnPowLimit)
         bnNew = bnPowLimit;
     LogPrintf("GetNextWorkRequiredEMA RETARGET\n");
+    retargetcache.SetResult(pindexLast, bnNew.GetCompact());
     return bnNew.GetCompact();
 }
 
@@ -16,6 +16,7 @@
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -673,6 +674,21 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
 };
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    stats.nTransactions++;
+    for (const auto output : outputs) {
+        ss << VARINT(output.first + 1);
+        ss << output.second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += output.second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 //! Calculate statistics about the unspent transaction output set
 static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
 {
@@ -685,32 +701,30 @@ static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        uint256 key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
+        COutPoint key;
+        Coin coin;
+        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
+            // Outputs of a transaction are adjacent, so hash them as one entry
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
+            prevkey = key.hash;
+            outputs[key.n] = std::move(coin);
             stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
         } else {
             return error("%s: unable to read value", __func__);
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, prevkey, outputs);
+    }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -752,6 +766,82 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue compactdb(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "compactdb \"database\" ( \"begin\" \"end\" )\n"
+            "\nCompacts a range of keys of a database, reclaiming the space of entries erased there\n"
+            "and merging its files into as few levels as possible.\n"
+            "Note this call may take some time, during which the node keeps running.\n"
+            "\nArguments:\n"
+            "1. \"database\"   (string, required) The database to compact, \"chainstate\" or \"blockindex\"\n"
+            "2. \"begin\"      (string, optional) The first raw key of the range, in hex. Empty for the start of the database\n"
+            "3. \"end\"        (string, optional) The last raw key of the range, in hex. Empty for the end of the database\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"database\": \"name\",   (string) The database that was compacted\n"
+            "  \"files_before\": [n,...], (array) The number of table files at each level before\n"
+            "  \"files_after\": [n,...],  (array) The number of table files at each level after\n"
+            "  \"time\": n                (numeric) The time the compaction took, in milliseconds\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("compactdb", "\"chainstate\"")
+            + HelpExampleCli("compactdb", "\"chainstate\" \"43\" \"44\"")
+            + HelpExampleRpc("compactdb", "\"blockindex\"")
+        );
+
+    std::string strDatabase = params[0].get_str();
+    std::string strBegin, strEnd;
+    for (unsigned int i = 1; i < params.size(); i++) {
+        std::string strHex = params[i].get_str();
+        if (!IsHex(strHex) && !strHex.empty())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Keys must be hex strings");
+        std::vector<unsigned char> vKey = ParseHex(strHex);
+        (i == 1 ? strBegin : strEnd).assign(vKey.begin(), vKey.end());
+    }
+    const std::string* pbegin = strBegin.empty() ? NULL : &strBegin;
+    const std::string* pend = strEnd.empty() ? NULL : &strEnd;
+
+    // The databases live as long as the RPC server, so compacting them does
+    // not need to keep validation waiting.
+    CCoinsViewDB* pcoinsdb;
+    CBlockTreeDB* pblocktreedb;
+    {
+        LOCK(cs_main);
+        pcoinsdb = pcoinsdbview;
+        pblocktreedb = pblocktree;
+    }
+
+    std::vector<int> vFilesBefore, vFilesAfter;
+    int64_t nStart = GetTimeMillis();
+    if (strDatabase == "chainstate") {
+        vFilesBefore = pcoinsdb->GetFilesPerLevel();
+        pcoinsdb->CompactRawRange(pbegin, pend);
+        vFilesAfter = pcoinsdb->GetFilesPerLevel();
+    } else if (strDatabase == "blockindex") {
+        vFilesBefore = pblocktreedb->GetFilesPerLevel();
+        pblocktreedb->CompactRawRange(pbegin, pend);
+        vFilesAfter = pblocktreedb->GetFilesPerLevel();
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown database: " + strDatabase);
+    }
+    int64_t nTime = GetTimeMillis() - nStart;
+
+    UniValue filesBefore(UniValue::VARR), filesAfter(UniValue::VARR);
+    BOOST_FOREACH(int nFiles, vFilesBefore)
+        filesBefore.push_back(nFiles);
+    BOOST_FOREACH(int nFiles, vFilesAfter)
+        filesAfter.push_back(nFiles);
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("database", strDatabase));
+    ret.push_back(Pair("files_before", filesBefore));
+    ret.push_back(Pair("files_after", filesAfter));
+    ret.push_back(Pair("time", nTime));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -777,7 +867,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -801,33 +890,35 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) {
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        }
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin)) {
             return NullUniValue;
+        }
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -1153,6 +1244,56 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue savemempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nDumps the mempool to disk, to mempool.dat in the data directory.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("savemempool", "")
+            + HelpExampleRpc("savemempool", "")
+        );
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return NullUniValue;
+}
+
+UniValue loadmempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "loadmempool\n"
+            "\nAccepts the transactions in mempool.dat in the data directory into the mempool.\n"
+            "Script checks are skipped for transactions dumped on top of the current tip.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"accepted\": n,              (numeric) Transactions accepted into the mempool\n"
+            "  \"noscriptchecks\": n,        (numeric) Of those, the ones whose scripts were not verified again\n"
+            "  \"failed\": n,                (numeric) Transactions that were not accepted\n"
+            "  \"alreadyhad\": n,            (numeric) Transactions that were in the mempool already\n"
+            "  \"expired\": n                (numeric) Transactions older than -mempoolexpiry, which were not tried\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadmempool", "")
+            + HelpExampleRpc("loadmempool", "")
+        );
+
+    CMempoolLoadStats stats;
+    if (!LoadMempool(stats))
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to load mempool from disk");
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("accepted", stats.nAccepted));
+    ret.push_back(Pair("noscriptchecks", stats.nScriptChecksSkipped));
+    ret.push_back(Pair("failed", stats.nFailed));
+    ret.push_back(Pair("alreadyhad", stats.nAlreadyHad));
+    ret.push_back(Pair("expired", stats.nExpired));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1231,6 +1372,7 @@ UniValue reconsiderblock(const UniValue& params, bool fHelp)
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         okSafeMode
   //  --------------------- ------------------------  -----------------------  ----------
+    { "blockchain",         "compactdb",              &compactdb,              true  },
     { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true  },
     { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
     { "blockchain",         "getblockcount",          &getblockcount,          true  },
@@ -1246,6 +1388,8 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
+    { "blockchain",         "loadmempool",            &loadmempool,            true  },
+    { "blockchain",         "savemempool",            &savemempool,            true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
 
     /* Not shown in help */
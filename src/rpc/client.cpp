@@ -26,6 +26,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
 {
     { "stop", 0 },
     { "setmocktime", 0 },
+    { "getlockstats", 0 },
+    { "getlockstats", 2 },
     { "getaddednodeinfo", 0 },
     { "generate", 0 },
     { "generate", 1 },
@@ -10,6 +10,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "rpc/server.h"
+#include "sync.h"
 #include "timedata.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -20,6 +21,9 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <functional>
+
 #include <boost/assign/list_of.hpp>
 
 #include <univalue.h>
@@ -445,6 +449,85 @@ UniValue signmessagewithprivkey(const UniValue& params, bool fHelp)
     return EncodeBase64(&vchSig[0], vchSig.size());
 }
 
+UniValue getlockstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "getlockstats ( count \"sortby\" reset )\n"
+            "\nReturns how often, and for how long, locks were taken at each place in the source,\n"
+            "since startup or the last reset. The places that cost the most come first.\n"
+            "Nested acquisitions of a lock the thread already holds are counted too, and the\n"
+            "hold time of the outer one includes theirs.\n"
+            "\nArguments:\n"
+            "1. count     (numeric, optional, default=20) The number of places to return, 0 for all\n"
+            "2. \"sortby\"  (string, optional, default=\"wait\") What to sort on: \"wait\", \"hold\", \"maxhold\",\n"
+            "             \"contended\" or \"acquired\"\n"
+            "3. reset     (boolean, optional, default=false) Set all counters back to zero afterwards\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"lock\": \"name\",       (string) The lock, as written at the place it is taken\n"
+            "    \"site\": \"file:line\",  (string) The place it is taken\n"
+            "    \"acquired\": n,         (numeric) The number of times it was taken there\n"
+            "    \"contended\": n,        (numeric) How many of those had to wait for another thread\n"
+            "    \"wait\": n,             (numeric) The total time spent waiting, in microseconds\n"
+            "    \"hold\": n,             (numeric) The total time it was held, in microseconds\n"
+            "    \"maxhold\": n           (numeric) The longest time it was held, in microseconds\n"
+            "  },\n"
+            "  ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getlockstats", "")
+            + HelpExampleCli("getlockstats", "10 \"hold\"")
+            + HelpExampleRpc("getlockstats", "0, \"wait\", true")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(UniValue::VNUM)(UniValue::VSTR)(UniValue::VBOOL));
+
+    int nCount = params.size() > 0 ? params[0].get_int() : 20;
+    if (nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+    std::string strSortBy = params.size() > 1 ? params[1].get_str() : "wait";
+    bool fReset = params.size() > 2 ? params[2].get_bool() : false;
+
+    std::function<int64_t(const CLockSiteStats&)> key;
+    if (strSortBy == "wait")
+        key = [](const CLockSiteStats& stats) { return stats.nWaitMicros; };
+    else if (strSortBy == "hold")
+        key = [](const CLockSiteStats& stats) { return stats.nHoldMicros; };
+    else if (strSortBy == "maxhold")
+        key = [](const CLockSiteStats& stats) { return stats.nMaxHoldMicros; };
+    else if (strSortBy == "contended")
+        key = [](const CLockSiteStats& stats) { return (int64_t)stats.nContended; };
+    else if (strSortBy == "acquired")
+        key = [](const CLockSiteStats& stats) { return (int64_t)stats.nAcquired; };
+    else
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown sort order");
+
+    std::vector<CLockSiteStats> vStats = GetLockStats();
+    if (fReset)
+        ResetLockStats();
+    std::stable_sort(vStats.begin(), vStats.end(), [&key](const CLockSiteStats& a, const CLockSiteStats& b) {
+        return key(a) > key(b);
+    });
+    if (nCount > 0 && vStats.size() > (size_t)nCount)
+        vStats.resize(nCount);
+
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("lock", stats.strName));
+        obj.push_back(Pair("site", strprintf("%s:%d", stats.strFile, stats.nLine)));
+        obj.push_back(Pair("acquired", stats.nAcquired));
+        obj.push_back(Pair("contended", stats.nContended));
+        obj.push_back(Pair("wait", stats.nWaitMicros));
+        obj.push_back(Pair("hold", stats.nHoldMicros));
+        obj.push_back(Pair("maxhold", stats.nMaxHoldMicros));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 UniValue setmocktime(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -485,6 +568,7 @@ static const CRPCCommand commands[] =
     { "util",               "createwitnessaddress",   &createwitnessaddress,   true  },
     { "util",               "verifymessage",          &verifymessage,          true  },
     { "util",               "signmessagewithprivkey", &signmessagewithprivkey, true  },
+    { "control",            "getlockstats",           &getlockstats,           true  },
 
     /* Not shown in help */
     { "hidden",             "setmocktime",            &setmocktime,            true  },
@@ -376,6 +376,43 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getcompactblockinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getcompactblockinfo\n"
+            "\nReturns statistics about reconstructing compact blocks from the transactions we have.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": n,              (numeric) Compact blocks reconstruction was started for\n"
+            "  \"blocks_complete\": n,     (numeric) Those of them that needed no transactions from the peer\n"
+            "  \"txn_prefilled\": n,       (numeric) Transactions the peer sent along with the compact blocks\n"
+            "  \"txn_mempool\": n,         (numeric) Transactions found in the mempool\n"
+            "  \"txn_extra\": n,           (numeric) Transactions found in the extra pool of orphaned, replaced and evicted transactions\n"
+            "  \"txn_requested\": n,       (numeric) Transactions that had to be requested from the peer\n"
+            "  \"extra_pool_size\": n,     (numeric) Transactions currently in the extra pool\n"
+            "  \"extra_pool_max\": n       (numeric) Maximum number of transactions in the extra pool (-blockreconstructionextratxn)\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcompactblockinfo", "")
+            + HelpExampleRpc("getcompactblockinfo", "")
+       );
+
+    CCompactBlockStats stats;
+    GetCompactBlockStats(stats);
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("blocks", stats.nBlocks));
+    obj.push_back(Pair("blocks_complete", stats.nBlocksComplete));
+    obj.push_back(Pair("txn_prefilled", stats.nTxPrefilled));
+    obj.push_back(Pair("txn_mempool", stats.nTxMempool));
+    obj.push_back(Pair("txn_extra", stats.nTxExtra));
+    obj.push_back(Pair("txn_requested", stats.nTxRequested));
+    obj.push_back(Pair("extra_pool_size", (uint64_t)stats.nExtraTxn));
+    obj.push_back(Pair("extra_pool_max", (uint64_t)stats.nMaxExtraTxn));
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -581,6 +618,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         true  },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
     { "network",            "getnettotals",           &getnettotals,           true  },
+    { "network",            "getcompactblockinfo",    &getcompactblockinfo,    true  },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
     { "network",            "setban",                 &setban,                 true  },
     { "network",            "listbanned",             &listbanned,             true  },
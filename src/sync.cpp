@@ -7,19 +7,92 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
+#include <map>
 #include <stdio.h>
 
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
 #ifdef DEBUG_LOCKCONTENTION
-void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
+void PrintLockContention(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros)
 {
-    LogPrintf("LOCKCONTENTION: %s\n", pszName);
+    LogPrintf("LOCKCONTENTION: %s waited %dus\n", pszName, nWaitMicros);
     LogPrintf("Locker: %s:%d\n", pszFile, nLine);
 }
 #endif /* DEBUG_LOCKCONTENTION */
 
+namespace {
+//! All locking sites that have been used so far. Sites are never
+//! unregistered, and the list is never destroyed, so that locks taken
+//! during shutdown can still find it.
+boost::mutex& LockSitesMutex()
+{
+    static boost::mutex* pmutex = new boost::mutex();
+    return *pmutex;
+}
+
+std::vector<CLockSite*>& LockSites()
+{
+    static std::vector<CLockSite*>* pvSites = new std::vector<CLockSite*>();
+    return *pvSites;
+}
+}
+
+CLockSite::CLockSite(const char* pszNameIn, const char* pszFileIn, int nLineIn) : pszName(pszNameIn), pszFile(pszFileIn), nLine(nLineIn), nAcquired(0), nContended(0), nWaitMicros(0), nHoldMicros(0), nMaxHoldMicros(0)
+{
+    boost::unique_lock<boost::mutex> lock(LockSitesMutex());
+    LockSites().push_back(this);
+}
+
+void CLockSite::Reset()
+{
+    nAcquired = 0;
+    nContended = 0;
+    nWaitMicros = 0;
+    nHoldMicros = 0;
+    nMaxHoldMicros = 0;
+}
+
+std::vector<CLockSiteStats> GetLockStats()
+{
+    // A lock taken in a template has a site per instantiation; report
+    // those as one.
+    std::map<std::pair<std::string, int>, CLockSiteStats> mapStats;
+    {
+        boost::unique_lock<boost::mutex> lock(LockSitesMutex());
+        BOOST_FOREACH(const CLockSite* pSite, LockSites()) {
+            std::pair<std::map<std::pair<std::string, int>, CLockSiteStats>::iterator, bool> ret = mapStats.insert(std::make_pair(std::make_pair(std::string(pSite->pszFile), pSite->nLine), CLockSiteStats()));
+            CLockSiteStats& stats = ret.first->second;
+            if (ret.second) {
+                stats.strName = pSite->pszName;
+                stats.strFile = pSite->pszFile;
+                stats.nLine = pSite->nLine;
+                stats.nAcquired = stats.nContended = 0;
+                stats.nWaitMicros = stats.nHoldMicros = stats.nMaxHoldMicros = 0;
+            }
+            stats.nAcquired += pSite->nAcquired.load(std::memory_order_relaxed);
+            stats.nContended += pSite->nContended.load(std::memory_order_relaxed);
+            stats.nWaitMicros += pSite->nWaitMicros.load(std::memory_order_relaxed);
+            stats.nHoldMicros += pSite->nHoldMicros.load(std::memory_order_relaxed);
+            stats.nMaxHoldMicros = std::max(stats.nMaxHoldMicros, pSite->nMaxHoldMicros.load(std::memory_order_relaxed));
+        }
+    }
+
+    std::vector<CLockSiteStats> vStats;
+    vStats.reserve(mapStats.size());
+    for (const auto& entry : mapStats)
+        vStats.push_back(entry.second);
+    return vStats;
+}
+
+void ResetLockStats()
+{
+    boost::unique_lock<boost::mutex> lock(LockSitesMutex());
+    BOOST_FOREACH(CLockSite* pSite, LockSites())
+        pSite->Reset();
+}
+
 #ifdef DEBUG_LOCKORDER
 //
 // Early deadlock detection.
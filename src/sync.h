@@ -8,6 +8,11 @@
 
 #include "threadsafety.h"
 
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -105,40 +110,117 @@ typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
 typedef boost::condition_variable CConditionVariable;
 
 #ifdef DEBUG_LOCKCONTENTION
-void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
+void PrintLockContention(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros);
 #endif
 
+/**
+ * Counters for one place in the source that takes a lock. Every LOCK,
+ * LOCK2 and TRY_LOCK has one of these (see LockSiteAt), which registers
+ * itself the first time the lock is taken there; GetLockStats() reports
+ * them all.
+ */
+class CLockSite
+{
+public:
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+
+    //! Times the lock was taken here
+    std::atomic<uint64_t> nAcquired;
+    //! Of those, the times it was held by another thread (or a TRY_LOCK failed)
+    std::atomic<uint64_t> nContended;
+    //! Time spent waiting for the lock, and holding it, in microseconds
+    std::atomic<int64_t> nWaitMicros;
+    std::atomic<int64_t> nHoldMicros;
+    std::atomic<int64_t> nMaxHoldMicros;
+
+    CLockSite(const char* pszNameIn, const char* pszFileIn, int nLineIn);
+
+    void AddHold(int64_t nMicros)
+    {
+        nHoldMicros.fetch_add(nMicros, std::memory_order_relaxed);
+        int64_t nMax = nMaxHoldMicros.load(std::memory_order_relaxed);
+        while (nMicros > nMax && !nMaxHoldMicros.compare_exchange_weak(nMax, nMicros, std::memory_order_relaxed)) {}
+    }
+
+    void Reset();
+};
+
+/** A copy of the counters of a CLockSite */
+struct CLockSiteStats {
+    std::string strName;
+    std::string strFile;
+    int nLine;
+    uint64_t nAcquired;
+    uint64_t nContended;
+    int64_t nWaitMicros;
+    int64_t nHoldMicros;
+    int64_t nMaxHoldMicros;
+};
+
+/** Get the counters of all locking sites that have been used so far */
+std::vector<CLockSiteStats> GetLockStats();
+/** Set the counters of all locking sites back to zero */
+void ResetLockStats();
+
+/** Monotonic time in microseconds, for timing locks */
+static inline int64_t GetLockTimeMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class SCOPED_LOCKABLE CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+    CLockSite* pSite;
+    int64_t nLockedSince;
 
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
-#ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock()) {
-            PrintLockContention(pszName, pszFile, nLine);
-#endif
+            int64_t nStart = GetLockTimeMicros();
             lock.lock();
+            int64_t nWaited = GetLockTimeMicros() - nStart;
+            if (pSite) {
+                pSite->nContended.fetch_add(1, std::memory_order_relaxed);
+                pSite->nWaitMicros.fetch_add(nWaited, std::memory_order_relaxed);
+            }
 #ifdef DEBUG_LOCKCONTENTION
-        }
+            PrintLockContention(pszName, pszFile, nLine, nWaited);
 #endif
+        }
+        Locked();
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()), true);
         lock.try_lock();
-        if (!lock.owns_lock())
+        if (!lock.owns_lock()) {
             LeaveCritical();
+            if (pSite)
+                pSite->nContended.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            Locked();
+        }
         return lock.owns_lock();
     }
 
+    void Locked()
+    {
+        if (pSite) {
+            pSite->nAcquired.fetch_add(1, std::memory_order_relaxed);
+            nLockedSince = GetLockTimeMicros();
+        }
+    }
+
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false, CLockSite* pSiteIn = NULL) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : lock(mutexIn, boost::defer_lock), pSite(pSiteIn), nLockedSince(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -146,7 +228,7 @@ public:
             Enter(pszName, pszFile, nLine);
     }
 
-    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(pmutexIn)
+    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false, CLockSite* pSiteIn = NULL) EXCLUSIVE_LOCK_FUNCTION(pmutexIn) : pSite(pSiteIn), nLockedSince(0)
     {
         if (!pmutexIn) return;
 
@@ -159,8 +241,11 @@ public:
 
     ~CMutexLock() UNLOCK_FUNCTION()
     {
-        if (lock.owns_lock())
+        if (lock.owns_lock()) {
+            if (pSite)
+                pSite->AddHold(GetLockTimeMicros() - nLockedSince);
             LeaveCritical();
+        }
     }
 
     operator bool()
@@ -171,9 +256,35 @@ public:
 
 typedef CMutexLock<CCriticalSection> CCriticalBlock;
 
-#define LOCK(cs) CCriticalBlock criticalblock(cs, #cs, __FILE__, __LINE__)
-#define LOCK2(cs1, cs2) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__), criticalblock2(cs2, #cs2, __FILE__, __LINE__)
-#define TRY_LOCK(cs, name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
+#define PASTE(x, y) x ## y
+#define PASTE2(x, y) PASTE(x, y)
+
+namespace {
+/**
+ * The counters of the locking site numbered N (by __COUNTER__, so unique
+ * within the translation unit). Keeping the site in a function rather than
+ * in a static next to the lock lets LOCK, LOCK2 and TRY_LOCK each expand to
+ * a single declaration, so they behave like one statement wherever they are
+ * used.
+ */
+template <int N>
+CLockSite& LockSiteAt(const char* pszName, const char* pszFile, int nLine)
+{
+    static CLockSite site(pszName, pszFile, nLine);
+    return site;
+}
+}
+
+#define LOCK_SITE(cs, n) &LockSiteAt<n>(#cs, __FILE__, __LINE__)
+#define LOCK_AT(cs, n) CCriticalBlock PASTE2(criticalblock, n)(cs, #cs, __FILE__, __LINE__, false, LOCK_SITE(cs, n))
+// Declarators are initialized in order and destroyed in reverse, so cs1 is taken first and released last.
+#define LOCK2_AT(cs1, cs2, n1, n2) CCriticalBlock PASTE2(criticalblock, n1)(cs1, #cs1, __FILE__, __LINE__, false, LOCK_SITE(cs1, n1)), \
+                                                 PASTE2(criticalblock, n2)(cs2, #cs2, __FILE__, __LINE__, false, LOCK_SITE(cs2, n2))
+#define TRY_LOCK_AT(cs, name, n) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true, LOCK_SITE(cs, n))
+
+#define LOCK(cs) LOCK_AT(cs, __COUNTER__)
+#define LOCK2(cs1, cs2) LOCK2_AT(cs1, cs2, __COUNTER__, __COUNTER__)
+#define TRY_LOCK(cs, name) TRY_LOCK_AT(cs, name, __COUNTER__)
 
 #define ENTER_CRITICAL_SECTION(cs)                            \
     {                                                         \
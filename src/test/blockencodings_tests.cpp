@@ -16,6 +16,8 @@ struct RegtestingSetup : public TestingSetup {
     RegtestingSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
 };
 
+std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > extra_txn;
+
 BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, RegtestingSetup)
 
 static void SetBlockVersion(CPureBlockHeader& header, int32_t baseVersion) {
@@ -79,7 +81,7 @@ BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
         stream >> shortIDs2;
 
         PartiallyDownloadedBlock partialBlock(&pool);
-        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, extra_txn) == READ_STATUS_OK);
         BOOST_CHECK( partialBlock.IsTxAvailable(0));
         BOOST_CHECK(!partialBlock.IsTxAvailable(1));
         BOOST_CHECK( partialBlock.IsTxAvailable(2));
@@ -177,7 +179,7 @@ BOOST_AUTO_TEST_CASE(NonCoinbasePreforwardRTTest)
         stream >> shortIDs2;
 
         PartiallyDownloadedBlock partialBlock(&pool);
-        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, extra_txn) == READ_STATUS_OK);
         BOOST_CHECK(!partialBlock.IsTxAvailable(0));
         BOOST_CHECK( partialBlock.IsTxAvailable(1));
         BOOST_CHECK( partialBlock.IsTxAvailable(2));
@@ -230,7 +232,7 @@ BOOST_AUTO_TEST_CASE(SufficientPreforwardRTTest)
         stream >> shortIDs2;
 
         PartiallyDownloadedBlock partialBlock(&pool);
-        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, extra_txn) == READ_STATUS_OK);
         BOOST_CHECK( partialBlock.IsTxAvailable(0));
         BOOST_CHECK( partialBlock.IsTxAvailable(1));
         BOOST_CHECK( partialBlock.IsTxAvailable(2));
@@ -282,7 +284,7 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
         stream >> shortIDs2;
 
         PartiallyDownloadedBlock partialBlock(&pool);
-        BOOST_CHECK(partialBlock.InitData(shortIDs2) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, extra_txn) == READ_STATUS_OK);
         BOOST_CHECK(partialBlock.IsTxAvailable(0));
 
         CBlock block2;
@@ -295,6 +297,59 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(ReceiveWithExtraTransactions)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+
+    pool.addUnchecked(block.vtx[2].GetHash(), entry.FromTx(block.vtx[2]));
+
+    // An unrelated transaction, tx 1 and a second copy of the mempool's tx 2
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout.hash = GetRandHash();
+    mtx.vout.resize(1);
+    std::shared_ptr<const CTransaction> unrelated = std::make_shared<const CTransaction>(mtx);
+    std::vector<std::pair<uint256, std::shared_ptr<const CTransaction> > > extra_txn_filled(3);
+    extra_txn_filled[0] = std::make_pair(unrelated->GetHash(), unrelated);
+    extra_txn_filled[1] = std::make_pair(block.vtx[1].GetHash(), std::make_shared<const CTransaction>(block.vtx[1]));
+    extra_txn_filled[2] = std::make_pair(block.vtx[2].GetHash(), std::make_shared<const CTransaction>(block.vtx[2]));
+
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+
+        // Without the extra pool tx 1 is missing
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, extra_txn) == READ_STATUS_OK);
+        BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+
+        // With it the block is complete, with tx 2 still taken from the mempool
+        PartiallyDownloadedBlock partialBlockExtra(&pool);
+        BOOST_CHECK(partialBlockExtra.InitData(shortIDs2, extra_txn_filled) == READ_STATUS_OK);
+        BOOST_CHECK( partialBlockExtra.IsTxAvailable(0));
+        BOOST_CHECK( partialBlockExtra.IsTxAvailable(1));
+        BOOST_CHECK( partialBlockExtra.IsTxAvailable(2));
+        BOOST_CHECK_EQUAL(partialBlockExtra.GetPrefilledCount(), 1);
+        BOOST_CHECK_EQUAL(partialBlockExtra.GetMempoolCount(), 1);
+        BOOST_CHECK_EQUAL(partialBlockExtra.GetExtraCount(), 1);
+
+        CBlock block2;
+        std::vector<CTransaction> vtx_missing;
+        BOOST_CHECK(partialBlockExtra.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+        bool mutated;
+        BOOST_CHECK_EQUAL(block.hashMerkleRoot.ToString(), BlockMerkleRoot(block2, &mutated).ToString());
+        BOOST_CHECK(!mutated);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
     BlockTransactionsRequest req1;
     req1.blockhash = GetRandHash();
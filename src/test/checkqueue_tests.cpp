@@ -0,0 +1,288 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include "test/test_bitcoin.h"
+#include "utiltime.h"
+
+#include <atomic>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+namespace {
+
+/** Check that counts how often it ran and returns fOk. */
+struct CountingCheck
+{
+    std::atomic<int>* pnRun;
+    bool fOk;
+
+    CountingCheck() : pnRun(NULL), fOk(true) {}
+    CountingCheck(std::atomic<int>* pnRunIn, bool fOkIn) : pnRun(pnRunIn), fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        (*pnRun)++;
+        return fOk;
+    }
+
+    void swap(CountingCheck& check)
+    {
+        std::swap(pnRun, check.pnRun);
+        std::swap(fOk, check.fOk);
+    }
+};
+
+/**
+ * Check that fails unless the controller that added it is the one currently
+ * using the queue, so checks that leak from one controller into another's
+ * batch are noticed.
+ */
+struct OwnedCheck
+{
+    std::atomic<int>* pnCurrent;
+    int nOwner;
+    bool fOk;
+
+    OwnedCheck() : pnCurrent(NULL), nOwner(0), fOk(true) {}
+    OwnedCheck(std::atomic<int>* pnCurrentIn, int nOwnerIn, bool fOkIn) : pnCurrent(pnCurrentIn), nOwner(nOwnerIn), fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        return fOk && pnCurrent->load() == nOwner;
+    }
+
+    void swap(OwnedCheck& check)
+    {
+        std::swap(pnCurrent, check.pnCurrent);
+        std::swap(nOwner, check.nOwner);
+        std::swap(fOk, check.fOk);
+    }
+};
+
+/**
+ * Check that, if fBlock is set, does not return until nWait other checks
+ * have run, and fails if that takes more than a few seconds.
+ */
+struct BlockingCheck
+{
+    std::atomic<int>* pnRun;
+    int nWait;
+    bool fBlock;
+
+    BlockingCheck() : pnRun(NULL), nWait(0), fBlock(false) {}
+    BlockingCheck(std::atomic<int>* pnRunIn, int nWaitIn, bool fBlockIn) : pnRun(pnRunIn), nWait(nWaitIn), fBlock(fBlockIn) {}
+
+    bool operator()()
+    {
+        bool fOk = true;
+        if (fBlock) {
+            int64_t nStart = GetTimeMillis();
+            while (pnRun->load() < nWait) {
+                if (GetTimeMillis() - nStart > 10000) {
+                    fOk = false;
+                    break;
+                }
+                MilliSleep(1);
+            }
+        }
+        (*pnRun)++;
+        return fOk;
+    }
+
+    void swap(BlockingCheck& check)
+    {
+        std::swap(pnRun, check.pnRun);
+        std::swap(nWait, check.nWait);
+        std::swap(fBlock, check.fBlock);
+    }
+};
+
+/** Add nChecks checks to control one at a time, the one at nFail (if any) failing. */
+bool RunChecks(CCheckQueue<CountingCheck>& queue, unsigned int nFlushSize, std::atomic<int>& nRun, int nChecks, int nFail)
+{
+    CCheckQueueControl<CountingCheck> control(&queue, nFlushSize);
+    for (int i = 0; i < nChecks; i++) {
+        std::vector<CountingCheck> vChecks(1, CountingCheck(&nRun, i != nFail));
+        control.Add(vChecks);
+    }
+    return control.Wait();
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_batched_control)
+{
+    CCheckQueue<CountingCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, &queue));
+
+    // Whether the checks are handed over one by one, in batches, or all
+    // at once in Wait, every one of them runs.
+    unsigned int vFlushSizes[] = {0, 1, 16, 1000};
+    for (unsigned int nFlushSize : vFlushSizes) {
+        std::atomic<int> nRun(0);
+        BOOST_CHECK(RunChecks(queue, nFlushSize, nRun, 500, -1));
+        BOOST_CHECK_EQUAL(nRun, 500);
+        BOOST_CHECK(queue.IsIdle());
+
+        // A failing check fails the whole lot, and the queue is usable again.
+        nRun = 0;
+        BOOST_CHECK(!RunChecks(queue, nFlushSize, nRun, 500, 250));
+        BOOST_CHECK(nRun <= 500);
+        BOOST_CHECK(queue.IsIdle());
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_steal_uneven)
+{
+    // With no workers yet, every check lands in the master's deque.
+    CCheckQueue<BlockingCheck> queue(1);
+    std::atomic<int> nRun(0);
+    CCheckQueueControl<BlockingCheck> control(&queue);
+    std::vector<BlockingCheck> vChecks;
+    for (int i = 0; i < 200; i++)
+        vChecks.push_back(BlockingCheck(&nRun, 199, i == 199));
+    control.Add(vChecks);
+
+    // The master takes from the back, so it starts with the blocking check
+    // and can only finish it once the workers have stolen the other 199
+    // from the front of its deque. A worker only reaches the blocking check
+    // after all others have been taken.
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<BlockingCheck>::Thread, &queue));
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nRun, 200);
+    BOOST_CHECK(queue.IsIdle());
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_more_workers_than_checks)
+{
+    CCheckQueue<CountingCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < 8; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, &queue));
+
+    // Most deques stay empty, and most workers wake up to find nothing to
+    // take; none of the checks may be lost or run twice.
+    for (int nChecks = 0; nChecks < 4; nChecks++) {
+        for (int i = 0; i < 50; i++) {
+            std::atomic<int> nRun(0);
+            {
+                CCheckQueueControl<CountingCheck> control(&queue);
+                std::vector<CountingCheck> vChecks(nChecks, CountingCheck(&nRun, true));
+                control.Add(vChecks);
+                BOOST_CHECK(control.Wait());
+            }
+            BOOST_CHECK_EQUAL(nRun, nChecks);
+            BOOST_CHECK(queue.IsIdle());
+
+            if (nChecks > 0) {
+                nRun = 0;
+                BOOST_CHECK(!RunChecks(queue, 0, nRun, nChecks, i % nChecks));
+                BOOST_CHECK(queue.IsIdle());
+            }
+        }
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+namespace {
+
+void RunOwnedChecks(CCheckQueue<OwnedCheck>* pqueue, std::atomic<int>* pnCurrent, std::atomic<int>* pnErrors, int nOwner)
+{
+    for (int i = 0; i < 20; i++) {
+        CCheckQueueControl<OwnedCheck> control(pqueue);
+        // Nobody else may be using the queue while we hold the control.
+        if (pnCurrent->exchange(nOwner) != 0)
+            (*pnErrors)++;
+        bool fOk = (i + nOwner) % 3 != 0;
+        for (int j = 0; j < 50; j++) {
+            std::vector<OwnedCheck> vChecks(2, OwnedCheck(pnCurrent, nOwner, true));
+            if (j == 25)
+                vChecks[1] = OwnedCheck(pnCurrent, nOwner, fOk);
+            control.Add(vChecks);
+        }
+        if (control.Wait() != fOk)
+            (*pnErrors)++;
+        *pnCurrent = 0;
+    }
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_concurrent_controls)
+{
+    CCheckQueue<OwnedCheck> queue(8);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<OwnedCheck>::Thread, &queue));
+
+    // Several threads using the queue at once are made to take turns, and
+    // each gets the result of its own checks only.
+    std::atomic<int> nCurrent(0);
+    std::atomic<int> nErrors(0);
+    boost::thread_group controllers;
+    for (int i = 1; i <= 4; i++)
+        controllers.create_thread(boost::bind(&RunOwnedChecks, &queue, &nCurrent, &nErrors, i));
+    controllers.join_all();
+    BOOST_CHECK_EQUAL(nErrors, 0);
+    BOOST_CHECK(queue.IsIdle());
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_single_failure)
+{
+    CCheckQueue<CountingCheck> queue(128);
+    boost::thread_group threads;
+    for (int i = 0; i < 15; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, &queue));
+
+    // One failing check anywhere in a large batch fails all of it, however
+    // it is spread over the threads, and does not carry over to the next.
+    int vFails[] = {0, 1, 4999, 5000, 9998, 9999};
+    for (int nFail : vFails) {
+        std::atomic<int> nRun(0);
+        {
+            CCheckQueueControl<CountingCheck> control(&queue);
+            std::vector<CountingCheck> vChecks;
+            for (int i = 0; i < 10000; i++)
+                vChecks.push_back(CountingCheck(&nRun, i != nFail));
+            control.Add(vChecks);
+            BOOST_CHECK(!control.Wait());
+        }
+        BOOST_CHECK(nRun <= 10000);
+        BOOST_CHECK(queue.IsIdle());
+
+        nRun = 0;
+        BOOST_CHECK(!RunChecks(queue, 100, nRun, 10000, nFail));
+        BOOST_CHECK(queue.IsIdle());
+
+        nRun = 0;
+        BOOST_CHECK(RunChecks(queue, 100, nRun, 10000, -1));
+        BOOST_CHECK_EQUAL(nRun, 10000);
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,39 +9,50 @@
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "txdb.h"
 #include "consensus/validation.h"
 
 #include <vector>
 #include <map>
+#include <set>
 
 #include <boost/test/unit_test.hpp>
 
 namespace
 {
+//! equality test
+bool operator==(const Coin &a, const Coin &b) {
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent()) return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.nHeight == b.nHeight &&
+           a.out == b.out;
+}
+
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin) && !coin.IsSpent();
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -51,8 +62,8 @@ public:
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
@@ -74,9 +85,12 @@ public:
     {
         // Manually recompute the dynamic usage of the whole data, and compare it.
         size_t ret = memusage::DynamicUsage(cacheCoins);
+        size_t count = 0;
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
+            count++;
         }
+        BOOST_CHECK_EQUAL(GetCacheSize(), count);
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
@@ -91,7 +105,7 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
@@ -103,13 +117,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -127,36 +143,52 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            Coin& coin = result[COutPoint(txid, 0)];
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(COutPoint(txid, 0));
+            BOOST_CHECK(coin == entry);
+            BOOST_CHECK_EQUAL(stack.back()->HaveCoin(COutPoint(txid, 0)), !entry.IsSpent());
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3F), OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0); // Random sizes so we can test memory usage accounting
+                    (coin.IsSpent() ? added_an_entry : updated_an_entry) = true;
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(COutPoint(txid, 0), std::move(newcoin), !coin.IsSpent() || insecure_rand() & 1);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(COutPoint(txid, 0));
             }
         }
 
+        // Once every 10 iterations, remove a random entry from the cache
+        if (insecure_rand() % 10 == 0) {
+            COutPoint out(txids[insecure_rand() % txids.size()], 0);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(out);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(out);
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -205,10 +237,12 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
 }
 
 // This test is similar to the previous test
@@ -220,7 +254,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     bool spent_a_duplicate_coinbase = false;
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -238,7 +272,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             tx.vin.resize(1);
             tx.vout.resize(1);
             tx.vout[0].nValue = i; //Keep txs unique unless intended to duplicate
-            unsigned int height = insecure_rand();
+            int height = insecure_rand() % 1000000;
 
             // 1/10 times create a coinbase
             if (insecure_rand() % 10 == 0 || coinbaseids.size() < 10) {
@@ -273,8 +307,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[tx.vin[0].prevout].Clear();
 
                 // It is of particular importance here that once we spend a coinbase tx hash
                 // it is no longer available to be duplicated (or spent again)
@@ -294,21 +327,18 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            result[COutPoint(tx.GetHash(), 0)] = Coin(tx.vout[0], height, CTransaction(tx).IsCoinBase());
 
             UpdateCoins(tx, *(stack.back()), height);
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
             }
         }
 
@@ -346,56 +376,405 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     BOOST_CHECK(spent_a_duplicate_coinbase);
 }
 
+// Randomly insert, update and erase entries in a CCoinsMap and compare it
+// against a std::map, including erasing while iterating the way BatchWrite
+// does, and check that clear() returns all memory.
+BOOST_AUTO_TEST_CASE(ccoins_map_arena)
+{
+    std::vector<COutPoint> outpoints;
+    outpoints.resize(2000);
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        // Several outputs of the same transaction
+        outpoints[i] = COutPoint(i % 3 ? outpoints[i - 1].hash : GetRandHash(), i % 3);
+    }
+
+    CCoinsMap map;
+    std::map<COutPoint, unsigned int> result;
+    std::vector<const CCoinsCacheEntry*> entries(outpoints.size(), NULL);
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+
+    for (unsigned int i = 0; i < 100000; i++) {
+        const COutPoint& outpoint = outpoints[insecure_rand() % outpoints.size()];
+        int n = insecure_rand() % 100;
+        if (n < 60) {
+            std::pair<CCoinsMap::iterator, bool> ret = map.insert(std::make_pair(outpoint, CCoinsCacheEntry()));
+            BOOST_CHECK_EQUAL(ret.second, result.count(outpoint) == 0);
+            ret.first->second.coin.nHeight = i;
+            result[outpoint] = i;
+        } else if (n < 90) {
+            BOOST_CHECK_EQUAL(map.erase(outpoint), result.erase(outpoint));
+        } else {
+            CCoinsMap::iterator it = map.find(outpoint);
+            BOOST_CHECK_EQUAL(it == map.end(), result.count(outpoint) == 0);
+            if (it != map.end()) {
+                BOOST_CHECK_EQUAL((unsigned int)it->second.coin.nHeight, result[outpoint]);
+            }
+        }
+        BOOST_CHECK_EQUAL(map.size(), result.size());
+    }
+
+    // Entries do not move when the index is rebuilt.
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        entries[i] = &map[outpoints[i]];
+        result.insert(std::make_pair(outpoints[i], 0));
+    }
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        map[COutPoint(GetRandHash(), 0)];
+    }
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        BOOST_CHECK(entries[i] == &map.find(outpoints[i])->second);
+    }
+
+    // Erase every other entry while iterating.
+    size_t nVisited = 0, nKept = 0;
+    for (CCoinsMap::iterator it = map.begin(); it != map.end();) {
+        nVisited++;
+        if (nVisited % 2) {
+            map.erase(it++);
+        } else {
+            nKept++;
+            ++it;
+        }
+    }
+    BOOST_CHECK_EQUAL(nVisited, 2 * outpoints.size());
+    BOOST_CHECK_EQUAL(map.size(), nKept);
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+}
+
+// Flushes handed to the background writer must be visible to lookups right
+// away, and in the database with their best block once the write completes.
+BOOST_FIXTURE_TEST_CASE(coins_write_behind, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewWriteBehind writer(&db);
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 1000; i++) {
+        outpoints.push_back(COutPoint(GetRandHash(), i % 4));
+    }
+
+    for (int round = 0; round < 4; round++) {
+        uint256 hashBlock = GetRandHash();
+        CCoinsViewCache cache(&writer);
+        for (unsigned int i = 0; i < outpoints.size(); i++) {
+            if ((i + round) % 2) {
+                CTxOut txout;
+                txout.nValue = i;
+                cache.AddCoin(outpoints[i], Coin(txout, round, false), true);
+            } else {
+                cache.SpendCoin(outpoints[i]);
+            }
+        }
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+
+        // Readable through the writer, whether or not the write is done.
+        BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+        CCoinsViewCache cacheAfter(&writer);
+        for (unsigned int i = 0; i < outpoints.size(); i++) {
+            const Coin& coin = cacheAfter.AccessCoin(outpoints[i]);
+            BOOST_CHECK_EQUAL(writer.HaveCoin(outpoints[i]), (i + round) % 2 == 1);
+            if ((i + round) % 2) {
+                BOOST_CHECK(!coin.IsSpent() && coin.nHeight == (unsigned int)round && coin.out.nValue == i);
+            } else {
+                BOOST_CHECK(coin.IsSpent());
+            }
+        }
+
+        BOOST_CHECK(writer.Sync());
+        BOOST_CHECK(db.GetBestBlock() == hashBlock);
+        for (unsigned int i = 0; i < outpoints.size(); i++) {
+            BOOST_CHECK_EQUAL(db.HaveCoin(outpoints[i]), (i + round) % 2 == 1);
+        }
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_prefetch, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewPrefetch prefetch(&db, 4);
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 1000; i++) {
+        outpoints.push_back(COutPoint(GetRandHash(), i % 4));
+    }
+
+    CCoinsViewCache cache(&prefetch);
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        CTxOut txout;
+        txout.nValue = i;
+        cache.AddCoin(outpoints[i], Coin(txout, 1, false), true);
+    }
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+
+    // Wait for at least one coin to arrive; lookups give the same answers
+    // however many of the reads are done.
+    prefetch.Prefetch(outpoints);
+    for (int i = 0; i < 1000 && prefetch.DynamicMemoryUsage() == 0; i++)
+        MilliSleep(10);
+    BOOST_CHECK(prefetch.DynamicMemoryUsage() > 0);
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        Coin coin;
+        BOOST_CHECK(prefetch.GetCoin(outpoints[i], coin));
+        BOOST_CHECK(coin.nHeight == 1 && coin.out.nValue == i);
+    }
+    BOOST_CHECK(prefetch.GetHits() > 0);
+
+    // Prefetched coins that get spent are not handed out anymore.
+    prefetch.Prefetch(outpoints);
+    for (int i = 0; i < 1000 && prefetch.DynamicMemoryUsage() == 0; i++)
+        MilliSleep(10);
+    CCoinsMap mapSpent;
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        mapSpent[outpoints[i]].flags = CCoinsCacheEntry::DIRTY;
+    }
+    BOOST_CHECK(prefetch.BatchWrite(mapSpent, GetRandHash()));
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        Coin coin;
+        BOOST_CHECK(!prefetch.GetCoin(outpoints[i], coin));
+        BOOST_CHECK(!prefetch.HaveCoin(outpoints[i]));
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_prefetch_bounds, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    // A single coin fills it up, and at most 32 outpoints wait to be read.
+    CCoinsViewPrefetch prefetch(&db, 1, 1, 32);
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 64; i++) {
+        outpoints.push_back(COutPoint(GetRandHash(), 0));
+    }
+
+    CCoinsViewCache cache(&prefetch);
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        CTxOut txout;
+        txout.nValue = i;
+        cache.AddCoin(outpoints[i], Coin(txout, 1, false), true);
+    }
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+
+    // Only the first 32 are queued. The worker reads one batch of 16 and
+    // then waits for them to be used.
+    prefetch.Prefetch(outpoints);
+    for (int i = 0; i < 1000 && prefetch.DynamicMemoryUsage() == 0; i++)
+        MilliSleep(10);
+    MilliSleep(100);
+
+    // New outpoints make room by dropping the oldest coins, and fill up the
+    // queue again.
+    prefetch.Prefetch(std::vector<COutPoint>(outpoints.begin() + 32, outpoints.end()));
+    uint64_t nHitsExpected = 0;
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        if (i == 16 || i == 32 || i == 48) {
+            // The next batch of 16 is read once the previous one is used up,
+            // and the outpoints beyond the queue bound are never read.
+            for (int j = 0; j < 1000 && i < 48 && prefetch.DynamicMemoryUsage() == 0; j++)
+                MilliSleep(10);
+            MilliSleep(100);
+        }
+        if (i >= 16 && i < 48)
+            nHitsExpected++;
+        Coin coin;
+        BOOST_CHECK(prefetch.GetCoin(outpoints[i], coin));
+        BOOST_CHECK(coin.nHeight == 1 && coin.out.nValue == i);
+        BOOST_CHECK_EQUAL(prefetch.GetHits(), nHitsExpected);
+    }
+}
+
+namespace {
+
+/** Record written verbatim, to store data in a layout the current code no longer writes. */
+struct RawRecord
+{
+    std::vector<unsigned char> data;
+
+    RawRecord(const std::string& hex) : data(ParseHex(hex)) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const { return data.size(); }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        s.write((const char*)data.data(), data.size());
+    }
+};
+
+/** Coin database that can also access records in the old per-transaction layout. */
+class CCoinsViewDBLegacy : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBLegacy() : CCoinsViewDB(1 << 20, true) {}
+
+    void WriteLegacy(const uint256 &txid, const std::string &hex) { db.Write(std::make_pair('c', txid), RawRecord(hex)); }
+    bool HaveLegacy(const uint256 &txid) { return db.Exists(std::make_pair('c', txid)); }
+};
+
+}
+
+// Outputs are stored one record each. Adding, spending and overwriting through
+// caches of any depth must leave the database equal to a simple model.
+BOOST_FIXTURE_TEST_CASE(coins_db_per_output, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::map<COutPoint, Coin> result;
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 100; i++) {
+        // Transactions with one to many outputs
+        uint256 txid = GetRandHash();
+        unsigned int nOutputs = i % 10 == 0 ? 100 : 1 + insecure_rand() % 10;
+        for (unsigned int n = 0; n < nOutputs; n++) {
+            outpoints.push_back(COutPoint(txid, n));
+        }
+    }
+
+    for (int round = 0; round < 20; round++) {
+        CCoinsViewCache cache(&db);
+        // Half the rounds go through a second cache, whose entries reach the
+        // first one without knowing what the database holds.
+        CCoinsViewCache child(&cache);
+        CCoinsViewCache& view = round % 2 ? child : cache;
+        for (const COutPoint& outpoint : outpoints) {
+            Coin& model = result[outpoint];
+            uint32_t r = insecure_rand() % 8;
+            if ((model.IsSpent() && r < 3) || r == 3) {
+                // Create, or overwrite as a duplicate coinbase would.
+                CTxOut txout;
+                txout.nValue = insecure_rand() % 100000;
+                txout.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+                model = Coin(txout, insecure_rand() % 1000, r == 3);
+                view.AddCoin(outpoint, Coin(txout, model.nHeight, model.fCoinBase), r == 3);
+            } else if (!model.IsSpent() && r < 6) {
+                Coin coin;
+                BOOST_CHECK(view.SpendCoin(outpoint, &coin));
+                BOOST_CHECK(coin == model);
+                model.Clear();
+            }
+        }
+        if (round % 2)
+            BOOST_CHECK(child.Flush());
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+
+        size_t nUnspent = 0;
+        for (const COutPoint& outpoint : outpoints) {
+            const Coin& model = result[outpoint];
+            Coin coin;
+            bool fFound = db.GetCoin(outpoint, coin);
+            BOOST_CHECK_EQUAL(fFound, !model.IsSpent());
+            BOOST_CHECK_EQUAL(db.HaveCoin(outpoint), !model.IsSpent());
+            if (fFound) {
+                BOOST_CHECK(coin == model);
+                nUnspent++;
+            }
+        }
+
+        // The cursor yields every unspent output once, grouped by transaction.
+        size_t nCursor = 0;
+        std::set<uint256> setTxidsDone;
+        uint256 txidPrev;
+        boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+        for (; pcursor->Valid(); pcursor->Next()) {
+            COutPoint outpoint;
+            Coin coin;
+            BOOST_CHECK(pcursor->GetKey(outpoint));
+            BOOST_CHECK(pcursor->GetValue(coin));
+            BOOST_CHECK(coin == result[outpoint]);
+            if (outpoint.hash != txidPrev) {
+                BOOST_CHECK(setTxidsDone.insert(outpoint.hash).second);
+                txidPrev = outpoint.hash;
+            }
+            nCursor++;
+        }
+        BOOST_CHECK_EQUAL(nCursor, nUnspent);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_upgrade, TestingSetup)
+{
+    CCoinsViewDBLegacy db;
+    BOOST_CHECK(db.Upgrade());
+    // A cursor over an empty database is not valid
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    BOOST_CHECK(!pcursor->Valid());
+
+    // Per-transaction records as written by older versions: vout[1] unspent
+    // at height 203998; coinbase with vout[4] and vout[16] unspent at height
+    // 120891; and the smallest possible record.
+    uint256 txid1 = GetRandHash(), txid2 = GetRandHash(), txid3 = GetRandHash();
+    db.WriteLegacy(txid1, "0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e");
+    db.WriteLegacy(txid2, "0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b");
+    db.WriteLegacy(txid3, "0002000600");
+    // A record in the new layout is left alone
+    COutPoint outpointNew(GetRandHash(), 7);
+    CTxOut txoutNew;
+    txoutNew.nValue = 42;
+    {
+        CCoinsViewCache cache(&db);
+        cache.AddCoin(outpointNew, Coin(txoutNew, 5, false), false);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.Upgrade());
+
+    BOOST_CHECK(!db.HaveLegacy(txid1) && !db.HaveLegacy(txid2) && !db.HaveLegacy(txid3));
+    Coin coin;
+    BOOST_CHECK(!db.HaveCoin(COutPoint(txid1, 0)));
+    BOOST_CHECK(db.GetCoin(COutPoint(txid1, 1), coin));
+    BOOST_CHECK(coin == Coin(CTxOut(60000000000ULL, GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))), 203998, false));
+    for (unsigned int n = 0; n < 17; n++) {
+        BOOST_CHECK_EQUAL(db.HaveCoin(COutPoint(txid2, n)), n == 4 || n == 16);
+    }
+    BOOST_CHECK(db.GetCoin(COutPoint(txid2, 4), coin));
+    BOOST_CHECK(coin == Coin(CTxOut(234925952, GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))), 120891, true));
+    BOOST_CHECK(db.GetCoin(COutPoint(txid2, 16), coin));
+    BOOST_CHECK(coin == Coin(CTxOut(110397, GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))), 120891, true));
+    BOOST_CHECK(db.GetCoin(COutPoint(txid3, 0), coin));
+    BOOST_CHECK(coin == Coin(CTxOut(0, CScript()), 0, false));
+    BOOST_CHECK(db.GetCoin(outpointNew, coin));
+    BOOST_CHECK(coin == Coin(txoutNew, 5, false));
+
+    // Upgrading again finds nothing to do
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.HaveCoin(COutPoint(txid1, 1)));
+}
+
 BOOST_AUTO_TEST_CASE(ccoins_serialization)
 {
     // Good example
-    CDataStream ss1(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"), SER_DISK, CLIENT_VERSION);
-    CCoins cc1;
+    CDataStream ss1(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin cc1;
     ss1 >> cc1;
-    BOOST_CHECK_EQUAL(cc1.nVersion, 1);
     BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
-    BOOST_CHECK_EQUAL(cc1.vout.size(), 2);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(0), false);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(1), true);
-    BOOST_CHECK_EQUAL(cc1.vout[1].nValue, 60000000000ULL);
-    BOOST_CHECK_EQUAL(HexStr(cc1.vout[1].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+    BOOST_CHECK_EQUAL(cc1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(cc1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
 
     // Good example
-    CDataStream ss2(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
-    CCoins cc2;
+    CDataStream ss2(ParseHex("8ddf77bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4"), SER_DISK, CLIENT_VERSION);
+    Coin cc2;
     ss2 >> cc2;
-    BOOST_CHECK_EQUAL(cc2.nVersion, 1);
     BOOST_CHECK_EQUAL(cc2.fCoinBase, true);
     BOOST_CHECK_EQUAL(cc2.nHeight, 120891);
-    BOOST_CHECK_EQUAL(cc2.vout.size(), 17);
-    for (int i = 0; i < 17; i++) {
-        BOOST_CHECK_EQUAL(cc2.IsAvailable(i), i == 4 || i == 16);
-    }
-    BOOST_CHECK_EQUAL(cc2.vout[4].nValue, 234925952);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[4].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))));
-    BOOST_CHECK_EQUAL(cc2.vout[16].nValue, 110397);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[16].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+    BOOST_CHECK_EQUAL(cc2.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(cc2.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
 
     // Smallest possible example
-    CDataStream ssx(SER_DISK, CLIENT_VERSION);
-    BOOST_CHECK_EQUAL(HexStr(ssx.begin(), ssx.end()), "");
-
-    CDataStream ss3(ParseHex("0002000600"), SER_DISK, CLIENT_VERSION);
-    CCoins cc3;
+    CDataStream ss3(ParseHex("000006"), SER_DISK, CLIENT_VERSION);
+    Coin cc3;
     ss3 >> cc3;
-    BOOST_CHECK_EQUAL(cc3.nVersion, 0);
     BOOST_CHECK_EQUAL(cc3.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc3.nHeight, 0);
-    BOOST_CHECK_EQUAL(cc3.vout.size(), 1);
-    BOOST_CHECK_EQUAL(cc3.IsAvailable(0), true);
-    BOOST_CHECK_EQUAL(cc3.vout[0].nValue, 0);
-    BOOST_CHECK_EQUAL(cc3.vout[0].scriptPubKey.size(), 0);
+    BOOST_CHECK_EQUAL(cc3.out.nValue, 0);
+    BOOST_CHECK_EQUAL(cc3.out.scriptPubKey.size(), 0);
 
     // scriptPubKey that ends beyond the end of the stream
-    CDataStream ss4(ParseHex("0002000800"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss4(ParseHex("000007"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc4;
+        Coin cc4;
         ss4 >> cc4;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
@@ -406,9 +785,9 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     uint64_t x = 3000000000ULL;
     tmp << VARINT(x);
     BOOST_CHECK_EQUAL(HexStr(tmp.begin(), tmp.end()), "8a95c0bb00");
-    CDataStream ss5(ParseHex("0002008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss5(ParseHex("00008a95c0bb00"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc5;
+        Coin cc5;
         ss5 >> cc5;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
@@ -126,6 +126,53 @@ BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
     }
 }
 
+// Test non-default LevelDB options and compaction
+BOOST_AUTO_TEST_CASE(dbwrapper_options)
+{
+    path ph = temp_directory_path() / unique_path();
+    CDBOptions dbOptions;
+    dbOptions.nBlockSize = 1 << 10;
+    dbOptions.fCompression = true;
+    dbOptions.nBloomBits = 0;
+    dbOptions.nWriteBufferSize = 64 << 10;
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, false, true, dbOptions);
+
+        // Enough data to fill several write buffers
+        std::vector<uint256> values;
+        for (uint32_t i = 0; i < 4000; i++) {
+            values.push_back(GetRandHash());
+            BOOST_CHECK(dbw.Write(std::make_pair('o', i), values.back()));
+        }
+        for (uint32_t i = 0; i < 4000; i += 2)
+            BOOST_CHECK(dbw.Erase(std::make_pair('o', i)));
+
+        // Compact the first half of the keys, then everything
+        std::string strBegin, strEnd;
+        {
+            CDataStream ssBegin(SER_DISK, CLIENT_VERSION), ssEnd(SER_DISK, CLIENT_VERSION);
+            ssBegin << std::make_pair('o', (uint32_t)0);
+            ssEnd << std::make_pair('o', (uint32_t)2000);
+            strBegin.assign(ssBegin.begin(), ssBegin.end());
+            strEnd.assign(ssEnd.begin(), ssEnd.end());
+        }
+        dbw.CompactRawRange(&strBegin, &strEnd);
+        dbw.CompactRawRange(NULL, NULL);
+
+        std::vector<int> vFiles = dbw.GetFilesPerLevel();
+        BOOST_CHECK(vFiles.size() > 1);
+        BOOST_CHECK_EQUAL(vFiles[0], 0);
+
+        for (uint32_t i = 0; i < 4000; i++) {
+            uint256 res;
+            BOOST_CHECK_EQUAL(dbw.Read(std::make_pair('o', i), res), i % 2 == 1);
+            if (i % 2)
+                BOOST_CHECK(res == values[i]);
+        }
+    }
+    boost::filesystem::remove_all(ph);
+}
+
 // Test that we do not obfuscation if there is existing data.
 BOOST_AUTO_TEST_CASE(existing_data_no_obfuscate)
 {
@@ -2,7 +2,9 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/common.h"
 #include "hash.h"
+#include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -122,6 +124,20 @@ BOOST_AUTO_TEST_CASE(siphash)
         hasher3.Write(uint64_t(x)|(uint64_t(x+1)<<8)|(uint64_t(x+2)<<16)|(uint64_t(x+3)<<24)|
                      (uint64_t(x+4)<<32)|(uint64_t(x+5)<<40)|(uint64_t(x+6)<<48)|(uint64_t(x+7)<<56));
     }
+
+    // Check consistency between CSipHasher and SipHashUint256[Extra].
+    for (int i = 0; i < 16; ++i) {
+        uint256 x = GetRandHash();
+        uint32_t n = insecure_rand();
+        uint8_t nb[4];
+        WriteLE32(nb, n);
+        CSipHasher sip256(1, 2);
+        sip256.Write(x.begin(), 32);
+        CSipHasher sip288 = sip256;
+        sip288.Write(nb, 4);
+        BOOST_CHECK_EQUAL(SipHashUint256(1, 2, x), sip256.Finalize());
+        BOOST_CHECK_EQUAL(SipHashUint256Extra(1, 2, x, n), sip288.Finalize());
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,134 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+#include "chainparams.h"
+#include "main.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mappedfile_tests, TestingSetup)
+
+static void AppendToFile(const boost::filesystem::path& path, const std::vector<unsigned char>& data)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file != NULL);
+    BOOST_REQUIRE(fwrite(data.data(), 1, data.size(), file) == data.size());
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_cache)
+{
+#ifndef WIN32
+    if (sizeof(void*) < 8)
+        return;
+    std::vector<boost::filesystem::path> paths;
+    for (int i = 0; i < 3; i++) {
+        paths.push_back(pathTemp / strprintf("mapped%d.dat", i));
+        AppendToFile(paths[i], std::vector<unsigned char>(100, i));
+    }
+
+    CMappedFileCache cache(2);
+    std::shared_ptr<const CMappedFile> m0 = cache.Get(0, paths[0], 100);
+    BOOST_REQUIRE(m0);
+    BOOST_CHECK_EQUAL(m0->size(), 100U);
+    BOOST_CHECK(m0->data()[99] == 0);
+    // Asking for more than the file holds fails.
+    BOOST_CHECK(!cache.Get(1, paths[1], 101));
+    BOOST_CHECK(cache.Get(1, paths[1], 50));
+    BOOST_CHECK(cache.Get(0, paths[0], 1) == m0);
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+
+    // File 1 is now least recently used and makes room for file 2.
+    std::shared_ptr<const CMappedFile> m1 = cache.Get(1, paths[1], 1);
+    BOOST_CHECK(cache.Get(0, paths[0], 1) == m0);
+    BOOST_CHECK(cache.Get(2, paths[2], 1));
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK(cache.Get(1, paths[1], 1) != m1);
+    // The evicted mapping is still usable by whoever holds it.
+    BOOST_CHECK(m1->data()[0] == 1);
+
+    // A file that grew is remapped when a reader needs the new bytes.
+    m0 = cache.Get(0, paths[0], 100);
+    BOOST_REQUIRE(m0);
+    AppendToFile(paths[0], std::vector<unsigned char>(100, 7));
+    BOOST_CHECK(cache.Get(0, paths[0], 100) == m0);
+    std::shared_ptr<const CMappedFile> m0b = cache.Get(0, paths[0], 200);
+    BOOST_REQUIRE(m0b);
+    BOOST_CHECK(m0b != m0);
+    BOOST_CHECK(m0b->data()[150] == 7);
+
+    cache.Evict(0);
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(spanreader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << (uint32_t)0x01020304 << std::string("mapped");
+    std::vector<unsigned char> data(ss.begin(), ss.end());
+
+    CSpanReader reader(SER_DISK, CLIENT_VERSION, data.data(), data.size());
+    uint32_t n;
+    std::string str;
+    reader >> n >> str;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    BOOST_CHECK_EQUAL(str, "mapped");
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_readblock)
+{
+    const CChainParams& chainparams = Params();
+    const CBlock& genesis = chainparams.GenesisBlock();
+    CBlock block;
+
+    // The genesis block written by InitBlockIndex reads back through the mapping.
+    BOOST_CHECK(ReadBlockFromDisk(block, chainActive.Genesis(), chainparams.GetConsensus()));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+
+    // Blocks appended after their file was first mapped are still found.
+    const int nFile = 1000;
+    CDiskBlockPos pos1(nFile, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(genesis, pos1, chainparams.MessageStart()));
+    BOOST_CHECK(ReadBlockFromDisk(block, pos1, chainparams.GetConsensus()));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+    CDiskBlockPos pos2(nFile, pos1.nPos + ::GetSerializeSize(genesis, SER_DISK, CLIENT_VERSION));
+    BOOST_REQUIRE(WriteBlockToDisk(genesis, pos2, chainparams.MessageStart()));
+    BOOST_CHECK(pos2.nPos > pos1.nPos);
+    block.SetNull();
+    BOOST_CHECK(ReadBlockFromDisk(block, pos2, chainparams.GetConsensus()));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+
+    // Pruning drops the mapping together with the file.
+    std::set<int> setFilesToPrune;
+    setFilesToPrune.insert(nFile);
+    UnlinkPrunedFiles(setFilesToPrune);
+    BOOST_CHECK(!ReadBlockFromDisk(block, pos1, chainparams.GetConsensus()));
+}
+
+BOOST_AUTO_TEST_CASE(readrawblock)
+{
+    const CChainParams& chainparams = Params();
+    std::vector<unsigned char> vRaw;
+    BOOST_REQUIRE(ReadRawBlockFromDisk(vRaw, chainActive.Genesis(), chainparams.MessageStart()));
+
+    // The stored bytes are the network serialization, witness included.
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << chainparams.GenesisBlock();
+    BOOST_CHECK(vRaw == std::vector<unsigned char>(ss.begin(), ss.end()));
+
+    // Data not stored for this network is refused.
+    CMessageHeader::MessageStartChars badStart = {0, 0, 0, 0};
+    BOOST_CHECK(!ReadRawBlockFromDisk(vRaw, chainActive.Genesis(), badStart));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
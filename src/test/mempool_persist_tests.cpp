@@ -0,0 +1,148 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/validation.h"
+#include "main.h"
+#include "script/standard.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mempool_persist_tests, TestingSetup)
+
+static const CScript REDEEM_SCRIPT = CScript() << OP_TRUE;
+
+// A transaction spending the first output of prevout's transaction to a
+// pay-to-script-hash of OP_TRUE, which is standard and needs no signature.
+static CTransaction Spend(const COutPoint& prevout, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(REDEEM_SCRIPT.begin(), REDEEM_SCRIPT.end());
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = GetScriptForDestination(CScriptID(REDEEM_SCRIPT));
+    tx.vout[0].nValue = nValue;
+    return CTransaction(tx);
+}
+
+static bool ToMemPool(const CTransaction& tx)
+{
+    LOCK(cs_main);
+    CValidationState state;
+    return AcceptToMemoryPool(mempool, state, tx, false, NULL);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_dump_load)
+{
+    // Give ourselves a coin to spend, as if it had been mined
+    CMutableTransaction funding;
+    funding.vout.resize(1);
+    funding.vout[0].scriptPubKey = GetScriptForDestination(CScriptID(REDEEM_SCRIPT));
+    funding.vout[0].nValue = 50 * COIN;
+    {
+        LOCK(cs_main);
+        AddCoins(*pcoinsTip, CTransaction(funding), 0);
+    }
+
+    SetMockTime(GetTime());
+    CTransaction txParent = Spend(COutPoint(funding.GetHash(), 0), 49 * COIN);
+    CTransaction txChild = Spend(COutPoint(txParent.GetHash(), 0), 48 * COIN);
+    BOOST_CHECK(ToMemPool(txParent));
+    BOOST_CHECK(ToMemPool(txChild));
+    int64_t nTime = mempool.info(txParent.GetHash()).nTime;
+    mempool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0, 10000);
+    mempool.PrioritiseTransaction(GetRandHash(), "unknown", 0, 5000);
+    BOOST_CHECK(DumpMempool());
+
+    // Loading on top of the same tip skips the script checks
+    SetMockTime(nTime + 60);
+    mempool.clear();
+    {
+        LOCK(mempool.cs);
+        mempool.mapDeltas.clear();
+    }
+    CMempoolLoadStats stats;
+    BOOST_CHECK(LoadMempool(stats));
+    BOOST_CHECK_EQUAL(stats.nAccepted, 2);
+    BOOST_CHECK_EQUAL(stats.nScriptChecksSkipped, 2);
+    BOOST_CHECK_EQUAL(stats.nFailed, 0);
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    BOOST_CHECK_EQUAL(mempool.info(txParent.GetHash()).nTime, nTime);
+    BOOST_CHECK_EQUAL(mempool.mapDeltas.size(), 2U);
+    BOOST_CHECK_EQUAL(mempool.mapTx.find(txChild.GetHash())->GetModifiedFee(), COIN + 10000);
+
+    // Loading again finds them there already, and leaves their deltas alone
+    BOOST_CHECK(LoadMempool(stats));
+    BOOST_CHECK_EQUAL(stats.nAccepted, 0);
+    BOOST_CHECK_EQUAL(stats.nAlreadyHad, 2);
+    BOOST_CHECK_EQUAL(mempool.mapTx.find(txChild.GetHash())->GetModifiedFee(), COIN + 10000);
+
+    // Unless told to check the scripts of everything it loads
+    mempool.clear();
+    mapArgs["-checkmempoolload"] = "1";
+    BOOST_CHECK(LoadMempool(stats));
+    mapArgs.erase("-checkmempoolload");
+    BOOST_CHECK_EQUAL(stats.nAccepted, 2);
+    BOOST_CHECK_EQUAL(stats.nScriptChecksSkipped, 0);
+
+    // A dump made on another tip has its scripts checked again
+    {
+        boost::filesystem::path path = GetDataDir() / "mempool.dat";
+        FILE* file = fopen(path.string().c_str(), "r+b");
+        BOOST_REQUIRE(file);
+        BOOST_CHECK_EQUAL(fseek(file, 8, SEEK_SET), 0); // past the version
+        fputc(0xff, file);
+        fclose(file);
+    }
+    mempool.clear();
+    BOOST_CHECK(LoadMempool(stats));
+    BOOST_CHECK_EQUAL(stats.nAccepted, 2);
+    BOOST_CHECK_EQUAL(stats.nScriptChecksSkipped, 0);
+
+    // A transaction that got corrupted on disk no longer matches its witness
+    // hash, so its scripts are checked and it is rejected, and its child
+    // with it
+    BOOST_CHECK(DumpMempool());
+    {
+        CDataStream ssTx(SER_DISK, CLIENT_VERSION);
+        ssTx << txParent;
+        boost::filesystem::path path = GetDataDir() / "mempool.dat";
+        FILE* file = fopen(path.string().c_str(), "r+b");
+        BOOST_REQUIRE(file);
+        std::vector<char> vData(1 << 16);
+        vData.resize(fread(vData.data(), 1, vData.size(), file));
+        std::vector<char>::iterator it = std::search(vData.begin(), vData.end(), ssTx.begin(), ssTx.end());
+        BOOST_REQUIRE(it != vData.end());
+        // The redeem script pushed by the scriptSig, after the version, the
+        // input count, the prevout, the script length and the push opcode
+        long nPos = (it - vData.begin()) + 4 + 1 + 36 + 1 + 1;
+        BOOST_CHECK_EQUAL(vData[nPos], (char)OP_TRUE);
+        BOOST_CHECK_EQUAL(fseek(file, nPos, SEEK_SET), 0);
+        fputc(OP_2, file);
+        fclose(file);
+    }
+    mempool.clear();
+    BOOST_CHECK(LoadMempool(stats));
+    BOOST_CHECK_EQUAL(stats.nAccepted, 0);
+    BOOST_CHECK_EQUAL(stats.nFailed, 2);
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    // Transactions past -mempoolexpiry are not loaded
+    SetMockTime(nTime + DEFAULT_MEMPOOL_EXPIRY * 60 * 60);
+    mempool.clear();
+    BOOST_CHECK(LoadMempool(stats));
+    BOOST_CHECK_EQUAL(stats.nAccepted, 0);
+    BOOST_CHECK_EQUAL(stats.nExpired, 2);
+
+    mempool.clear();
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
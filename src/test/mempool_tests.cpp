@@ -9,6 +9,7 @@
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <limits>
 #include <list>
 #include <vector>
 
@@ -423,6 +424,88 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
 }
 
 
+BOOST_AUTO_TEST_CASE(MempoolReorgTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    std::list<CTransaction> conflicts;
+
+    // txParent has two children, txChild1 and txChild2, which are both
+    // spent by txGrandChild.
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 10 * COIN;
+    }
+    CMutableTransaction txChild[2];
+    for (int i = 0; i < 2; i++) {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 5 * COIN;
+    }
+    CMutableTransaction txGrandChild;
+    txGrandChild.vin.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txGrandChild.vin[i].scriptSig = CScript() << OP_11;
+        txGrandChild.vin[i].prevout = COutPoint(txChild[i].GetHash(), 0);
+    }
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 5 * COIN;
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    pool.addUnchecked(txChild[0].GetHash(), entry.Fee(2000LL).FromTx(txChild[0]));
+    pool.addUnchecked(txChild[1].GetHash(), entry.Fee(3000LL).FromTx(txChild[1]));
+    pool.addUnchecked(txGrandChild.GetHash(), entry.Fee(4000LL).FromTx(txGrandChild));
+
+    // Mine txParent and txChild1...
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txParent);
+    vtx.push_back(txChild[0]);
+    pool.removeForBlock(vtx, 1, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txGrandChild.GetHash())->GetCountWithAncestors(), 2U);
+
+    // ... then disconnect the block again, putting its transactions back the
+    // way DisconnectTip does.
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    pool.addUnchecked(txChild[0].GetHash(), entry.Fee(2000LL).FromTx(txChild[0]));
+    std::vector<uint256> vHashUpdate;
+    vHashUpdate.push_back(txParent.GetHash());
+    vHashUpdate.push_back(txChild[0].GetHash());
+    pool.UpdateTransactionsFromBlock(vHashUpdate);
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+
+    CTxMemPool::txiter it = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 4U);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 10000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it).size(), 2U);
+    it = pool.mapTx.find(txChild[0].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 2U);
+    it = pool.mapTx.find(txChild[1].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 2U);
+    it = pool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 4U);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 10000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(it).size(), 2U);
+
+    CTxMemPool::setEntries setAncestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3U);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*it, setAncestors, 3, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+}
+
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
     CTxMemPool pool(CFeeRate(1000));
@@ -133,4 +133,34 @@ BOOST_AUTO_TEST_CASE(merkle_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(merkle_batched_matches_branch)
+{
+    // The batched level-by-level root must agree with the root implied by
+    // the constant-space branch computation, including sizes that exercise
+    // the 8-, 4- and 1-wide paths of SHA256D64 at every level.
+    for (int i = 0; i < 64; i++) {
+        int nleaves = (i < 40) ? i : 40 + (insecure_rand() % 3000);
+        std::vector<uint256> leaves(nleaves);
+        for (int j = 0; j < nleaves; j++) {
+            leaves[j] = GetRandHash();
+        }
+        bool mutated = true;
+        uint256 root = ComputeMerkleRoot(leaves, &mutated);
+        BOOST_CHECK(!mutated);
+        if (nleaves == 0) {
+            BOOST_CHECK(root.IsNull());
+            continue;
+        }
+        int pos = insecure_rand() % nleaves;
+        BOOST_CHECK(ComputeMerkleRootFromBranch(leaves[pos], ComputeMerkleBranch(leaves, pos), pos) == root);
+        // Two identical siblings anywhere in the tree are reported as a mutation.
+        int left = pos & ~1;
+        if (left + 1 < nleaves) {
+            leaves[left] = leaves[left + 1];
+            ComputeMerkleRoot(leaves, &mutated);
+            BOOST_CHECK(mutated);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -10,6 +10,7 @@
 #include "main.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "scheduler.h"
 #include "script/standard.h"
 #include "txmempool.h"
 #include "uint256.h"
@@ -178,6 +179,124 @@ void TestPackageSelection(const CChainParams& chainparams, CScript scriptPubKey,
     BOOST_CHECK(pblocktemplate->block.vtx[8].GetHash() == hashLowFeeTx2);
 }
 
+static const CScript OP_TRUE_REDEEM_SCRIPT = CScript() << OP_TRUE;
+
+// Spends the output prevout to a pay-to-script-hash of OP_TRUE, which needs
+// no signature and is standard.
+static CTransaction SpendToP2SH(const COutPoint& prevout, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(OP_TRUE_REDEEM_SCRIPT.begin(), OP_TRUE_REDEEM_SCRIPT.end());
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = GetScriptForDestination(CScriptID(OP_TRUE_REDEEM_SCRIPT));
+    tx.vout[0].nValue = nValue;
+    return CTransaction(tx);
+}
+
+static std::multiset<uint256> BlockTxids(const CBlock& block)
+{
+    std::multiset<uint256> setTxids;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        setTxids.insert(block.vtx[i].GetHash());
+    return setTxids;
+}
+
+BOOST_AUTO_TEST_CASE(CreateBlockTemplate_incremental)
+{
+    const CChainParams& chainparams = Params(CBaseChainParams::MAIN);
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    const CAmount nSubsidy = GetBlockSubsidy(1, chainparams.GetConsensus());
+
+    // Give ourselves coins to spend, as if they had been mined
+    CMutableTransaction funding;
+    funding.vout.resize(2);
+    for (CTxOut& txout : funding.vout) {
+        txout.scriptPubKey = GetScriptForDestination(CScriptID(OP_TRUE_REDEEM_SCRIPT));
+        txout.nValue = 50 * COIN;
+    }
+    {
+        LOCK(cs_main);
+        AddCoins(*pcoinsTip, CTransaction(funding), 0);
+    }
+    CTransaction txParent = SpendToP2SH(COutPoint(funding.GetHash(), 0), 49 * COIN);
+    CTransaction txChild = SpendToP2SH(COutPoint(txParent.GetHash(), 0), 47 * COIN);
+    CTransaction txOther = SpendToP2SH(COutPoint(funding.GetHash(), 1), 46 * COIN);
+
+    CScheduler scheduler;
+    StartBlockCandidate(chainparams, scheduler);
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, txParent, false, NULL));
+    }
+
+    // The first template is assembled from scratch
+    std::unique_ptr<CBlockTemplate> pblocktemplate(CreateBlockTemplate(chainparams, scriptPubKey));
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0].vout[0].nValue, nSubsidy + COIN);
+
+    // Later ones pick up what entered the mempool since, after their parents
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, txChild, false, NULL));
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, txOther, false, NULL));
+    }
+    pblocktemplate.reset(CreateBlockTemplate(chainparams, scriptPubKey));
+    BOOST_REQUIRE(pblocktemplate);
+    const CBlock& block = pblocktemplate->block;
+    BOOST_REQUIRE_EQUAL(block.vtx.size(), 4U);
+    BOOST_CHECK(block.vtx[1].GetHash() == txParent.GetHash());
+    BOOST_CHECK(block.vtx[2].GetHash() == txChild.GetHash());
+    BOOST_CHECK(block.vtx[3].GetHash() == txOther.GetHash());
+    BOOST_CHECK_EQUAL(block.vtx[0].vout[0].nValue, nSubsidy + 7 * COIN);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -7 * COIN);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[2], 2 * COIN);
+
+    // and select what assembling the block from scratch would
+    std::unique_ptr<CBlockTemplate> pblocktemplateFull(BlockAssembler(chainparams).CreateNewBlock(scriptPubKey));
+    BOOST_REQUIRE(pblocktemplateFull);
+    BOOST_CHECK(BlockTxids(pblocktemplateFull->block) == BlockTxids(block));
+    BOOST_CHECK_EQUAL(pblocktemplateFull->block.vtx[0].vout[0].nValue, block.vtx[0].vout[0].nValue);
+
+    // Transactions leave the template with the mempool, descendants and all
+    {
+        LOCK(cs_main);
+        std::list<CTransaction> removed;
+        mempool.removeRecursive(txParent, removed);
+        BOOST_CHECK_EQUAL(removed.size(), 2U);
+    }
+    pblocktemplate.reset(CreateBlockTemplate(chainparams, scriptPubKey));
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == txOther.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0].vout[0].nValue, nSubsidy + 4 * COIN);
+
+    // A selection that changed is tested again before a template is made of
+    // it, here finding that a transaction spends a coin that does not exist
+    CTransaction txMissing = SpendToP2SH(COutPoint(GetRandHash(), 0), COIN);
+    TestMemPoolEntryHelper entry;
+    {
+        LOCK(cs_main);
+        mempool.addUnchecked(txMissing.GetHash(), entry.Fee(COIN / 10).FromTx(txMissing));
+    }
+    BOOST_CHECK_THROW(CreateBlockTemplate(chainparams, scriptPubKey), std::runtime_error);
+    {
+        LOCK(cs_main);
+        std::list<CTransaction> removed;
+        mempool.removeRecursive(txMissing, removed);
+    }
+    pblocktemplate.reset(CreateBlockTemplate(chainparams, scriptPubKey));
+    BOOST_REQUIRE(pblocktemplate);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+
+    StopBlockCandidate();
+    mempool.clear();
+}
+
 // NOTE: These tests rely on CreateNewBlock doing its own self-validation!
 BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 {
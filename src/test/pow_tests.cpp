@@ -13,6 +13,144 @@
 
 using namespace std;
 
+/* Uncached EMA retarget as it used to walk the block index on every call */
+static unsigned int ReferenceEMA(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
+{
+    const int64_t perBlockTargetTimespan = 120;
+    const arith_uint256 bnPowLimit = UintToArith256(params.powLimit);
+    int64_t block_durations[2160];
+    float alpha = 0.09;
+    if (pindexLast->nHeight > 110322) {
+        alpha = 0.06;
+    }
+    float accumulator = 120;
+    arith_uint256 fiveThousandsLimit;
+    fiveThousandsLimit.SetCompact(0x1b0c7898);
+
+    if (pindexLast->nHeight < 175000 && pblock->nTime > (pindexLast->nTime + perBlockTargetTimespan*10)) {
+        arith_uint256 bnNew;
+        bnNew.SetCompact(pindexLast->nBits);
+        if (pindexLast->nHeight > 101631 && pindexLast->nHeight < 103791) {
+            bnNew *= 10;
+        } else {
+            bnNew *= 2;
+        }
+        if (pindexLast->nHeight > 104290 && bnNew > fiveThousandsLimit)
+            bnNew = fiveThousandsLimit;
+        if (bnNew > bnPowLimit)
+            bnNew = bnPowLimit;
+        return bnNew.GetCompact();
+    }
+
+    const CBlockIndex* pindexFirst = pindexLast;
+    for (int i = 0; pindexFirst && i < 2160 ; i++) {
+        block_durations[2159 - i] = pindexFirst->GetBlockTime() - pindexFirst->pprev->GetBlockTime();
+        if (pindexLast->nHeight > 110322) {
+            if (block_durations[2159 - i] > (1.5 * perBlockTargetTimespan) ) {
+                block_durations[2159 - i] = 1.5 * perBlockTargetTimespan;
+            }
+            if ((block_durations[2159 - i] >= 0) && (block_durations[2159 - i] < (perBlockTargetTimespan / 2)) ) {
+                block_durations[2159 - i] = perBlockTargetTimespan / 2;
+            }
+        }
+        if (block_durations[2159 - i] < 0 && pindexLast->nHeight > 104290) {
+            block_durations[2159 - i] = perBlockTargetTimespan;
+        }
+        pindexFirst = pindexFirst->pprev;
+    }
+    for (int i=0; i<2160 ; i++) {
+        accumulator = (alpha * block_durations[i]) + (1 - alpha) * accumulator;
+    }
+
+    int64_t nActualTimespan = accumulator;
+    if (nActualTimespan < perBlockTargetTimespan / 2)
+        nActualTimespan = perBlockTargetTimespan / 2;
+    if (pindexLast->nHeight > 110322 && nActualTimespan > perBlockTargetTimespan * 2) {
+        nActualTimespan = perBlockTargetTimespan * 2;
+    } else if(nActualTimespan > perBlockTargetTimespan * 4) {
+        nActualTimespan = perBlockTargetTimespan * 4;
+    }
+
+    arith_uint256 bnNew;
+    bnNew.SetCompact(pindexLast->nBits);
+    bnNew *= nActualTimespan;
+    bnNew /= perBlockTargetTimespan;
+    if (pindexLast->nHeight > 104290 && bnNew > fiveThousandsLimit)
+        bnNew = fiveThousandsLimit;
+    if (bnNew > bnPowLimit)
+        bnNew = bnPowLimit;
+    return bnNew.GetCompact();
+}
+
+/* Uncached DarkGravityWave v3 as it used to walk the block index on every call */
+static unsigned int ReferenceDGW(const CBlockIndex* pindexLast, const Consensus::Params& params)
+{
+    const CBlockIndex *BlockReading = pindexLast;
+    int64_t nActualTimespan = 0;
+    int64_t LastBlockTime = 0;
+    int64_t CountBlocks = 0;
+    arith_uint256 PastDifficultyAverage;
+    arith_uint256 PastDifficultyAveragePrev;
+    const arith_uint256 bnPowLimit = UintToArith256(params.powLimit);
+
+    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+        if (i > 24) { break; }
+        CountBlocks++;
+        if (CountBlocks == 1) { PastDifficultyAverage.SetCompact(BlockReading->nBits); }
+        else { PastDifficultyAverage = ((PastDifficultyAveragePrev * CountBlocks) + (arith_uint256().SetCompact(BlockReading->nBits))) / (CountBlocks + 1); }
+        PastDifficultyAveragePrev = PastDifficultyAverage;
+        if (LastBlockTime > 0) {
+            nActualTimespan += LastBlockTime - BlockReading->GetBlockTime();
+        }
+        LastBlockTime = BlockReading->GetBlockTime();
+        if (BlockReading->pprev == NULL) { break; }
+        BlockReading = BlockReading->pprev;
+    }
+
+    arith_uint256 bnNew(PastDifficultyAverage);
+    int64_t _nTargetTimespan = CountBlocks * params.nPowTargetSpacing;
+    if (nActualTimespan < _nTargetTimespan/3)
+        nActualTimespan = _nTargetTimespan/3;
+    if (nActualTimespan > _nTargetTimespan*3)
+        nActualTimespan = _nTargetTimespan*3;
+    bnNew *= nActualTimespan;
+    bnNew /= _nTargetTimespan;
+    if (bnNew > bnPowLimit)
+        bnNew = bnPowLimit;
+    return bnNew.GetCompact();
+}
+
+/* Build a header chain starting at nStartHeight whose nBits follow the reference retarget, with
+ * block durations that hit every clamp (negative, very short, very long and stalled blocks) */
+static void BuildRetargetChain(std::vector<CBlockIndex>& blocks, int nStartHeight, bool fEMA, const Consensus::Params& params)
+{
+    for (size_t i = 0; i < blocks.size(); i++) {
+        CBlockIndex& block = blocks[i];
+        block.pprev = i ? &blocks[i - 1] : NULL;
+        block.nHeight = nStartHeight + i;
+        if (i == 0) {
+            block.nTime = 1400000000;
+            block.nBits = 0x1b0404cb;
+            continue;
+        }
+        int64_t nDuration;
+        switch (insecure_rand() % 8) {
+        case 0: nDuration = -(int64_t)(insecure_rand() % 600); break;
+        case 1: nDuration = insecure_rand() % 60; break;
+        case 2: nDuration = 1200 + insecure_rand() % 2400; break;
+        default: nDuration = 60 + insecure_rand() % 200; break;
+        }
+        block.nTime = block.pprev->nTime + nDuration;
+        CBlockHeader header;
+        header.nTime = block.nTime;
+        if (block.pprev->nHeight <= 101631) {
+            block.nBits = block.pprev->nBits;
+        } else {
+            block.nBits = fEMA ? ReferenceEMA(block.pprev, &header, params) : ReferenceDGW(block.pprev, params);
+        }
+    }
+}
+
 BOOST_FIXTURE_TEST_SUITE(pow_tests, BasicTestingSetup)
 
 /* Test calculation of next difficulty target with no constraints applying */
@@ -95,4 +233,43 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+/* Cached EMA and DarkGravityWave retargets must match a full walk of the index, whether the chain
+ * is connected in order (sliding window), queried at random (window rebuilds) or queried twice (memo) */
+BOOST_AUTO_TEST_CASE(retarget_cache_matches_walk)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const Consensus::Params& params = Params().GetConsensus();
+
+    std::vector<CBlockIndex> ema(14000);
+    BuildRetargetChain(ema, 99000, true, params);
+    std::vector<CBlockIndex> dgw(3000);
+    BuildRetargetChain(dgw, 832500, false, params);
+
+    ClearRetargetCache();
+    for (size_t i = 2633; i < ema.size(); i++) {
+        CBlockHeader header;
+        header.nTime = ema[i].nTime;
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&ema[i - 1], &header, params), ReferenceEMA(&ema[i - 1], &header, params));
+    }
+    for (size_t i = 501; i < dgw.size(); i++) {
+        CBlockHeader header;
+        header.nTime = dgw[i].nTime;
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&dgw[i - 1], &header, params), ReferenceDGW(&dgw[i - 1], params));
+    }
+
+    ClearRetargetCache();
+    for (int j = 0; j < 2000; j++) {
+        const CBlockIndex* pindexLast = &ema[2632 + GetRand(ema.size() - 2632)];
+        CBlockHeader header;
+        header.nTime = pindexLast->nTime + GetRand(1300);
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, &header, params), ReferenceEMA(pindexLast, &header, params));
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, &header, params), ReferenceEMA(pindexLast, &header, params));
+
+        pindexLast = &dgw[500 + GetRand(dgw.size() - 500)];
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, &header, params), ReferenceDGW(pindexLast, params));
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, &header, params), ReferenceDGW(pindexLast, params));
+    }
+    ClearRetargetCache();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -213,4 +213,28 @@ BOOST_AUTO_TEST_CASE(sighash_from_data)
         BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
     }
 }
+
+// Goal: check that witness signature hashes come out the same whether the
+// transaction hashes are precomputed, left out, or not computed at all
+BOOST_AUTO_TEST_CASE(sighash_precomputed)
+{
+    seed_insecure_rand(false);
+
+    for (int i = 0; i < 1000; i++) {
+        int nHashType = insecure_rand();
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        int nIn = insecure_rand() % txTo.vin.size();
+        const CTransaction tx(txTo);
+
+        PrecomputedTransactionData txdata(tx);
+        PrecomputedTransactionData txdataNotReady;
+        BOOST_CHECK(txdata.ready && !txdataNotReady.ready);
+        uint256 sh = SignatureHash(scriptCode, tx, nIn, nHashType, i, SIGVERSION_WITNESS_V0);
+        BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, i, SIGVERSION_WITNESS_V0, &txdata) == sh);
+        BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, i, SIGVERSION_WITNESS_V0, &txdataNotReady) == sh);
+    }
+}
 BOOST_AUTO_TEST_SUITE_END()
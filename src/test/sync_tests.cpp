@@ -0,0 +1,118 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sync.h"
+#include "test/test_bitcoin.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(sync_tests, BasicTestingSetup)
+
+static CLockSiteStats FindLockSite(int nLine)
+{
+    for (const CLockSiteStats& stats : GetLockStats())
+        if (stats.strFile == __FILE__ && stats.nLine == nLine)
+            return stats;
+    BOOST_ERROR("no locking site at line " << nLine);
+    return CLockSiteStats();
+}
+
+static int LockOnce(CCriticalSection& cs)
+{
+    LOCK(cs); return __LINE__;
+}
+
+static int LockInLoop(CCriticalSection& cs, int n)
+{
+    int nLine = __LINE__ + 2;
+    for (int i = 0; i < n; i++)
+        LOCK(cs);
+    return nLine;
+}
+
+BOOST_AUTO_TEST_CASE(lockstats_counts)
+{
+    CCriticalSection cs;
+    int nLine = 0;
+    for (int i = 0; i < 10; i++)
+        nLine = LockOnce(cs);
+
+    CLockSiteStats stats = FindLockSite(nLine);
+    BOOST_CHECK_EQUAL(stats.strName, "cs");
+    BOOST_CHECK(stats.nAcquired >= 10);
+    BOOST_CHECK(stats.nMaxHoldMicros <= stats.nHoldMicros);
+
+    ResetLockStats();
+    stats = FindLockSite(nLine);
+    BOOST_CHECK_EQUAL(stats.nAcquired, 0U);
+    BOOST_CHECK_EQUAL(stats.nHoldMicros, 0);
+}
+
+BOOST_AUTO_TEST_CASE(lockstats_contention)
+{
+    CCriticalSection cs;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fLocked = false;
+
+    // Hold the lock in another thread, long enough for us to notice.
+    boost::thread thread([&] {
+        LOCK(cs);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fLocked = true;
+            cond.notify_one();
+        }
+        MilliSleep(50);
+    });
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fLocked)
+            cond.wait(lock);
+    }
+
+    int nTryLine;
+    bool fGotIt;
+    { TRY_LOCK(cs, lockTry); fGotIt = lockTry; nTryLine = __LINE__; }
+    BOOST_CHECK(!fGotIt);
+
+    int nLine;
+    { LOCK(cs); nLine = __LINE__; }
+    thread.join();
+
+    CLockSiteStats stats = FindLockSite(nTryLine);
+    BOOST_CHECK_EQUAL(stats.nAcquired, 0U);
+    BOOST_CHECK_EQUAL(stats.nContended, 1U);
+
+    stats = FindLockSite(nLine);
+    BOOST_CHECK_EQUAL(stats.nAcquired, 1U);
+    BOOST_CHECK_EQUAL(stats.nContended, 1U);
+    BOOST_CHECK(stats.nWaitMicros > 0);
+}
+
+BOOST_AUTO_TEST_CASE(lock_single_statement)
+{
+    // The lock macros are single declarations, so as the body of a loop or
+    // of an if without braces they lock and unlock right there, and nothing
+    // of them is left to run outside it.
+    CCriticalSection cs1, cs2;
+    int nLine = LockInLoop(cs1, 3);
+    BOOST_CHECK_EQUAL(FindLockSite(nLine).nAcquired, 3U);
+
+    bool fTake = false;
+    if (fTake)
+        LOCK2(cs1, cs2);
+    bool fFree = false;
+    boost::thread thread([&] {
+        TRY_LOCK(cs1, lock1);
+        TRY_LOCK(cs2, lock2);
+        fFree = lock1 && lock2;
+    });
+    thread.join();
+    BOOST_CHECK(fFree);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "pubkey.h"
 #include "txmempool.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
@@ -83,4 +84,62 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+static bool
+CheckInputSignature(const CTransaction& tx, const CScript& scriptPubKey, bool fStore)
+{
+    PrecomputedTransactionData txdata(tx);
+    CachingTransactionSignatureChecker checker(&tx, 0, 0, fStore, txdata);
+    return VerifyScript(tx.vin[0].scriptSig, scriptPubKey, NULL, SCRIPT_VERIFY_P2SH, checker);
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_sigcache_hit_rate, BasicTestingSetup)
+{
+    // Signatures checked on mempool acceptance (store=true) must be found again
+    // when the same transactions are connected in a block (store=false), which
+    // also marks them for eviction since they will not be needed any more.
+    const int nTx = 200;
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+    std::vector<CTransaction> txs;
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = CENT;
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        tx.vin[0].scriptSig << vchSig;
+        txs.push_back(tx);
+    }
+
+    // Mempool acceptance: every lookup misses and the result is stored.
+    SignatureCacheStats start = GetSignatureCacheStats();
+    for (const CTransaction& tx : txs)
+        BOOST_CHECK(CheckInputSignature(tx, scriptPubKey, true));
+    SignatureCacheStats mempool = GetSignatureCacheStats();
+    BOOST_CHECK_EQUAL(mempool.nHits - start.nHits, 0U);
+    BOOST_CHECK_EQUAL(mempool.nMisses - start.nMisses, (uint64_t)nTx);
+
+    // Block connection: every lookup hits.
+    for (const CTransaction& tx : txs)
+        BOOST_CHECK(CheckInputSignature(tx, scriptPubKey, false));
+    SignatureCacheStats block = GetSignatureCacheStats();
+    uint64_t nHits = block.nHits - mempool.nHits;
+    uint64_t nLookups = nHits + block.nMisses - mempool.nMisses;
+    BOOST_TEST_MESSAGE(strprintf("signature cache hit rate on block connection: %.1f%% (%u/%u)",
+        100.0 * nHits / nLookups, nHits, nLookups));
+    BOOST_CHECK_EQUAL(nHits, (uint64_t)nTx);
+
+    // A bad signature is never served from the cache.
+    CMutableTransaction txBad(txs[0]);
+    txBad.vout[0].nValue += 1;
+    BOOST_CHECK(!CheckInputSignature(txBad, scriptPubKey, true));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,16 +6,23 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "compressor.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+
 #include <boost/thread.hpp>
 
 using namespace std;
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -27,16 +34,113 @@ static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+namespace {
+
+/** Key of the record of an unspent output in the coin database */
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/**
+ * Per-transaction record written by older versions, only read to upgrade.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 0: IsCoinBase()
+ * - bit 1: vout[0] is not spent
+ * - bit 2: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 1 and bit 2 are unset, they encode N-1, as there must be at
+ *     least one non-spent output.
+ */
+class CCoins
 {
+public:
+    bool fCoinBase;
+    std::vector<CTxOut> vout;
+    int nHeight;
+
+    CCoins() : fCoinBase(false), nHeight(0) {}
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+
+/** Add the changed entries of mapCoins to batch. Returns the number of changed entries. */
+size_t BatchWriteCoins(CDBBatch &batch, const CCoinsMap &mapCoins)
+{
+    size_t changed = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
+            else
+                batch.Write(entry, it->second.coin);
+            changed++;
+        }
+    }
+    return changed;
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBOptions& dbOptions) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, dbOptions) 
+{
+}
+
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
+}
+
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -48,28 +152,371 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
-    size_t count = 0;
-    size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
-            else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
-            changed++;
-        }
-        count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
-    }
+    size_t count = mapCoins.size();
+    size_t changed = BatchWriteCoins(batch, mapCoins);
+    mapCoins.clear();
+    if (!hashBlock.IsNull())
+        batch.Write(DB_BEST_BLOCK, hashBlock);
+
+    LogPrint("coindb", "Committing %u changed outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    return db.WriteBatch(batch);
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    CDBBatch batch(db);
+    size_t changed = BatchWriteCoins(batch, mapCoins);
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)mapCoins.size());
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid())
+        return true;
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    static const size_t nBatchSize = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<char, uint256> key;
+    std::pair<char, uint256> prev_key = make_pair(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        if (!pcursor->GetKey(key) || key.first != DB_COINS)
+            break;
+        if (count++ % 256 == 0) {
+            // Records are in txid order, so the leading bytes tell how far along we are.
+            uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+            int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+            uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+            if (reportDone < percentageDone / 10) {
+                // report max. every 10% step
+                LogPrintf("[%d%%]...", percentageDone);
+                reportDone = percentageDone / 10;
+            }
+        }
+        CCoins old_coins;
+        if (!pcursor->GetValue(old_coins))
+            return error("%s: cannot parse CCoins record", __func__);
+        COutPoint outpoint(key.second, 0);
+        for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+            if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                outpoint.n = i;
+                CoinEntry entry(&outpoint);
+                batch.Write(entry, newcoin);
+            }
+        }
+        batch.Erase(key);
+        if (batch.SizeEstimate() > nBatchSize) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+            db.CompactRange(prev_key, key);
+            prev_key = key;
+        }
+        pcursor->Next();
+    }
+    if (!db.WriteBatch(batch))
+        return false;
+    db.CompactRange(prev_key, key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsViewDB *dbIn) : CCoinsViewBacked(dbIn), db(dbIn), fPending(false), fFailed(false), fStop(false)
+{
+    thread = boost::thread(boost::bind(&TraceThread<boost::function<void()> >, "coinwrite", boost::function<void()>(boost::bind(&CCoinsViewWriteBehind::ThreadWrite, this))));
+}
+
+CCoinsViewWriteBehind::~CCoinsViewWriteBehind()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+void CCoinsViewWriteBehind::ThreadWrite()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (true) {
+        while (!fPending && !fStop)
+            cond.wait(lock);
+        // Whatever was handed off is written before stopping.
+        if (!fPending)
+            return;
+
+        // BatchWrite does not touch mapPending while a write is pending, so
+        // it can be read without the lock, concurrently with lookups.
+        lock.unlock();
+        int64_t nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = db->WriteCoins(mapPending, hashPendingBlock);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        LogPrint("coindb", "Background write of %u outputs took %.2fms\n", (unsigned int)mapPending.size(), 0.001 * (GetTimeMicros() - nStart));
+        lock.lock();
+
+        if (!fOk) {
+            LogPrintf("%s: failed to write to coin database\n", __func__);
+            fFailed = true;
+        }
+        mapPending.clear();
+        fPending = false;
+        cond.notify_all();
+    }
+}
+
+bool CCoinsViewWriteBehind::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(outpoint);
+            if (it != mapPending.end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewWriteBehind::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(outpoint);
+            if (it != mapPending.end())
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewWriteBehind::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending && !hashPendingBlock.IsNull())
+            return hashPendingBlock;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fPending)
+        cond.wait(lock);
+    if (fFailed)
+        return false;
+    mapPending.swap(mapCoins);
+    hashPendingBlock = hashBlock;
+    fPending = true;
+    cond.notify_all();
+    return true;
+}
+
+CCoinsViewCursor *CCoinsViewWriteBehind::Cursor() const {
+    Sync();
+    return base->Cursor();
+}
+
+bool CCoinsViewWriteBehind::Sync() const {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fPending)
+        cond.wait(lock);
+    return !fFailed;
+}
+
+CCoinsViewPrefetch::CCoinsViewPrefetch(CCoinsView *baseIn, int nThreads, size_t nMaxUsageIn, size_t nMaxQueueIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0), nMaxUsage(nMaxUsageIn), nMaxQueue(nMaxQueueIn), nWriteSequence(0), nHits(0), fStop(false)
+{
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "prefetch", boost::function<void()>(boost::bind(&CCoinsViewPrefetch::ThreadPrefetch, this))));
+}
+
+CCoinsViewPrefetch::~CCoinsViewPrefetch()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    threads.join_all();
+}
+
+void CCoinsViewPrefetch::ThreadPrefetch()
+{
+    // Outpoints taken off the queue at a time
+    static const size_t nBatchSize = 16;
+    std::vector<COutPoint> vBatch;
+    std::vector<std::pair<COutPoint, Coin> > vFound;
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (true) {
+        // Wait for the coins already read to be used before reading more.
+        while ((queue.empty() || PrefetchedUsage() > nMaxUsage) && !fStop)
+            cond.wait(lock);
+        if (fStop)
+            return;
+
+        vBatch.clear();
+        while (!queue.empty() && vBatch.size() < nBatchSize) {
+            vBatch.push_back(queue.front());
+            queue.pop_front();
+        }
+        uint64_t nSequence = nWriteSequence;
+
+        lock.unlock();
+        vFound.clear();
+        for (const COutPoint& outpoint : vBatch) {
+            Coin coin;
+            try {
+                if (base->GetCoin(outpoint, coin) && !coin.IsSpent())
+                    vFound.push_back(std::make_pair(outpoint, std::move(coin)));
+            } catch (const std::runtime_error& e) {
+                // Leave it to the actual lookup to deal with read errors.
+                LogPrint("coindb", "%s: %s\n", __func__, e.what());
+            }
+        }
+        lock.lock();
+
+        // A write may have changed the coins after they were read.
+        if (nSequence != nWriteSequence)
+            continue;
+        for (std::pair<COutPoint, Coin>& found : vFound) {
+            std::pair<CCoinsMap::iterator, bool> ret = mapPrefetched.insert(std::make_pair(found.first, CCoinsCacheEntry()));
+            if (ret.second) {
+                ret.first->second.coin = std::move(found.second);
+                cachedCoinsUsage += ret.first->second.coin.DynamicMemoryUsage();
+                queuePrefetched.push_back(found.first);
+            }
+        }
+        // Forget the outpoints of coins that were used since, once they make
+        // up most of the order.
+        if (queuePrefetched.size() > 2 * mapPrefetched.size() + nBatchSize) {
+            std::deque<COutPoint> queueKept;
+            for (const COutPoint& outpoint : queuePrefetched) {
+                if (mapPrefetched.count(outpoint))
+                    queueKept.push_back(outpoint);
+            }
+            queuePrefetched.swap(queueKept);
+        }
+    }
+}
+
+void CCoinsViewPrefetch::EraseCoin(CCoinsMap::iterator it) const {
+    bool fFull = PrefetchedUsage() > nMaxUsage;
+    cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    mapPrefetched.erase(it);
+    if (mapPrefetched.empty())
+        mapPrefetched.clear(); // give the arena back
+    if (fFull && PrefetchedUsage() <= nMaxUsage)
+        cond.notify_all();
+}
+
+bool CCoinsViewPrefetch::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::iterator it = mapPrefetched.find(outpoint);
+        if (it != mapPrefetched.end()) {
+            // The cache above keeps the coin from now on.
+            coin = std::move(it->second.coin);
+            EraseCoin(it);
+            nHits++;
+            return true;
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewPrefetch::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (mapPrefetched.count(outpoint))
+            return true;
+    }
+    return base->HaveCoin(outpoint);
+}
+
+bool CCoinsViewPrefetch::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        nWriteSequence++;
+        if (!mapPrefetched.empty()) {
+            for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+                if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                    continue;
+                CCoinsMap::iterator itPrefetched = mapPrefetched.find(it->first);
+                if (itPrefetched != mapPrefetched.end())
+                    EraseCoin(itPrefetched);
+            }
+        }
+    }
+    bool fOk = base->BatchWrite(mapCoins, hashBlock);
+    {
+        // Reads that started during the write may have seen either version.
+        boost::unique_lock<boost::mutex> lock(cs);
+        nWriteSequence++;
+    }
+    return fOk;
+}
+
+void CCoinsViewPrefetch::Prefetch(const std::vector<COutPoint> &vOutpoints) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        // Blocks are connected in order and use up their coins, so the
+        // oldest coins left are the ones least likely to be used.
+        unsigned int nDropped = 0;
+        while (PrefetchedUsage() > nMaxUsage && !queuePrefetched.empty()) {
+            CCoinsMap::iterator it = mapPrefetched.find(queuePrefetched.front());
+            queuePrefetched.pop_front();
+            if (it != mapPrefetched.end()) {
+                EraseCoin(it);
+                nDropped++;
+            }
+        }
+        if (nDropped)
+            LogPrint("coindb", "Dropped %u unused prefetched coins\n", nDropped);
+        for (const COutPoint& outpoint : vOutpoints) {
+            if (queue.size() >= nMaxQueue)
+                break;
+            if (!mapPrefetched.count(outpoint))
+                queue.push_back(outpoint);
+        }
+    }
+    cond.notify_all();
+}
+
+size_t CCoinsViewPrefetch::PrefetchedUsage() const {
+    // The map reuses the room of erased entries, so count the entries it
+    // holds rather than what it has allocated.
+    return mapPrefetched.size() * sizeof(CCoinsMap::value_type) + cachedCoinsUsage;
+}
+
+size_t CCoinsViewPrefetch::DynamicMemoryUsage() const {
+    boost::unique_lock<boost::mutex> lock(cs);
+    return memusage::DynamicUsage(mapPrefetched) + cachedCoinsUsage;
+}
+
+uint64_t CCoinsViewPrefetch::GetHits() const {
+    boost::unique_lock<boost::mutex> lock(cs);
+    return nHits;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBOptions& dbOptions) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, dbOptions) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -98,25 +545,31 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
+    if (keyTmp.first == DB_COIN) {
         key = keyTmp.second;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
 {
-    return pcursor->GetValue(coins);
+    return pcursor->GetValue(coin);
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
@@ -126,14 +579,18 @@ unsigned int CCoinsViewDBCursor::GetValueSize() const
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return keyTmp.first == DB_COIN;
 }
 
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
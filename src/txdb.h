@@ -10,12 +10,16 @@
 #include "dbwrapper.h"
 #include "chain.h"
 
+#include <deque>
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -27,6 +31,16 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -backgroundflush default
+static const bool DEFAULT_BACKGROUND_FLUSH = true;
+//! -prefetchthreads default
+static const int DEFAULT_PREFETCH_THREADS = 4;
+//! max. -prefetchthreads
+static const int MAX_PREFETCH_THREADS = 16;
+//! Memory the prefetcher may hold in coins that have not been used yet
+static const size_t MAX_PREFETCH_USAGE = 32 << 20;
+//! Outpoints the prefetcher may have waiting to be read
+static const size_t MAX_PREFETCH_QUEUE = 1 << 17;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -53,19 +67,134 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/** CCoinsView backed by the coin database (chainstate/)
+ *
+ * Unspent outputs are stored as one record per output, keyed by outpoint, so
+ * spending an output only erases its own record instead of rewriting the
+ * remaining outputs of its transaction.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBOptions& dbOptions = CDBOptions());
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    //! Like BatchWrite, but leaves mapCoins untouched.
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Convert per-transaction records of an older database to per-output records.
+    bool Upgrade();
+
+    //! Compact the raw keys from *pbegin to *pend of the database (NULL for no bound).
+    void CompactRawRange(const std::string* pbegin, const std::string* pend) const { db.CompactRawRange(pbegin, pend); }
+    std::vector<int> GetFilesPerLevel() const { return db.GetFilesPerLevel(); }
+};
+
+/**
+ * CCoinsView that hands flushed cache entries to a background thread, which
+ * writes them to the coin database while validation continues on the emptied
+ * cache above. Until the write has been committed, lookups are answered from
+ * the handed off entries first.
+ *
+ * The entries and the best block marker go to the database in one batch, so
+ * after a crash the coin database is consistent at the last block whose write
+ * completed, and the blocks after it are connected again on startup.
+ */
+class CCoinsViewWriteBehind : public CCoinsViewBacked
+{
+private:
+    CCoinsViewDB *db;
+
+    mutable boost::mutex cs;
+    mutable boost::condition_variable cond;
+    //! Entries being written, only modified by BatchWrite while no write is pending
+    CCoinsMap mapPending;
+    uint256 hashPendingBlock;
+    bool fPending;
+    bool fFailed;
+    bool fStop;
+    boost::thread thread;
+
+    void ThreadWrite();
+
+public:
+    CCoinsViewWriteBehind(CCoinsViewDB *dbIn);
+    ~CCoinsViewWriteBehind();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    uint256 GetBestBlock() const;
+    //! Takes over all of mapCoins, after waiting for the previous write to finish.
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    CCoinsViewCursor *Cursor() const;
+
+    //! Wait until everything handed off has been written. Returns false if a write failed.
+    bool Sync() const;
+};
+
+/**
+ * CCoinsView that reads coins ahead of their use on a pool of worker threads.
+ *
+ * Prefetch() queues outpoints, typically the inputs of a block that was just
+ * stored, and the workers read them from the view below in parallel. Coins
+ * found are held until GetCoin hands them to the cache above, which then only
+ * has to take them from memory instead of waiting for a database read.
+ *
+ * Coins that are written through BatchWrite are dropped from the prefetched
+ * ones, and reads that overlap a write are discarded, so GetCoin always
+ * answers the same as the view below would.
+ *
+ * The workers stop reading while the prefetched coins use more than
+ * nMaxUsage, and at most nMaxQueue outpoints wait to be read. Prefetch()
+ * makes room for new coins by dropping the oldest ones, which belong to
+ * blocks that were stored but not connected.
+ */
+class CCoinsViewPrefetch : public CCoinsViewBacked
+{
+private:
+    mutable boost::mutex cs;
+    mutable boost::condition_variable cond;
+    //! Outpoints waiting to be read, oldest first
+    std::deque<COutPoint> queue;
+    //! Coins read but not used yet
+    mutable CCoinsMap mapPrefetched;
+    mutable size_t cachedCoinsUsage;
+    //! Outpoints in the order their coins were prefetched; may name coins that were used since
+    std::deque<COutPoint> queuePrefetched;
+    const size_t nMaxUsage;
+    const size_t nMaxQueue;
+    //! Changed by every write, to tell reads that may have raced one
+    uint64_t nWriteSequence;
+    mutable uint64_t nHits;
+    bool fStop;
+    boost::thread_group threads;
+
+    void ThreadPrefetch();
+    size_t PrefetchedUsage() const;
+    void EraseCoin(CCoinsMap::iterator it) const;
+
+public:
+    CCoinsViewPrefetch(CCoinsView *baseIn, int nThreads, size_t nMaxUsageIn = MAX_PREFETCH_USAGE, size_t nMaxQueueIn = MAX_PREFETCH_QUEUE);
+    ~CCoinsViewPrefetch();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Queue outpoints to be read by the workers.
+    void Prefetch(const std::vector<COutPoint> &vOutpoints);
+
+    //! Memory allocated for prefetched coins
+    size_t DynamicMemoryUsage() const;
+    //! Number of lookups answered from prefetched coins
+    uint64_t GetHits() const;
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -74,8 +203,8 @@ class CCoinsViewDBCursor: public CCoinsViewCursor
 public:
     ~CCoinsViewDBCursor() {}
 
-    bool GetKey(uint256 &key) const;
-    bool GetValue(CCoins &coins) const;
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -85,7 +214,7 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
         CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    std::pair<char, COutPoint> keyTmp;
 
     friend class CCoinsViewDB;
 };
@@ -94,7 +223,7 @@ private:
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBOptions& dbOptions = CDBOptions());
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
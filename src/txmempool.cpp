@@ -44,6 +44,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    vTxHashesIdx = 0;
+    nEpoch = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -83,13 +86,17 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const EpochGuard epoch(*this);
+    std::vector<txiter> vStage, vAllDescendants;
+    BOOST_FOREACH(const txiter childEntry, GetMemPoolChildren(updateIt)) {
+        visited(childEntry);
+        vStage.push_back(childEntry);
+    }
 
-    while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
+    while (!vStage.empty()) {
+        const txiter cit = vStage.back();
+        vStage.pop_back();
+        vAllDescendants.push_back(cit);
         const setEntries &setChildren = GetMemPoolChildren(cit);
         BOOST_FOREACH(const txiter childEntry, setChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
@@ -97,25 +104,27 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
                 // We've already calculated this one, just add the entries for this set
                 // but don't traverse again.
                 BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+                    if (!visited(cacheEntry))
+                        vAllDescendants.push_back(cacheEntry);
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
+            } else if (!visited(childEntry)) {
                 // Schedule for later processing
-                stageEntries.insert(childEntry);
+                vStage.push_back(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
-    // Update and add to cached descendant map
+    // vAllDescendants now contains all in-mempool descendants of updateIt,
+    // each of them once. Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    BOOST_FOREACH(txiter cit, setAllDescendants) {
+    std::vector<txiter> &vCached = cachedDescendants[updateIt];
+    BOOST_FOREACH(txiter cit, vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            vCached.push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
@@ -146,25 +155,27 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // setMemPoolChildren will be updated, an assumption made in
     // UpdateForDescendants.
     BOOST_REVERSE_FOREACH(const uint256 &hash, vHashesToUpdate) {
-        // we cache the in-mempool children to avoid duplicate updates
-        setEntries setChildren;
         // calculate children from mapNextTx
         txiter it = mapTx.find(hash);
         if (it == mapTx.end()) {
             continue;
         }
-        auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
-        // First calculate the children, and update setMemPoolChildren to
-        // include them, and update their setMemPoolParents to include this tx.
-        for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
-            const uint256 &childHash = iter->second->GetHash();
-            txiter childIter = mapTx.find(childHash);
-            assert(childIter != mapTx.end());
-            // We can skip updating entries we've encountered before or that
-            // are in the block (which are already accounted for).
-            if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
-                UpdateChild(it, childIter, true);
-                UpdateParent(childIter, it, true);
+        {
+            // we mark the in-mempool children to avoid duplicate updates
+            const EpochGuard epoch(*this);
+            auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
+            // First calculate the children, and update setMemPoolChildren to
+            // include them, and update their setMemPoolParents to include this tx.
+            for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
+                const uint256 &childHash = iter->second->GetHash();
+                txiter childIter = mapTx.find(childHash);
+                assert(childIter != mapTx.end());
+                // We can skip updating entries we've encountered before or that
+                // are in the block (which are already accounted for).
+                if (!visited(childIter) && !setAlreadyIncluded.count(childHash)) {
+                    UpdateChild(it, childIter, true);
+                    UpdateParent(childIter, it, true);
+                }
             }
         }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
@@ -173,18 +184,24 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
-    setEntries parentHashes;
+    const EpochGuard epoch(*this);
+    // Ancestors found but not walked yet; each entry is marked visited when
+    // it is staged, so it is staged only once.
+    std::vector<txiter> vStage;
     const CTransaction &tx = entry.GetTx();
 
+    BOOST_FOREACH(txiter ancestor, setAncestors)
+        visited(ancestor);
+
     if (fSearchForParents) {
         // Get parents of this transaction that are in the mempool
         // GetMemPoolParents() is only valid for entries in the mempool, so we
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
-                if (parentHashes.size() + 1 > limitAncestorCount) {
+            if (piter != mapTx.end() && !visited(piter)) {
+                vStage.push_back(piter);
+                if (vStage.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
                 }
@@ -194,16 +211,19 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        BOOST_FOREACH(txiter piter, GetMemPoolParents(it)) {
+            if (!visited(piter))
+                vStage.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
-    while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+    while (!vStage.empty()) {
+        txiter stageit = vStage.back();
+        vStage.pop_back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -220,10 +240,10 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
         BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!visited(phash)) {
+                vStage.push_back(phash);
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (vStage.size() + setAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
@@ -233,9 +253,10 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
     return true;
 }
 
-void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
+template<typename Entries>
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, const Entries &ancestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const setEntries &parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     BOOST_FOREACH(txiter piter, parentIters) {
         UpdateChild(piter, it, add);
@@ -243,7 +264,7 @@ void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors
     const int64_t updateCount = (add ? 1 : -1);
     const int64_t updateSize = updateCount * it->GetTxSize();
     const CAmount updateFee = updateCount * it->GetModifiedFee();
-    BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+    BOOST_FOREACH(txiter ancestorIt, ancestors) {
         mapTx.modify(ancestorIt, update_descendant_state(updateSize, updateFee, updateCount));
     }
 }
@@ -270,11 +291,10 @@ void CTxMemPool::UpdateChildrenForRemoval(txiter it)
     }
 }
 
-void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants)
+void CTxMemPool::UpdateForRemoveFromMempool(const vecEntries &entriesToRemove, bool updateDescendants)
 {
     // For each entry, walk back all ancestors and decrement size associated with this
     // transaction
-    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
     if (updateDescendants) {
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
@@ -283,25 +303,25 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
         BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-            setEntries setDescendants;
-            CalculateDescendants(removeIt, setDescendants);
-            setDescendants.erase(removeIt); // don't update state for self
+            vecEntries vDescendants;
+            {
+                const EpochGuard epoch(*this);
+                CalculateDescendants(removeIt, vDescendants);
+            }
             int64_t modifySize = -((int64_t)removeIt->GetTxSize());
             CAmount modifyFee = -removeIt->GetModifiedFee();
             int modifySigOps = -removeIt->GetSigOpCost();
-            BOOST_FOREACH(txiter dit, setDescendants) {
-                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
+            // The first entry is removeIt itself, whose state we don't update
+            for (unsigned int i = 1; i < vDescendants.size(); i++) {
+                mapTx.modify(vDescendants[i], update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
             }
         }
     }
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
-        setEntries setAncestors;
-        const CTxMemPoolEntry &entry = *removeIt;
-        std::string dummy;
-        // Since this is a tx that is already in the mempool, we can call CMPA
-        // with fSearchForParents = false.  If the mempool is in a consistent
-        // state, then using true or false should both be correct, though false
-        // should be a bit faster.
+        vecEntries vAncestors;
+        // Walk the ancestors as linked in mapLinks rather than searching the
+        // inputs for in-mempool parents. If the mempool is in a consistent
+        // state, then both give the same answer.
         // However, if we happen to be in the middle of processing a reorg, then
         // the mempool can be in an inconsistent state.  In this case, the set
         // of ancestors reachable via mapLinks will be the same as the set of 
@@ -315,10 +335,13 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // differ from the set of mempool parents we'd calculate by searching,
         // and it's important that we use the mapLinks[] notion of ancestor
         // transactions as the set of things to update for removal.
-        CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        {
+            const EpochGuard epoch(*this);
+            CalculateAncestors(removeIt, vAncestors);
+        }
         // Note that UpdateAncestorsOf severs the child links that point to
         // removeIt in the entries for the parents of removeIt.
-        UpdateAncestorsOf(false, removeIt, setAncestors);
+        UpdateAncestorsOf(false, removeIt, vAncestors);
     }
     // After updating all the ancestor sizes, we can now sever the link between each
     // transaction being removed and any mempool children (ie, update setMemPoolParents
@@ -349,7 +372,7 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nCurrentEpoch(0), fHasEpochGuard(false)
 {
     _clear(); //lock free clear
 
@@ -367,17 +390,22 @@ CTxMemPool::~CTxMemPool()
     delete minerPolicyEstimator;
 }
 
-void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
+CTxMemPool::EpochGuard::EpochGuard(const CTxMemPool& in) : pool(in)
 {
-    LOCK(cs);
+    assert(!pool.fHasEpochGuard);
+    ++pool.nCurrentEpoch;
+    pool.fHasEpochGuard = true;
+}
 
-    auto it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
+CTxMemPool::EpochGuard::~EpochGuard()
+{
+    pool.fHasEpochGuard = false;
+}
 
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first->hash == hashTx) {
-        coins.Spend(it->first->n); // and remove those outputs from coins
-        it++;
-    }
+bool CTxMemPool::isSpent(const COutPoint& outpoint)
+{
+    LOCK(cs);
+    return mapNextTx.count(outpoint);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -447,11 +475,14 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     vTxHashes.emplace_back(hash, newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
 
+    NotifyEntryAdded(newit);
     return true;
 }
 
 void CTxMemPool::removeUnchecked(txiter it)
 {
+    NotifyEntryRemoved(it);
+
     const uint256 hash = it->GetTx().GetHash();
     BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
@@ -482,23 +513,47 @@ void CTxMemPool::removeUnchecked(txiter it)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+    vecEntries vDescendants;
+    {
+        const EpochGuard epoch(*this);
+        BOOST_FOREACH(txiter it, setDescendants)
+            visited(it);
+        CalculateDescendants(entryit, vDescendants);
     }
-    // Traverse down the children of entry, only adding children that are not
-    // accounted for in setDescendants already (because those children have either
-    // already been walked, or will be walked in this iteration).
-    while (!stage.empty()) {
-        txiter it = *stage.begin();
-        setDescendants.insert(it);
-        stage.erase(it);
-
-        const setEntries &setChildren = GetMemPoolChildren(it);
+    setDescendants.insert(vDescendants.begin(), vDescendants.end());
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, vecEntries &vDescendants) const
+{
+    if (visited(entryit))
+        return;
+    // Entries past i have been found but their children not looked at yet.
+    unsigned int i = vDescendants.size();
+    vDescendants.push_back(entryit);
+    for (; i < vDescendants.size(); i++) {
+        const setEntries &setChildren = GetMemPoolChildren(vDescendants[i]);
         BOOST_FOREACH(const txiter &childiter, setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
-            }
+            if (!visited(childiter))
+                vDescendants.push_back(childiter);
+        }
+    }
+}
+
+void CTxMemPool::CalculateAncestors(txiter entryit, vecEntries &vAncestors) const
+{
+    visited(entryit);
+    // Entries from i on have been found but their parents not looked at yet.
+    unsigned int i = vAncestors.size();
+    const setEntries &setParents = GetMemPoolParents(entryit);
+    BOOST_FOREACH(const txiter &parentiter, setParents) {
+        if (!visited(parentiter))
+            vAncestors.push_back(parentiter);
+    }
+    for (; i < vAncestors.size(); i++) {
+        const setEntries &setGrandParents = GetMemPoolParents(vAncestors[i]);
+        BOOST_FOREACH(const txiter &parentiter, setGrandParents) {
+            if (!visited(parentiter))
+                vAncestors.push_back(parentiter);
         }
     }
 }
@@ -508,32 +563,31 @@ void CTxMemPool::removeRecursive(const CTransaction &origTx, std::list<CTransact
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        setEntries txToRemove;
-        txiter origit = mapTx.find(origTx.GetHash());
-        if (origit != mapTx.end()) {
-            txToRemove.insert(origit);
-        } else {
-            // When recursively removing but origTx isn't in the mempool
-            // be sure to remove any children that are in the pool. This can
-            // happen during chain re-orgs if origTx isn't re-accepted into
-            // the mempool for any reason.
-            for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                auto it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
-                if (it == mapNextTx.end())
-                    continue;
-                txiter nextit = mapTx.find(it->second->GetHash());
-                assert(nextit != mapTx.end());
-                txToRemove.insert(nextit);
+        vecEntries vAllRemoves;
+        {
+            const EpochGuard epoch(*this);
+            txiter origit = mapTx.find(origTx.GetHash());
+            if (origit != mapTx.end()) {
+                CalculateDescendants(origit, vAllRemoves);
+            } else {
+                // When recursively removing but origTx isn't in the mempool
+                // be sure to remove any children that are in the pool. This can
+                // happen during chain re-orgs if origTx isn't re-accepted into
+                // the mempool for any reason.
+                for (unsigned int i = 0; i < origTx.vout.size(); i++) {
+                    auto it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                    if (it == mapNextTx.end())
+                        continue;
+                    txiter nextit = mapTx.find(it->second->GetHash());
+                    assert(nextit != mapTx.end());
+                    CalculateDescendants(nextit, vAllRemoves);
+                }
             }
         }
-        setEntries setAllRemoves;
-        BOOST_FOREACH(txiter it, txToRemove) {
-            CalculateDescendants(it, setAllRemoves);
-        }
-        BOOST_FOREACH(txiter it, setAllRemoves) {
+        BOOST_FOREACH(txiter it, vAllRemoves) {
             removed.push_back(it->GetTx());
         }
-        RemoveStaged(setAllRemoves, false);
+        RemoveStaged(vAllRemoves, false);
     }
 }
 
@@ -555,9 +609,9 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
                 indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
                 if (it2 != mapTx.end())
                     continue;
-                const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
-		if (nCheckFrequency != 0) assert(coins);
-                if (!coins || (coins->IsCoinBase() && ((signed long)nMemPoolHeight) - coins->nHeight < COINBASE_MATURITY)) {
+                const Coin &coin = pcoins->AccessCoin(txin.prevout);
+                if (nCheckFrequency != 0) assert(!coin.IsSpent());
+                if (coin.IsSpent() || (coin.IsCoinBase() && ((signed long)nMemPoolHeight) - coin.nHeight < COINBASE_MATURITY)) {
                     transactionsToRemove.push_back(tx);
                     break;
                 }
@@ -611,8 +665,8 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     {
         txiter it = mapTx.find(tx.GetHash());
         if (it != mapTx.end()) {
-            setEntries stage;
-            stage.insert(it);
+            vecEntries stage;
+            stage.push_back(it);
             RemoveStaged(stage, true);
         }
         removeConflicts(tx, conflicts);
@@ -626,6 +680,8 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
 
 void CTxMemPool::_clear()
 {
+    for (txiter it = mapTx.begin(); it != mapTx.end(); it++)
+        NotifyEntryRemoved(it);
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
@@ -685,8 +741,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                     parentSigOpCost += it2->GetSigOpCost();
                 }
             } else {
-                const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
-                assert(coins && coins->IsAvailable(txin.prevout.n));
+                assert(pcoins->HaveCoin(txin.prevout));
             }
             // Check whether its inputs are marked in mapNextTx.
             auto it3 = mapNextTx.find(txin.prevout);
@@ -737,7 +792,8 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
-            assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, NULL));
+            PrecomputedTransactionData txdata(tx);
+            assert(CheckInputs(tx, state, mempoolDuplicate, false, 0, false, txdata, NULL));
             UpdateCoins(tx, mempoolDuplicate, 1000000);
         }
     }
@@ -751,7 +807,8 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove++;
             assert(stepsSinceLastRemove < waitingOnDependants.size());
         } else {
-            assert(CheckInputs(entry->GetTx(), state, mempoolDuplicate, false, 0, false, NULL));
+            PrecomputedTransactionData txdata(entry->GetTx());
+            assert(CheckInputs(entry->GetTx(), state, mempoolDuplicate, false, 0, false, txdata, NULL));
             UpdateCoins(entry->GetTx(), mempoolDuplicate, 1000000);
             stepsSinceLastRemove = 0;
         }
@@ -964,20 +1021,24 @@ bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
 
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
-bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
+bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
-    shared_ptr<const CTransaction> ptx = mempool.get(txid);
+    shared_ptr<const CTransaction> ptx = mempool.get(outpoint.hash);
     if (ptx) {
-        coins = CCoins(*ptx, MEMPOOL_HEIGHT);
-        return true;
+        if (outpoint.n < ptx->vout.size()) {
+            coin = Coin(ptx->vout[outpoint.n], MEMPOOL_HEIGHT, false);
+            return true;
+        } else {
+            return false;
+        }
     }
-    return (base->GetCoins(txid, coins) && !coins.IsPruned());
+    return (base->GetCoin(outpoint, coin) && !coin.IsSpent());
 }
 
-bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
-    return mempool.exists(txid) || base->HaveCoins(txid);
+bool CCoinsViewMemPool::HaveCoin(const COutPoint &outpoint) const {
+    return mempool.exists(outpoint) || base->HaveCoin(outpoint);
 }
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
@@ -987,6 +1048,14 @@ size_t CTxMemPool::DynamicMemoryUsage() const {
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants) {
+    vecEntries vStage;
+    vStage.reserve(stage.size());
+    BOOST_FOREACH(txiter it, stage)
+        vStage.push_back(it);
+    RemoveStaged(vStage, updateDescendants);
+}
+
+void CTxMemPool::RemoveStaged(const vecEntries &stage, bool updateDescendants) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
     BOOST_FOREACH(const txiter& it, stage) {
@@ -997,14 +1066,13 @@ void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants) {
 int CTxMemPool::Expire(int64_t time) {
     LOCK(cs);
     indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
-    setEntries toremove;
-    while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
-        toremove.insert(mapTx.project<0>(it));
-        it++;
-    }
-    setEntries stage;
-    BOOST_FOREACH(txiter removeit, toremove) {
-        CalculateDescendants(removeit, stage);
+    vecEntries stage;
+    {
+        const EpochGuard epoch(*this);
+        while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
+            CalculateDescendants(mapTx.project<0>(it), stage);
+            it++;
+        }
     }
     RemoveStaged(stage, false);
     return stage.size();
@@ -1088,7 +1156,7 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
-void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining) {
+void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining, std::vector<std::shared_ptr<const CTransaction> >* pvTxnRemoved) {
     LOCK(cs);
 
     unsigned nTxnRemoved = 0;
@@ -1105,8 +1173,11 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRe
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
+        vecEntries stage;
+        {
+            const EpochGuard epoch(*this);
+            CalculateDescendants(mapTx.project<0>(it), stage);
+        }
         nTxnRemoved += stage.size();
 
         std::vector<CTransaction> txn;
@@ -1115,15 +1186,17 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRe
             BOOST_FOREACH(txiter it, stage)
                 txn.push_back(it->GetTx());
         }
+        if (pvTxnRemoved) {
+            BOOST_FOREACH(txiter it, stage)
+                pvTxnRemoved->push_back(it->GetSharedTx());
+        }
         RemoveStaged(stage, false);
         if (pvNoSpendsRemaining) {
             BOOST_FOREACH(const CTransaction& tx, txn) {
                 BOOST_FOREACH(const CTxIn& txin, tx.vin) {
                     if (exists(txin.prevout.hash))
                         continue;
-                    auto it = mapNextTx.lower_bound(COutPoint(txin.prevout.hash, 0));
-                    if (it == mapNextTx.end() || it->first->hash != txin.prevout.hash)
-                        pvNoSpendsRemaining->push_back(txin.prevout.hash);
+                    pvNoSpendsRemaining->push_back(txin.prevout);
                 }
             }
         }
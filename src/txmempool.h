@@ -13,6 +13,7 @@
 #include "amount.h"
 #include "coins.h"
 #include "indirectmap.h"
+#include "prevector.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
@@ -21,6 +22,8 @@
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
 
+#include <boost/signals2/signal.hpp>
+
 class CAutoFile;
 class CBlockIndex;
 
@@ -36,7 +39,7 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
+/** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 struct LockPoints
@@ -153,6 +156,7 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpoch; //!< Last traversal of the mempool graph that visited this entry
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -470,11 +474,36 @@ public:
         }
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    /** Entries collected by a walk; short walks stay on the stack. */
+    typedef prevector<16, txiter> vecEntries;
 
     const setEntries & GetMemPoolParents(txiter entry) const;
     const setEntries & GetMemPoolChildren(txiter entry) const;
+
+    /**
+     * Starts a walk over the transaction graph. While the guard is alive,
+     * visited() marks entries as seen, so a walk needs no set of its own to
+     * avoid visiting an entry twice. Walks cannot be nested, and need cs.
+     */
+    class EpochGuard {
+        const CTxMemPool& pool;
+    public:
+        EpochGuard(const CTxMemPool& in);
+        ~EpochGuard();
+    };
+
+    /** Mark an entry as seen by the current walk, returning whether it already was. */
+    bool visited(txiter it) const {
+        assert(fHasEpochGuard);
+        bool ret = it->nEpoch == nCurrentEpoch;
+        it->nEpoch = nCurrentEpoch;
+        return ret;
+    }
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, std::vector<txiter>, CompareIteratorByHash> cacheMap;
+
+    mutable uint64_t nCurrentEpoch; //!< Incremented at the start of each walk
+    mutable bool fHasEpochGuard; //!< Whether a walk is going on
 
     struct TxLinks {
         setEntries parents;
@@ -526,7 +555,7 @@ public:
     void _clear(); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
     void queryHashes(std::vector<uint256>& vtxid);
-    void pruneSpent(const uint256& hash, CCoins &coins);
+    bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
     /**
@@ -549,6 +578,7 @@ public:
      *  that any in-mempool descendants have their ancestor state updated.
      */
     void RemoveStaged(setEntries &stage, bool updateDescendants);
+    void RemoveStaged(const vecEntries &stage, bool updateDescendants);
 
     /** When adding transactions from a disconnected block back to the mempool,
      *  new mempool entries may have children in the mempool (which is generally
@@ -577,6 +607,9 @@ public:
      *  Assumes that setDescendants includes all in-mempool descendants of anything
      *  already in it.  */
     void CalculateDescendants(txiter it, setEntries &setDescendants);
+    /** Append it and all its in-mempool descendants the current walk has not
+     *  visited yet to vDescendants. Needs an EpochGuard. */
+    void CalculateDescendants(txiter it, vecEntries &vDescendants) const;
 
     /** The minimum fee to get into the mempool, which may itself not be enough
       *  for larger-sized transactions.
@@ -587,10 +620,11 @@ public:
     CFeeRate GetMinFee(size_t sizelimit) const;
 
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
-      *  pvNoSpendsRemaining, if set, will be populated with the list of transactions
+      *  pvNoSpendsRemaining, if set, will be populated with the list of outpoints
       *  which are not in mempool which no longer have any spends in this mempool.
+      *  pvTxnRemoved, if set, will be populated with the removed transactions.
       */
-    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL);
+    void TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining=NULL, std::vector<std::shared_ptr<const CTransaction> >* pvTxnRemoved=NULL);
 
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(int64_t time);
@@ -613,6 +647,13 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
+    bool exists(const COutPoint& outpoint) const
+    {
+        LOCK(cs);
+        auto it = mapTx.find(outpoint.hash);
+        return (it != mapTx.end() && outpoint.n < it->GetTx().vout.size());
+    }
+
     std::shared_ptr<const CTransaction> get(const uint256& hash) const;
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
@@ -641,6 +682,11 @@ public:
 
     size_t DynamicMemoryUsage() const;
 
+    /** Notifies listeners, with cs held, of an entry that has just been added
+     *  and linked to its in-mempool parents, and of one about to be removed. */
+    boost::signals2::signal<void (txiter)> NotifyEntryAdded;
+    boost::signals2::signal<void (txiter)> NotifyEntryRemoved;
+
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
      *  the descendants for a single transaction that has been added to the
@@ -658,14 +704,19 @@ private:
     void UpdateForDescendants(txiter updateIt,
             cacheMap &cachedDescendants,
             const std::set<uint256> &setExclude);
-    /** Update ancestors of hash to add/remove it as a descendant transaction. */
-    void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
+    /** Append the in-mempool ancestors of it, as linked in mapLinks, that the
+     *  current walk has not visited yet to vAncestors. Needs an EpochGuard. */
+    void CalculateAncestors(txiter it, vecEntries &vAncestors) const;
+    /** Update ancestors of hash to add/remove it as a descendant transaction.
+     *  ancestors is a setEntries or a vecEntries. */
+    template<typename Entries>
+    void UpdateAncestorsOf(bool add, txiter hash, const Entries &ancestors);
     /** Set ancestor state for an entry */
     void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors);
     /** For each transaction being removed, update ancestors and any direct children.
       * If updateDescendants is true, then also update in-mempool descendants'
       * ancestor state. */
-    void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants);
+    void UpdateForRemoveFromMempool(const vecEntries &entriesToRemove, bool updateDescendants);
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry);
 
@@ -691,8 +742,8 @@ protected:
 
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn);
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
 };
 
 // We want to sort transactions by coin age priority